@@ -0,0 +1,118 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_HISTOGRAM_HPP_
+#define DHARC_HISTOGRAM_HPP_
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace dharc {
+/**
+ * Lock-free log-linear histogram of unsigned values, in the style of an HDR
+ * histogram. Each power of two is split into kSubBuckets linear buckets so
+ * the relative error of any reported value is at most 1/kSubBuckets, over
+ * the full 64-bit range and in a fixed 4KB of counters. Recording is a single
+ * relaxed increment, cheap enough to leave on in hot paths.
+ */
+class Histogram {
+	public:
+	static constexpr size_t kSubBits = 3;
+	static constexpr size_t kSubBuckets = 1 << kSubBits;
+	static constexpr size_t kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+	Histogram() { reset(); }
+
+	Histogram(const Histogram&) = delete;
+	Histogram &operator=(const Histogram&) = delete;
+
+	void record(uint64_t v) {
+		buckets_[index(v)].fetch_add(1, std::memory_order_relaxed);
+		count_.fetch_add(1, std::memory_order_relaxed);
+		sum_.fetch_add(v, std::memory_order_relaxed);
+
+		uint64_t max = max_.load(std::memory_order_relaxed);
+		while (v > max && !max_.compare_exchange_weak(max, v,
+				std::memory_order_relaxed)) {}
+	}
+
+	void reset() {
+		for (auto &b : buckets_) b.store(0, std::memory_order_relaxed);
+		count_.store(0, std::memory_order_relaxed);
+		sum_.store(0, std::memory_order_relaxed);
+		max_.store(0, std::memory_order_relaxed);
+	}
+
+	uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+	uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+	double mean() const {
+		const uint64_t c = count();
+		if (c == 0) return 0.0;
+		return static_cast<double>(sum_.load(std::memory_order_relaxed)) /
+			static_cast<double>(c);
+	}
+
+	/**
+	 * Value at or below which the given fraction (0.0 to 1.0) of recorded
+	 * values fall. Reports the upper bound of the bucket concerned.
+	 */
+	uint64_t percentile(double p) const {
+		const uint64_t c = count();
+		if (c == 0) return 0;
+
+		uint64_t target = static_cast<uint64_t>(p * static_cast<double>(c));
+		if (target >= c) target = c - 1;
+
+		uint64_t seen = 0;
+		for (auto i = 0U; i < kBuckets; ++i) {
+			seen += buckets_[i].load(std::memory_order_relaxed);
+			if (seen > target) {
+				const uint64_t upper = (i + 1 < kBuckets) ?
+					bucketValue(i + 1) - 1 : UINT64_MAX;
+				return (upper < max()) ? upper : max();
+			}
+		}
+		return max();
+	}
+
+	/**
+	 * Copy out the raw bucket counts, see bucketValue for their ranges.
+	 */
+	std::vector<uint64_t> buckets() const {
+		std::vector<uint64_t> res(kBuckets);
+		for (auto i = 0U; i < kBuckets; ++i) {
+			res[i] = buckets_[i].load(std::memory_order_relaxed);
+		}
+		return res;
+	}
+
+	/**
+	 * Smallest value counted in a bucket.
+	 */
+	static constexpr uint64_t bucketValue(size_t i) {
+		return (i < kSubBuckets) ? i :
+			static_cast<uint64_t>(kSubBuckets + (i % kSubBuckets)) <<
+				(i / kSubBuckets - 1);
+	}
+
+	static size_t index(uint64_t v) {
+		if (v < kSubBuckets) return static_cast<size_t>(v);
+
+		const size_t e = 63 - __builtin_clzll(v);
+		const size_t sub = (v >> (e - kSubBits)) & (kSubBuckets - 1);
+		return (e - kSubBits + 1) * kSubBuckets + sub;
+	}
+
+	private:
+	std::atomic<uint64_t> buckets_[kBuckets];
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> max_;
+};
+};  // namespace dharc
+
+#endif  // DHARC_HISTOGRAM_HPP_
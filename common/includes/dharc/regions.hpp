@@ -5,11 +5,134 @@
 #ifndef DHARC_REGIONS_HPP_
 #define DHARC_REGIONS_HPP_
 
+#include <cstdint>
+
 namespace dharc {
 enum struct RegionID : uint64_t {
-	SENSE_CAMERA_0_LUMINANCE = 0
+	SENSE_CAMERA_0_LUMINANCE = 0,
+	INVALID = UINT64_MAX
 };
+
+/**
+ * Statistic: How much of a region the last process pass covered. Only
+ * meaningful when the region is processed under a time budget, otherwise
+ * every unit is processed each pass and nothing is ever deferred.
+ */
+struct Coverage {
+	uint64_t pass;       // Number of completed process passes.
+	uint32_t units;      // Total units in the region.
+	uint32_t processed;  // Units processed in the last pass.
+	uint32_t deferred;   // Units deferred to a later pass.
+	uint32_t maxage;     // Passes since the most starved unit was processed.
+	float cutoff;        // Salience of the least salient processed unit.
 };
 
-#endif  // DHARC_REGIONS_HPP_
+/**
+ * Statistic: Deadline performance of a region's process passes. A pass is
+ * released on the region's period or when new input arrives, depending on
+ * the process policy, and is due one period after its release. Times are
+ * in microseconds.
+ */
+struct TickStats {
+	uint64_t ticks;      // Completed process passes.
+	uint64_t missed;     // Passes that completed after their deadline.
+	uint64_t skipped;    // Whole periods skipped after an overrun.
+	uint32_t period;
+	int32_t priority;    // Higher priority regions run first when both due.
+	float jitter;        // Smoothed variation in lateness.
+	float meanlate;      // Lateness is the delay from release to start.
+	float p50late;
+	float p99late;
+	float maxlate;
+};
+
+/**
+ * How a region accepts frames that arrive faster or slower than it processes
+ * them.
+ */
+enum struct Ingest : int32_t {
+	latest,   // Keep only the newest unprocessed frame, coalescing others.
+	queue,    // Queue frames up to a depth, dropping new frames when full.
+	lockstep  // Process every frame exactly once, writers wait their turn.
+};
+
+/**
+ * What happened to a written frame.
+ */
+enum struct WriteResult : int32_t {
+	accepted,
+	coalesced,  // Accepted, but replaced a frame that was never processed.
+	dropped,    // Not accepted because the region is too far behind.
+	rejected    // Region does not exist or the frame is the wrong size.
+};
+
+/**
+ * Reply to a frame write, so that sensors can adapt their rate.
+ */
+struct WriteStatus {
+	WriteResult result;
+	uint32_t pending;  // Frames waiting to be processed.
+	uint32_t backoff;  // Suggested delay before the next write, microseconds.
+	uint64_t seq;      // Sequence number given to an accepted frame.
+};
 
+/**
+ * Statistic: Frame ingest counters of a region.
+ */
+struct IngestStats {
+	Ingest mode;
+	uint32_t depth;        // Queue depth for Ingest::queue.
+	uint32_t pending;
+	uint64_t accepted;
+	uint64_t coalesced;
+	uint64_t dropped;
+	uint64_t reprocessed;  // Passes run without a new frame.
+};
+
+/**
+ * Statistic: Background snapshots of a region, times in microseconds.
+ */
+struct SnapshotStats {
+	uint64_t snapshots;  // Completed snapshots.
+	uint64_t failed;
+	uint64_t bytes;      // Size of the last snapshot.
+	uint32_t active;     // 1 while a snapshot is being written.
+	uint32_t copied;     // Units copied before they were written, last snapshot.
+	float duration;      // Of the last snapshot.
+	float maxstall;      // Most the last snapshot delayed a single pass.
+};
+
+/**
+ * Operations of a region that have their latency measured.
+ */
+enum struct Latency : int {
+	write,
+	process,
+	reform
+};
+
+/**
+ * Statistic: Work done by a region and the latency of its operations. Rates
+ * are per second, averaged since the previous query (at least a second
+ * earlier), and latencies are in microseconds.
+ */
+struct Metrics {
+	uint64_t units;   // Total units processed.
+	uint64_t links;   // Total links evaluated.
+	uint64_t learns;  // Total link strength adjustments.
+	float unitsps;
+	float linksps;
+	float learnsps;
+	float writep50;
+	float writep99;
+	float writemax;
+	float processp50;
+	float processp99;
+	float processmax;
+	float reformp50;
+	float reformp99;
+	float reformmax;
+};
+};
+
+#endif  // DHARC_REGIONS_HPP_
@@ -5,8 +5,16 @@
 #ifndef DHARC_RPC_HPP_
 #define DHARC_RPC_HPP_
 
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
-#include <sstream>
+#include <thread>
 #include <vector>
 #include <iostream>
 #include <type_traits>
@@ -21,17 +29,136 @@ using dharc::rpc::commands_t;
 using dharc::rpc::Packer;
 
 namespace dharc {
+class Rpc;
 
+namespace rpc {
+/**
+ * Several commands to send to the server in one message, the results of all
+ * of them coming back in one reply. Each command is type checked as by
+ * Rpc::send, and its result is unpacked into the variable given when the
+ * batch is sent. A batch holds at most rpc::kMaxBatch commands. Large
+ * arrays in the arguments are neither copied nor compressed, so they and the
+ * result variables must outlive sending the batch.
+ */
+class Batch {
+	public:
+	template<Command C, typename R, typename... A>
+	Batch &add(R &result, const A&... args) {
+		using cmd_type =
+		typename std::tuple_element<static_cast<int>(C), commands_t>::type;
+
+		static_assert(std::is_same<R(*)(const A&...), cmd_type>::value,
+			"Incorrect RPC Arguments");
+		static_assert(C != Command::batch, "Batches cannot be nested");
+
+		const size_t start = buf_.size();
+		buf_.resize(start + sizeof(Command) + packedSize(args...));
+		Writer w(buf_.data() + start, &parts_);
+		const Command c = C;
+		w.write(&c, sizeof(Command));
+		packAll(w, args...);
+
+		unpack_.push_back([&result](Reader &r) {
+			Packer<R>::unpack(r, result);
+		});
+		return *this;
+	}
+
+	size_t size() const { return unpack_.size(); }
+
+	void clear() {
+		buf_.clear();
+		parts_.clear();
+		unpack_.clear();
+	}
+
+	private:
+	friend class dharc::Rpc;
+
+	vector<uint8_t> buf_;  // Each command and its inline arguments.
+	vector<View<uint8_t>> parts_;
+	vector<std::function<void(Reader&)>> unpack_;
+};
+
+/**
+ * The ZMQ context every socket of the process is made in, clients and
+ * servers alike, so that inproc endpoints reach between them.
+ */
+zmq::context_t &context();
+
+/**
+ * Number of ZMQ I/O threads the context has, by default 1.
+ * @return False if the context is already in use, so it is too late.
+ */
+bool setIoThreads(int threads);
+};  // namespace rpc
+
+/**
+ * Client side of the RPC protocol. Requests are sent on a DEALER socket
+ * tagged with an id, so any number can be in flight at once and replies are
+ * matched to them as they arrive. A thread of the client's own does all
+ * sending and receiving, woken by new requests or replies. The server still
+ * handles a client's requests one at a time, in order, so requests that
+ * should run at once need clients of their own.
+ */
 class Rpc {
 	public:
+	/**
+	 * Longest to wait for the reply to a request, which then fails. Once
+	 * nothing at all has come back for as long, the client reconnects.
+	 */
+	static constexpr auto kTimeout = std::chrono::seconds(5);
+
+	/**
+	 * Connect over TCP to a server on the port of host addr.
+	 */
 	Rpc(const char *addr, int port);
+
+	/**
+	 * Connect to any ZMQ endpoint of a server, such as
+	 * "ipc:///tmp/dharc.ipc" or "inproc://dharc" for one in this process.
+	 */
+	explicit Rpc(const std::string &endpoint);
+
 	virtual ~Rpc();
 
+	Rpc(const Rpc&) = delete;
+	Rpc &operator=(const Rpc&) = delete;
+
+	/**
+	 * Agree with the server how large arrays are compressed, in both
+	 * directions. Either end falls back to a codec the other can decode.
+	 * See Compression::none, fast and dense for suitable settings.
+	 * @return False if the server does not support compression.
+	 */
+	bool setCompression(const rpc::Compression &c);
+
+	/**
+	 * Compression totals of the server, for those of this process see
+	 * rpc::Compressor::stats.
+	 */
+	rpc::CompressStats compressStats();
+
+	/**
+	 * What the server has handled of each command, indexed by command, then
+	 * a last entry for messages it could not read a command from.
+	 */
+	vector<rpc::CommandStats> commandStats();
+
+	/**
+	 * Requests the server has queued in each lane and how long they waited,
+	 * indexed by rpc::Lane.
+	 */
+	vector<rpc::LaneStats> laneStats();
+
 	protected:
 	/**
 	 * Send an RPC command to the server. The arguments must match those expected
 	 * for the given command, as must the return type. See the commands_t tuple
 	 * for the correct types.
+	 * @throw std::runtime_error if the reply is too short for the result,
+	 *        as when the server did not know the command, its arguments were
+	 *        short or it turned the request away.
 	 */
 	template<Command C, typename... A>
 	auto send(const A&... args) {
@@ -44,15 +171,9 @@ class Rpc {
 		static_assert(std::is_same<ret_type(*)(const A&...), cmd_type>::value,
 			"Incorrect RPC Arguments");
 
-		// Pack the command number and arguments
-		std::ostringstream os(std::ios_base::out | std::ios_base::binary);
-		packcmd(os, C);
-		pack(os, args...);
-
-		// Send and then unpack return value
-		std::istringstream is(send(os.str()),
-			std::ios_base::in | std::ios_base::binary);
-		return Packer<ret_type>::unpack(is);
+		ret_type res{};
+		call(res, C, args...);
+		return res;
 	}
 
 	/**
@@ -69,56 +190,148 @@ class Rpc {
 		static_assert(std::is_same<ret_type(*)(), cmd_type>::value,
 			"Incorrect RPC Arguments");
 
-		// Pack the command number and arguments
-		std::ostringstream os(std::ios_base::out | std::ios_base::binary);
-		packcmd(os, C);
-		pack(os);
-
-		// Send and then unpack return value
-		std::istringstream is(send(os.str()),
-			std::ios_base::in | std::ios_base::binary);
-		return Packer<ret_type>::unpack(is);
+		ret_type res{};
+		call(res, C);
+		return res;
 	}
 
+	/**
+	 * A version of send that unpacks the result into an existing object, so
+	 * that a vector received repeatedly keeps its capacity.
+	 */
+	template<Command C, typename R, typename... A>
+	void sendInto(R &result, const A&... args) {
+		using cmd_type =
+		typename std::tuple_element<static_cast<int>(C), commands_t>::type;
 
-	private:
-	/* Send a string request and get a string reply from the socket */
-	std::string send(const std::string &s);
+		static_assert(std::is_same<R(*)(const A&...), cmd_type>::value,
+			"Incorrect RPC Arguments");
 
-	/* One argument base case */
-	template<typename F>
-	void pack_(std::ostream &os, const F &first) {
-		Packer<F>::pack(os, first);
+		call(result, C, args...);
 	}
 
-	/* Recursively pack the arguments into a (json) stream */
-	template<typename F, typename... Args>
-	void pack_(std::ostream &os, const F &first, const Args&... args) {
-		pack_(os, first);
-		//os << ',';
-		pack_(os, args...);
-	}
+	/**
+	 * Send every command in a batch and wait for all of their results.
+	 * @throw std::runtime_error if any result is missing, as the server stops
+	 *        at the first command of a batch it cannot run. Results before
+	 *        that one are still unpacked.
+	 */
+	void send(rpc::Batch &batch);
+
+	/**
+	 * A version of send that returns without waiting for the reply. Arrays in
+	 * the arguments are copied, so need not outlive the call. The future
+	 * holds a std::runtime_error if the server does not reply in time or
+	 * the reply is too short for the result, as for send.
+	 */
+	template<Command C, typename... A>
+	auto async(const A&... args) {
+		using cmd_type =
+		typename std::tuple_element<static_cast<int>(C), commands_t>::type;
+		using ret_type =
+		typename std::result_of<cmd_type(A...)>::type;
+
+		static_assert(std::is_same<ret_type(*)(const A&...), cmd_type>::value,
+			"Incorrect RPC Arguments");
+
+		auto result = std::make_shared<std::promise<ret_type>>();
+		std::future<ret_type> res = result->get_future();
 
-	template<typename... Args>
-	void pack(std::ostream &os, const Args&... args) {
-		//os << ", \"args\": [";
-		pack_(os, args...);
-		//os << "]}";
+		vector<rpc::View<uint8_t>> parts;
+		rpc::Compressor comp(compression());
+		zmq::message_t msg = pack(parts, &comp, C, args...);
+		enqueue(&msg, parts, [result](rpc::Reader *r) {
+			if (r != nullptr) {
+				ret_type value = Packer<ret_type>::unpack(*r);
+				if (r->ok()) {
+					result->set_value(std::move(value));
+				} else {
+					result->set_exception(std::make_exception_ptr(
+						std::runtime_error("Server could not run the command")));
+				}
+			} else {
+				result->set_exception(std::make_exception_ptr(
+					std::runtime_error("Server unreachable")));
+			}
+		}, nullptr);
+		return res;
 	}
 
-	inline void pack(std::ostream &os) {
-		//os << ", \"args\": []}";
+
+	private:
+	/* Called with the reply to a request, or nullptr if there was none. */
+	typedef std::function<void(rpc::Reader*)> Handler;
+
+	struct Request {
+		uint64_t id;
+		vector<zmq::message_t> frames;
+		Handler handler;
+		std::chrono::steady_clock::time_point deadline;  // Sent or not.
+	};
+
+	struct Pending {
+		Handler handler;
+		std::chrono::steady_clock::time_point deadline;
+	};
+
+	/*
+	 * Pack a command and its arguments straight into a message sized to fit.
+	 * Large arrays are left in parts, still referring to the arguments or to
+	 * their compressed copies in comp.
+	 */
+	template<typename... A>
+	zmq::message_t pack(vector<rpc::View<uint8_t>> &parts,
+			rpc::Compressor *comp, Command c, const A&... args) {
+		zmq::message_t msg(sizeof(Command) + rpc::packedSize(args...));
+		rpc::Writer w(msg.data(), &parts, comp);
+		w.write(&c, sizeof(Command));
+		rpc::packAll(w, args...);
+		return msg;
 	}
 
-	inline void packcmd(std::ostream &os, Command c) {
-		//os << "{\"c\": " << static_cast<int>(c);
-		os.write((const char*)&c, sizeof(Command));
+	template<typename R, typename... A>
+	void call(R &result, Command c, const A&... args) {
+		vector<rpc::View<uint8_t>> parts;
+		rpc::Compressor comp(compression());
+		zmq::message_t msg = pack(parts, &comp, c, args...);
+		request(&msg, parts, [&result](rpc::Reader &r) {
+			Packer<R>::unpack(r, result);
+		});
 	}
 
-	zmq::socket_t sock_;
+	/*
+	 * Send a request and wait for its reply. Parts are sent without copying,
+	 * which is safe because this only returns once the socket has let go of
+	 * them.
+	 */
+	void request(zmq::message_t *msg, const vector<rpc::View<uint8_t>> &parts,
+		std::function<void(rpc::Reader&)> unpack);
+
+	/*
+	 * Queue a request for the client's thread to send. Its parts are copied
+	 * unless released is given, which is then set once the socket no longer
+	 * needs them.
+	 */
+	void enqueue(zmq::message_t *msg, const vector<rpc::View<uint8_t>> &parts,
+		Handler handler, std::shared_ptr<std::promise<void>> released);
+
+	rpc::Compression compression();
+
+	void io();
+	bool receive();  // False if no reply came.
+	void reconnect();
+
 	std::string uri_;
+	zmq::socket_t sock_;  // Only used by the client's thread once running.
+	int wakefd_;
+	uint64_t nextid_;
+	bool stopping_;
+	std::deque<Request> outgoing_;
+	std::mutex lock_;
+	std::map<uint64_t, Pending> pending_;  // Only used by the client's thread.
+	rpc::Compression compression_;
+	std::thread thread_;
 };
 };  // namespace dharc
 
 #endif  // DHARC_RPC_HPP_
-
@@ -8,9 +8,12 @@
 #include <tuple>
 #include <vector>
 #include <list>
+#include <string>
 
 #include "dharc/node.hpp"
 #include "dharc/tail.hpp"
+#include "dharc/regions.hpp"
+#include "dharc/rpc_packer.hpp"
 
 using std::vector;
 using std::list;
@@ -30,9 +33,121 @@ enum struct Command : int {
 	version,
 	write2d,
 	reform2d,
+	budget2d,
+	coverage2d,
+	framecpu,
+	schedule2d,
+	ticks2d,
+	lateness2d,
+	create2d,
+	resize2d,
+	destroy2d,
+	procps,
+	metrics2d,
+	latency2d,
+	ingest2d,
+	ingeststats2d,
+	save2d,
+	load2d,
+	snapshot2d,
+	snapstats2d,
+	shmattach2d,
+	shmwrite2d,
+	shmdetach2d,
+	step2d,
+	batch,
+	compression,
+	compressstats,
+	delta2d,
+	rpcstats,
+	lanestats,
+	pyramid2d,
+	shmstep2d,
 	end
 };
 
+/**
+ * Name of each command, for reports.
+ */
+constexpr const char *kCommandNames[] = {
+	"nop", "version", "write2d", "reform2d", "budget2d", "coverage2d",
+	"framecpu", "schedule2d", "ticks2d", "lateness2d", "create2d", "resize2d",
+	"destroy2d", "procps", "metrics2d", "latency2d", "ingest2d",
+	"ingeststats2d", "save2d", "load2d", "snapshot2d", "snapstats2d",
+	"shmattach2d", "shmwrite2d", "shmdetach2d", "step2d", "batch",
+	"compression", "compressstats", "delta2d", "rpcstats", "lanestats",
+	"pyramid2d", "shmstep2d"
+};
+
+static_assert(sizeof(kCommandNames) / sizeof(kCommandNames[0]) ==
+	static_cast<size_t>(Command::end), "Every command needs a name");
+
+/**
+ * Classes of request, each queued separately by the server. Frames to and
+ * from senses are handled first, everything else, mostly monitors polling,
+ * waits for them and is rate limited. Each client's own requests are still
+ * handled in the order it sent them.
+ */
+enum struct Lane : int {
+	sense,
+	monitor,
+	end
+};
+
+constexpr Lane lane(Command c) {
+	return (c == Command::write2d || c == Command::reform2d ||
+		c == Command::shmattach2d || c == Command::shmwrite2d ||
+		c == Command::shmdetach2d || c == Command::step2d ||
+		c == Command::delta2d || c == Command::shmstep2d) ?
+		Lane::sense : Lane::monitor;
+}
+
+/**
+ * Can the server turn a request away when its lane's queue is long. Only
+ * commands that read state can be, as a monitor polling loses nothing by
+ * asking again; those that change the fabric are queued regardless, unless
+ * so many wait that the server must protect itself. A batch may be dropped
+ * only if every command in it may, as may a request with no readable
+ * command.
+ */
+constexpr bool droppable(Command c) {
+	return c == Command::nop || c == Command::version ||
+		c == Command::coverage2d || c == Command::framecpu ||
+		c == Command::ticks2d || c == Command::lateness2d ||
+		c == Command::procps || c == Command::metrics2d ||
+		c == Command::latency2d || c == Command::ingeststats2d ||
+		c == Command::snapstats2d || c == Command::compressstats ||
+		c == Command::rpcstats || c == Command::lanestats ||
+		c == Command::pyramid2d || c == Command::end;
+}
+
+/**
+ * Requests of a lane the server has received since it started, and how long
+ * they waited for a worker, in nanoseconds.
+ */
+struct LaneStats {
+	uint64_t requests;
+	uint64_t deferred;  // Held back by the rate limit.
+	uint64_t rejected;  // Turned away, the queue full, see droppable.
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+};
+
+/**
+ * What the server has handled of a command since it started. Latencies are
+ * of running the command, in nanoseconds, not counting queueing or sending.
+ */
+struct CommandStats {
+	uint64_t calls;
+	uint64_t rejected;  // Arguments short, so it was not run.
+	uint64_t bytesin;   // Including message parts.
+	uint64_t bytesout;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+};
+
 /**
  * Corresponding types for each command (in the same order as commands are
  * specified in the Command enum struct).
@@ -40,10 +155,52 @@ enum struct Command : int {
 typedef tuple<
 	bool(*)(),  // nop
 	int(*)(),  // version
-	bool(*)(const size_t &, const vector<uint8_t> &, const size_t &, const size_t &),
-	vector<uint8_t>(*)(const size_t &, const size_t &, const size_t &)
+	dharc::WriteStatus(*)(const size_t &, const View<uint8_t> &,
+		const size_t &, const size_t &),  // write2d
+	vector<uint8_t>(*)(const size_t &, const size_t &, const size_t &),
+	bool(*)(const size_t &, const size_t &),  // budget2d
+	dharc::Coverage(*)(const size_t &),  // coverage2d
+	float(*)(),  // framecpu
+	bool(*)(const size_t &, const size_t &, const int &),  // schedule2d
+	dharc::TickStats(*)(const size_t &),  // ticks2d
+	vector<uint64_t>(*)(const size_t &),  // lateness2d
+	size_t(*)(const size_t &, const size_t &, const size_t &, const size_t &),
+	bool(*)(const size_t &, const size_t &, const size_t &, const size_t &,
+		const size_t &),  // resize2d
+	bool(*)(const size_t &),  // destroy2d
+	float(*)(),  // procps
+	dharc::Metrics(*)(const size_t &),  // metrics2d
+	vector<uint64_t>(*)(const size_t &, const int &),  // latency2d
+	bool(*)(const size_t &, const int &, const size_t &),  // ingest2d
+	dharc::IngestStats(*)(const size_t &),  // ingeststats2d
+	bool(*)(const size_t &, const std::string &),  // save2d
+	size_t(*)(const size_t &, const std::string &),  // load2d
+	bool(*)(const size_t &, const std::string &, const size_t &),  // snapshot2d
+	dharc::SnapshotStats(*)(const size_t &),  // snapstats2d
+	bool(*)(const size_t &, const std::string &),  // shmattach2d
+	dharc::WriteStatus(*)(const size_t &, const size_t &),  // shmwrite2d
+	bool(*)(const size_t &),  // shmdetach2d
+	vector<uint8_t>(*)(const size_t &, const View<uint8_t> &, const size_t &,
+		const size_t &, const size_t &),  // step2d
+	bool(*)(),  // batch, sent with a Batch rather than on its own
+	uint32_t(*)(const uint32_t &, const int &, const int &,
+		const size_t &),  // compression
+	CompressStats(*)(),  // compressstats
+	dharc::WriteStatus(*)(const size_t &, const size_t &,
+		const View<uint8_t> &, const View<uint8_t> &, const size_t &,
+		const size_t &),  // delta2d
+	vector<CommandStats>(*)(),  // rpcstats
+	vector<LaneStats>(*)(),  // lanestats
+	vector<vector<uint8_t>>(*)(const size_t&, const size_t&),  // pyramid2d
+	vector<uint8_t>(*)(const size_t &, const size_t &, const size_t &,
+		const size_t &, const size_t &)  // shmstep2d
 > commands_t;
 
+/**
+ * Most commands a batch may hold.
+ */
+constexpr uint32_t kMaxBatch = 256;
+
 };  // namespace rpc
 };  // namespace dharc
 
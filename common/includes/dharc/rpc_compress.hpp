@@ -0,0 +1,261 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_RPC_COMPRESS_HPP_
+#define DHARC_RPC_COMPRESS_HPP_
+
+#include <zlib.h>
+#ifdef DHARC_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace dharc {
+namespace rpc {
+
+/**
+ * Codecs a large array may be compressed with on the wire. Each array says
+ * which it used, so a receiver decodes whatever the sender chose as long as
+ * it was built with that codec.
+ */
+enum struct Codec : uint8_t {
+	none,
+	deflate,  // zlib at any level, decoded the same way.
+	lz4,      // Only when built with DHARC_HAVE_LZ4.
+	end
+};
+
+/**
+ * Arrays smaller than this are not compressed unless asked otherwise.
+ */
+constexpr size_t kCompressBytes = 16384;
+
+/**
+ * @return Mask of the codecs this build can decode, bit n for Codec n.
+ */
+inline uint32_t codecs() {
+	uint32_t res = (1U << static_cast<int>(Codec::none)) |
+		(1U << static_cast<int>(Codec::deflate));
+#ifdef DHARC_HAVE_LZ4
+	res |= 1U << static_cast<int>(Codec::lz4);
+#endif
+	return res;
+}
+
+/**
+ * How one end of a connection compresses the large arrays it sends. Only
+ * arrays sent as message parts of their own are ever compressed.
+ */
+struct Compression {
+	Codec codec;
+	int level;         // Deflate level, 1 fastest to 9 smallest.
+	size_t threshold;  // Smallest array to compress, in bytes.
+
+	/** Nothing compressed, for loopback where bandwidth is free. */
+	static Compression none() {
+		return Compression{Codec::none, 0, kCompressBytes};
+	}
+
+	/** Cheap to compress, for a LAN. LZ4 or else the fastest deflate. */
+	static Compression fast() {
+#ifdef DHARC_HAVE_LZ4
+		return Compression{Codec::lz4, 0, kCompressBytes};
+#else
+		return Compression{Codec::deflate, Z_BEST_SPEED, kCompressBytes};
+#endif
+	}
+
+	/** Smallest on the wire, for constrained links. */
+	static Compression dense() {
+		return Compression{Codec::deflate, Z_DEFAULT_COMPRESSION,
+			kCompressBytes};
+	}
+};
+
+/**
+ * Settle on compression the peer can decode, falling back from LZ4 to the
+ * fastest deflate and from there to none.
+ * @param peer Mask of codecs the peer decodes, as from codecs().
+ */
+inline Compression negotiate(Compression wanted, uint32_t peer) {
+	const uint32_t both = peer & codecs();
+	if (wanted.codec >= Codec::end) wanted.codec = Codec::none;
+
+	if (wanted.codec == Codec::lz4 &&
+			(both & (1U << static_cast<int>(Codec::lz4))) == 0) {
+		wanted.codec = Codec::deflate;
+		wanted.level = Z_BEST_SPEED;
+	}
+	if (wanted.codec == Codec::deflate &&
+			(both & (1U << static_cast<int>(Codec::deflate))) == 0) {
+		wanted.codec = Codec::none;
+	}
+	if (wanted.codec == Codec::deflate &&
+			(wanted.level < Z_BEST_SPEED || wanted.level > Z_BEST_COMPRESSION)) {
+		wanted.level = Z_DEFAULT_COMPRESSION;
+	}
+	return wanted;
+}
+
+/**
+ * Compression totals for the whole process, in both directions.
+ */
+struct CompressStats {
+	uint64_t arrays;         // Arrays sent compressed.
+	uint64_t rawbytes;       // Their size before compression.
+	uint64_t packedbytes;    // And after.
+	uint64_t skipped;        // Arrays sent raw since they did not shrink.
+	uint64_t compressns;     // Time spent compressing, including skipped.
+	uint64_t inflated;       // Arrays received compressed.
+	uint64_t inflatedbytes;  // Their size once decompressed.
+	uint64_t inflatens;      // Time spent decompressing.
+};
+
+/**
+ * Compresses the arrays of one message, keeping the compressed copies until
+ * it is destroyed so that they can be sent without copying again.
+ */
+class Compressor {
+	public:
+	explicit Compressor(const Compression &c) : config_(c) {}
+
+	Compressor(const Compressor&) = delete;
+	Compressor &operator=(const Compressor&) = delete;
+
+	Codec codec() const { return config_.codec; }
+
+	/**
+	 * @return The compressed array, or nullptr if it should be sent as is
+	 *         because it is too small or did not compress well enough.
+	 */
+	const std::vector<uint8_t> *compress(const void *data, size_t size) {
+		if (config_.codec == Codec::none || size < config_.threshold) {
+			return nullptr;
+		}
+
+		const auto start = clock::now();
+		store_.emplace_back();
+		std::vector<uint8_t> &out = store_.back();
+		bool ok = false;
+
+		switch (config_.codec) {
+		case Codec::deflate: {
+			uLongf len = compressBound(size);
+			out.resize(len);
+			ok = compress2(out.data(), &len, static_cast<const Bytef*>(data),
+				size, config_.level) == Z_OK;
+			out.resize(len);
+			break;
+		}
+#ifdef DHARC_HAVE_LZ4
+		case Codec::lz4: {
+			if (size > LZ4_MAX_INPUT_SIZE) break;
+			out.resize(LZ4_compressBound(static_cast<int>(size)));
+			const int len = LZ4_compress_default(
+				static_cast<const char*>(data),
+				reinterpret_cast<char*>(out.data()), static_cast<int>(size),
+				static_cast<int>(out.size()));
+			ok = len > 0;
+			out.resize((ok) ? len : 0);
+			break;
+		}
+#endif
+		default: break;
+		}
+
+		Counters &c = counters();
+		c.compressns += elapsed(start);
+
+		// Not worth the receiver's time unless it saves an eighth.
+		if (!ok || out.size() > size - size / 8) {
+			store_.pop_back();
+			++c.skipped;
+			return nullptr;
+		}
+
+		++c.arrays;
+		c.rawbytes += size;
+		c.packedbytes += out.size();
+		return &out;
+	}
+
+	/**
+	 * Decompress an array which must come out exactly dstsize bytes.
+	 */
+	static bool decompress(Codec codec, const uint8_t *src, size_t srcsize,
+			uint8_t *dst, size_t dstsize) {
+		const auto start = clock::now();
+		bool ok = false;
+
+		switch (codec) {
+		case Codec::deflate: {
+			uLongf len = dstsize;
+			ok = uncompress(dst, &len, src, srcsize) == Z_OK && len == dstsize;
+			break;
+		}
+#ifdef DHARC_HAVE_LZ4
+		case Codec::lz4:
+			if (srcsize > INT_MAX || dstsize > INT_MAX) break;
+			ok = LZ4_decompress_safe(reinterpret_cast<const char*>(src),
+				reinterpret_cast<char*>(dst), static_cast<int>(srcsize),
+				static_cast<int>(dstsize)) == static_cast<int>(dstsize);
+			break;
+#endif
+		default: break;
+		}
+
+		Counters &c = counters();
+		c.inflatens += elapsed(start);
+		if (ok) {
+			++c.inflated;
+			c.inflatedbytes += dstsize;
+		}
+		return ok;
+	}
+
+	static CompressStats stats() {
+		const Counters &c = counters();
+		return CompressStats{c.arrays, c.rawbytes, c.packedbytes, c.skipped,
+			c.compressns, c.inflated, c.inflatedbytes, c.inflatens};
+	}
+
+	private:
+	typedef std::chrono::steady_clock clock;
+
+	struct Counters {
+		std::atomic<uint64_t> arrays;
+		std::atomic<uint64_t> rawbytes;
+		std::atomic<uint64_t> packedbytes;
+		std::atomic<uint64_t> skipped;
+		std::atomic<uint64_t> compressns;
+		std::atomic<uint64_t> inflated;
+		std::atomic<uint64_t> inflatedbytes;
+		std::atomic<uint64_t> inflatens;
+	};
+
+	static Counters &counters() {
+		static Counters c;
+		return c;
+	}
+
+	static uint64_t elapsed(clock::time_point start) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			clock::now() - start).count();
+	}
+
+	const Compression config_;
+	std::deque<std::vector<uint8_t>> store_;
+};
+
+};  // namespace rpc
+};  // namespace dharc
+
+#endif  // DHARC_RPC_COMPRESS_HPP_
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_RPC_OUTPUTS_HPP_
+#define DHARC_RPC_OUTPUTS_HPP_
+
+#include <cstdint>
+#include <cstring>
+
+#include "dharc/regions.hpp"
+
+namespace dharc {
+namespace rpc {
+
+/**
+ * The ways of watching a region's outputs. Each is its own topic of the
+ * fabric's output publisher, so a subscriber can take either or both.
+ */
+enum struct Stream : uint8_t {
+	outputs = 'o',  // [topic][epoch 8 bytes][output]
+	deltas = 'd'    // [topic][DeltaHeader][tile bitmap][tiles]
+};
+
+/**
+ * A topic is the stream byte then the region's id, 8 bytes.
+ */
+constexpr size_t kTopicBytes = 1 + sizeof(uint64_t);
+
+inline void makeTopic(uint8_t *topic, Stream stream, RegionID regid) {
+	const uint64_t id = static_cast<uint64_t>(regid);
+	topic[0] = static_cast<uint8_t>(stream);
+	std::memcpy(topic + 1, &id, sizeof(id));
+}
+
+inline void parseTopic(const uint8_t *topic, Stream &stream, RegionID &regid) {
+	uint64_t id;
+	std::memcpy(&id, topic + 1, sizeof(id));
+	stream = static_cast<Stream>(topic[0]);
+	regid = static_cast<RegionID>(id);
+}
+
+/**
+ * Starts each message of a deltas stream. The tiles that changed follow as
+ * for TileGrid, all of them if base is 0. A subscriber whose last epoch is
+ * not base has missed a message and should subscribe again, which makes the
+ * publisher send the next one whole.
+ */
+struct DeltaHeader {
+	uint64_t epoch;
+	uint64_t base;   // Epoch this is relative to, 0 if whole.
+	uint32_t width;
+	uint32_t height;
+	uint32_t tilew;
+	uint32_t tileh;
+};
+
+};  // namespace rpc
+};  // namespace dharc
+
+#endif  // DHARC_RPC_OUTPUTS_HPP_
@@ -5,136 +5,492 @@
 #ifndef DHARC_PACKER_HPP_
 #define DHARC_PACKER_HPP_
 
-#include <iostream>
 #include <vector>
 #include <list>
+#include <string>
 #include <cassert>
-#include <zlib.h>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <type_traits>
 
 #include "dharc/node.hpp"
 #include "dharc/tail.hpp"
+#include "dharc/rpc_compress.hpp"
 
 namespace dharc {
 namespace rpc {
 
 /**
- * Default RPC packer for anything supporting both stream operators.
+ * Arrays of at least this many bytes are sent as a message part of their own
+ * rather than copied into the main message.
+ */
+constexpr size_t kPartBytes = 8192;
+
+/**
+ * An array's count has the codec of its part in its top byte.
+ */
+constexpr unsigned kCodecShift = 56;
+
+/**
+ * Set in an array's count if its elements are in the next message part
+ * rather than inline, which only arrays of at least kPartBytes may be.
+ */
+constexpr uint64_t kPartFlag = static_cast<uint64_t>(1) << 55;
+
+/**
+ * Most a compressed part may grow by when decompressed, beyond which it is
+ * taken to be corrupt rather than allocating for it. Deflate manages just
+ * over 1000 to 1 at best and LZ4 less.
+ */
+constexpr size_t kMaxInflation = 1100;
+
+/**
+ * Read only view of an array, used for arguments so that a received array can
+ * be used where it arrived in the message instead of being copied out. It is
+ * only valid while the message is.
+ */
+template <typename T>
+struct View {
+	const T *data;
+	size_t count;
+
+	View() : data(nullptr), count(0) {}
+	View(const T *d, size_t n) : data(d), count(n) {}
+	View(const std::vector<T> &vec) : data(vec.data()), count(vec.size()) {}
+
+	const T &operator[](size_t ix) const { return data[ix]; }
+	size_t size() const { return count; }
+	const T *begin() const { return data; }
+	const T *end() const { return data + count; }
+};
+
+/**
+ * Packs values straight into a message buffer sized beforehand with
+ * Packer<T>::size. Large arrays are not copied but listed as parts, to be
+ * sent after the message without copying. Given a compressor, parts it
+ * compresses refer into it instead, so it must outlive them.
+ */
+class Writer {
+	public:
+	Writer(void *buffer, std::vector<View<uint8_t>> *parts,
+		Compressor *comp = nullptr)
+		: pos_(static_cast<uint8_t*>(buffer)), parts_(parts), comp_(comp),
+			written_(0) {}
+
+	void write(const void *data, size_t size) {
+		if (size > 0) std::memcpy(pos_, data, size);
+		pos_ += size;
+		written_ += size;
+	}
+
+	void part(const void *data, size_t size) {
+		parts_->emplace_back(static_cast<const uint8_t*>(data), size);
+		written_ += size;
+	}
+
+	/** Bytes written so far, including parts. */
+	size_t written() const { return written_; }
+
+	/**
+	 * @return A compressed copy of an array to send as a part in its place,
+	 *         or nullptr to send the array as it is.
+	 */
+	const std::vector<uint8_t> *compress(const void *data, size_t size) {
+		return (comp_ != nullptr) ? comp_->compress(data, size) : nullptr;
+	}
+
+	Codec codec() const {
+		return (comp_ != nullptr) ? comp_->codec() : Codec::none;
+	}
+
+	private:
+	uint8_t *pos_;
+	std::vector<View<uint8_t>> *parts_;
+	Compressor *comp_;
+	size_t written_;
+};
+
+/**
+ * Unpacks values from a received message and its parts. Reading past the end
+ * gives zeros and marks the reader failed rather than overrunning.
+ */
+class Reader {
+	public:
+	Reader(const void *data, size_t size,
+		const View<uint8_t> *parts = nullptr, size_t nparts = 0)
+		: pos_(static_cast<const uint8_t*>(data)), end_(pos_ + size),
+			parts_(parts), nparts_(nparts), ok_(true), consumed_(0) {}
+
+	bool ok() const { return ok_; }
+	void fail() { ok_ = false; }
+
+	/** Bytes of the message not yet read. */
+	size_t remaining() const { return static_cast<size_t>(end_ - pos_); }
+
+	/** Bytes read so far, including parts as they arrived. */
+	size_t consumed() const { return consumed_; }
+
+	void read(void *data, size_t size) {
+		const uint8_t *p = take(size);
+		if (p != nullptr) {
+			std::memcpy(data, p, size);
+		} else {
+			std::memset(data, 0, size);
+		}
+	}
+
+	/**
+	 * Skip over size bytes of the message.
+	 * @return Pointer to those bytes or nullptr if there are not enough.
+	 */
+	const uint8_t *take(size_t size) {
+		if (!ok_ || static_cast<size_t>(end_ - pos_) < size) {
+			ok_ = false;
+			return nullptr;
+		}
+		const uint8_t *res = pos_;
+		pos_ += size;
+		consumed_ += size;
+		return res;
+	}
+
+	/**
+	 * The next message part, which must be exactly size bytes.
+	 */
+	View<uint8_t> part(size_t size) {
+		if (!ok_ || nparts_ == 0 || parts_->count != size) {
+			ok_ = false;
+			return View<uint8_t>();
+		}
+		--nparts_;
+		consumed_ += size;
+		return *parts_++;
+	}
+
+	/**
+	 * Decompress the next message part, which must come out exactly size
+	 * bytes. The result is kept for as long as the reader.
+	 * @return The decompressed bytes or nullptr if the part is missing or
+	 *         corrupt.
+	 */
+	const uint8_t *inflate(Codec codec, size_t size) {
+		if (!ok_ || nparts_ == 0 || size / kMaxInflation > parts_->count) {
+			ok_ = false;
+			return nullptr;
+		}
+		inflated_.emplace_back(size);
+		if (!Compressor::decompress(codec, parts_->data, parts_->count,
+				inflated_.back().data(), size)) {
+			inflated_.pop_back();
+			ok_ = false;
+			return nullptr;
+		}
+		consumed_ += parts_->count;
+		--nparts_;
+		++parts_;
+		return inflated_.back().data();
+	}
+
+	private:
+	const uint8_t *pos_;
+	const uint8_t *end_;
+	const View<uint8_t> *parts_;
+	size_t nparts_;
+	bool ok_;
+	size_t consumed_;
+	std::deque<std::vector<uint8_t>> inflated_;
+};
+
+/**
+ * Default RPC packer, copying the bytes of a value as they are. Types that
+ * are not trivially copyable need a Packer of their own.
  */
 template<typename T>
 struct Packer {
-	static void pack(std::ostream &os, const T &first) {
-		os.write((const char*)&first, sizeof(T));
+	static_assert(std::is_trivially_copyable<T>::value,
+		"No RPC packer for this type");
+
+	static size_t size(const T &first) { return sizeof(T); }
+	static void pack(Writer &w, const T &first) {
+		w.write(&first, sizeof(T));
 	}
-	static T unpack(std::istream &is) {
+	static void unpack(Reader &r, T &res) { r.read(&res, sizeof(T)); }
+	static T unpack(Reader &r) {
 		T res;
-		is.read((char*)&res, sizeof(T));
+		unpack(r, res);
 		return res;
 	}
 };
 
-template <>
-struct Packer<dharc::Node> {
-	static void pack(std::ostream &os, const dharc::Node &n) {
-		os.write((const char*)&n.value, sizeof(uint64_t));
+/**
+ * Buffer packing of arrays, shared by vectors, views and strings: a count
+ * followed by the elements, copied in one go. They are inline if small or
+ * else the next message part, which may be compressed, in which case the
+ * codec is in the count. Containers that are not contiguous always put their
+ * elements inline but are otherwise the same on the wire, so any container
+ * of an element type may be unpacked as any other.
+ */
+template<typename R>
+struct ArrayPacker {
+	static_assert(std::is_trivially_copyable<R>::value,
+		"Array elements must be trivially copyable");
+
+	static bool isPart(size_t count) {
+		return count * sizeof(R) >= kPartBytes;
+	}
+
+	static size_t size(size_t count) {
+		return sizeof(uint64_t) + ((isPart(count)) ? 0 : count * sizeof(R));
 	}
-	static dharc::Node unpack(std::istream &is) {
-		dharc::Node res;
-		is.read((char*)&res.value, sizeof(uint64_t));
+
+	static void pack(Writer &w, const R *data, size_t count) {
+		uint64_t x = count;
+		if (!isPart(count)) {
+			w.write(&x, sizeof(x));
+			w.write(data, count * sizeof(R));
+			return;
+		}
+
+		x |= kPartFlag;
+		const std::vector<uint8_t> *z = w.compress(data, count * sizeof(R));
+		if (z != nullptr) {
+			x |= static_cast<uint64_t>(w.codec()) << kCodecShift;
+			w.write(&x, sizeof(x));
+			w.part(z->data(), z->size());
+		} else {
+			w.write(&x, sizeof(x));
+			w.part(data, count * sizeof(R));
+		}
+	}
+
+	/**
+	 * Size and pack the elements of a container that is not contiguous.
+	 */
+	template<typename C>
+	static size_t sizeInline(const C &c) {
+		return sizeof(uint64_t) + c.size() * sizeof(R);
+	}
+	template<typename C>
+	static void packInline(Writer &w, const C &c) {
+		const uint64_t x = c.size();
+		w.write(&x, sizeof(x));
+		for (const R &e : c) w.write(&e, sizeof(R));
+	}
+
+	/**
+	 * @return Bytes of the elements in place, which need not be aligned, or
+	 *         nullptr if missing.
+	 */
+	static const uint8_t *unpack(Reader &r, size_t &count) {
+		uint64_t x = 0;
+		r.read(&x, sizeof(x));
+		count = 0;
+		const Codec codec = static_cast<Codec>(x >> kCodecShift);
+		const bool part = (x & kPartFlag) != 0;
+		x &= kPartFlag - 1;
+
+		// Guard the multiplication below against an absurd count.
+		if (x > SIZE_MAX / sizeof(R) || (part && !isPart(x)) ||
+				(codec != Codec::none && !part)) {
+			r.fail();
+			return nullptr;
+		}
+
+		const uint8_t *res;
+		if (codec != Codec::none) {
+			res = r.inflate(codec, x * sizeof(R));
+		} else if (part) {
+			res = r.part(x * sizeof(R)).data;
+		} else {
+			res = r.take(x * sizeof(R));
+		}
+		if (res != nullptr) count = x;
 		return res;
 	}
 };
 
 /**
- * RPC packer for vectors.
+ * Buffer packing of containers of values that are not trivially copyable,
+ * such as vectors of strings: a count as for arrays, followed by each
+ * element with its own packer.
  */
-template<>
+template<typename C>
+struct ElementPacker {
+	typedef typename C::value_type R;
+
+	static size_t size(const C &c) {
+		size_t res = sizeof(uint64_t);
+		for (const R &e : c) res += Packer<R>::size(e);
+		return res;
+	}
+	static void pack(Writer &w, const C &c) {
+		const uint64_t x = c.size();
+		w.write(&x, sizeof(x));
+		for (const R &e : c) Packer<R>::pack(w, e);
+	}
+	static void unpack(Reader &r, C &res) {
+		uint64_t x = 0;
+		r.read(&x, sizeof(x));
+		res.clear();
+
+		// Every element takes at least a byte, so a count larger than what is
+		// left is corrupt and nothing is allocated for it.
+		if (x > r.remaining()) {
+			r.fail();
+			return;
+		}
+		for (auto i = 0U; i < x && r.ok(); ++i) {
+			res.emplace_back();
+			Packer<R>::unpack(r, res.back());
+		}
+		if (!r.ok()) res.clear();
+	}
+	static C unpack(Reader &r) {
+		C res;
+		unpack(r, res);
+		return res;
+	}
+};
+
+template<typename R, bool = std::is_trivially_copyable<R>::value>
+struct VectorPacker : ElementPacker<std::vector<R>> {};
+
 template<typename R>
-struct Packer<std::vector<R>> {
-	static void pack(std::ostream &os, const std::vector<R> &vec) {
-		long unsigned int x = vec.size();
-		os.write((const char *)&x, sizeof(long unsigned int));
-		//x = compressBound(x * sizeof(R));
-		//unsigned char *buffer = new unsigned char[x];
-		//compress(buffer, &x, vec.data(), vec.size() * sizeof(R));
-		//os.write((const char *)&x, sizeof(long unsigned int));
-		//os.write((const char *)buffer, x);
-		os.write((const char *)vec.data(), x * sizeof(R));
-		//delete [] buffer;
-	}
-	static std::vector<R> unpack(std::istream &is) {
+struct VectorPacker<R, true> {
+	static size_t size(const std::vector<R> &vec) {
+		return ArrayPacker<R>::size(vec.size());
+	}
+	static void pack(Writer &w, const std::vector<R> &vec) {
+		ArrayPacker<R>::pack(w, vec.data(), vec.size());
+	}
+	/* Fill an existing vector, reusing its capacity. */
+	static void unpack(Reader &r, std::vector<R> &res) {
+		size_t count;
+		const uint8_t *p = ArrayPacker<R>::unpack(r, count);
+		if (alignof(R) == 1) {
+			// Copy without first zero filling.
+			res.assign(reinterpret_cast<const R*>(p),
+				reinterpret_cast<const R*>(p) + count);
+		} else {
+			// Elements in a message need not be aligned.
+			res.resize(count);
+			if (count > 0) std::memcpy(res.data(), p, count * sizeof(R));
+		}
+	}
+	static std::vector<R> unpack(Reader &r) {
 		std::vector<R> res;
-		long unsigned int x;
-		is.read((char *)&x, sizeof(long unsigned int));
-		res.resize(x);
-		//x *= sizeof(R);
-		//long unsigned int ux;
-		//is.read((char *)&ux, sizeof(long unsigned int));
-		//unsigned char *buffer = new unsigned char[ux];
-		//is.read((char *)buffer, ux);
-		is.read((char *)res.data(), x * sizeof(R));
-		//uncompress(res.data(), &x, buffer, ux);
-		//delete [] buffer;
+		unpack(r, res);
 		return res;
 	}
 };
 
+template<typename R, bool = std::is_trivially_copyable<R>::value>
+struct ListPacker : ElementPacker<std::list<R>> {};
 
+template<typename R>
+struct ListPacker<R, true> {
+	static size_t size(const std::list<R> &lst) {
+		return ArrayPacker<R>::sizeInline(lst);
+	}
+	static void pack(Writer &w, const std::list<R> &lst) {
+		ArrayPacker<R>::packInline(w, lst);
+	}
+	static void unpack(Reader &r, std::list<R> &res) {
+		size_t count;
+		const uint8_t *p = ArrayPacker<R>::unpack(r, count);
+		res.clear();
+		for (auto i = 0U; i < count; ++i) {
+			R e;
+			std::memcpy(&e, p + i * sizeof(R), sizeof(R));
+			res.push_back(e);
+		}
+	}
+	static std::list<R> unpack(Reader &r) {
+		std::list<R> res;
+		unpack(r, res);
+		return res;
+	}
+};
 
 /**
- * RPC packer for Tails.
+ * RPC packer for vectors, whose elements are copied in one go if they are
+ * trivially copyable.
  */
-/*template<>
-struct Packer<dharc::Tail> {
-	static void pack(std::ostream &os, const dharc::Tail &tail) {
-		auto x = tail.size();
-		os << '[';
-		for (auto i : tail) {
-			--x;
-			Packer<Node>::pack(os, i);
-			if (x != 0) os << ',';
-		}
-		os << ']';
-	}
-	static dharc::Tail unpack(std::istream &is) {
-		dharc::Tail res;
-		if (is.get() != '[') return res;
-		while (is.peek() != ']') {
-			res.insertRaw(Packer<Node>::unpack(is));
-			if (is.peek() == ',') is.ignore();
-		}
-		is.ignore();  // Remove trailing ']'
+template<typename R>
+struct Packer<std::vector<R>> : VectorPacker<R> {};
+
+/**
+ * RPC packer for lists, on the wire the same as a vector.
+ */
+template<typename R>
+struct Packer<std::list<R>> : ListPacker<R> {};
+
+/**
+ * RPC packer for views, on the wire the same as a vector. Unpacking refers
+ * into the message, so elements must not need alignment.
+ */
+template<typename R>
+struct Packer<View<R>> {
+	static_assert(alignof(R) == 1, "Views must be of unaligned elements");
+
+	static size_t size(const View<R> &view) {
+		return ArrayPacker<R>::size(view.count);
+	}
+	static void pack(Writer &w, const View<R> &view) {
+		ArrayPacker<R>::pack(w, view.data, view.count);
+	}
+	static void unpack(Reader &r, View<R> &res) {
+		size_t count;
+		const uint8_t *p = ArrayPacker<R>::unpack(r, count);
+		res = View<R>(reinterpret_cast<const R*>(p), count);
+	}
+	static View<R> unpack(Reader &r) {
+		View<R> res;
+		unpack(r, res);
 		return res;
 	}
-};*/
+};
 
 /**
- * RPC packer for lists.
+ * RPC packer for strings, on the wire the same as a vector of char.
  */
 template<>
-template<typename R>
-struct Packer<std::list<R>> {
-	static void pack(std::ostream &os, const std::list<R> &lst) {
-		auto x = lst.size();
-		os << '[';
-		for (auto i : lst) {
-			--x;
-			Packer<R>::pack(os, i);
-			if (x != 0) os << ',';
-		}
-		os << ']';
+struct Packer<std::string> {
+	static size_t size(const std::string &str) {
+		return ArrayPacker<char>::size(str.size());
 	}
-	static std::list<R> unpack(std::istream &is) {
-		std::list<R> res;
-		if (is.get() != '[') return res;
-		while (is.peek() != ']') {
-			res.push_back(Packer<R>::unpack(is));
-			if (is.peek() == ',') is.ignore();
-		}
-		is.ignore();  // Remove trailing ']'
+	static void pack(Writer &w, const std::string &str) {
+		ArrayPacker<char>::pack(w, str.data(), str.size());
+	}
+	static void unpack(Reader &r, std::string &res) {
+		size_t count;
+		const uint8_t *p = ArrayPacker<char>::unpack(r, count);
+		res.assign(reinterpret_cast<const char*>(p), count);
+	}
+	static std::string unpack(Reader &r) {
+		std::string res;
+		unpack(r, res);
 		return res;
 	}
 };
 
+/* Inline size of packed values, for sizing a message before packing it. */
+inline size_t packedSize() { return 0; }
+
+template<typename F, typename... A>
+size_t packedSize(const F &first, const A&... args) {
+	return Packer<F>::size(first) + packedSize(args...);
+}
+
+inline void packAll(Writer &w) {}
+
+template<typename F, typename... A>
+void packAll(Writer &w, const F &first, const A&... args) {
+	Packer<F>::pack(w, first);
+	packAll(w, args...);
+}
+
 };  // namespace rpc
 };  // namespace dharc
 
@@ -0,0 +1,214 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_SHM_RING_HPP_
+#define DHARC_SHM_RING_HPP_
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+namespace dharc {
+/**
+ * Ring of frame slots in POSIX shared memory, for senses on the same host as
+ * the fabric. The sense writes frames into slots and sends only the slot's
+ * sequence number over RPC, the fabric then copies the frame from the slot
+ * straight into the region. There is one writer and one reader per ring. A
+ * slot is not reused until the reader has consumed it, so the writer never
+ * overwrites a frame being read and instead reports the ring full.
+ */
+class ShmRing {
+	public:
+	static constexpr uint32_t kVersion = 1;
+	static constexpr size_t kAlign = 64;
+
+	~ShmRing() {
+		munmap(map_, mapsize_);
+		if (owner_) shm_unlink(name_.c_str());
+	}
+
+	ShmRing(const ShmRing&) = delete;
+	ShmRing &operator=(const ShmRing&) = delete;
+
+	/**
+	 * Create a new ring as its writer. It is removed again when destroyed.
+	 * @param name Shared memory object name, starting with '/'.
+	 * @return New ring or nullptr on failure.
+	 */
+	static ShmRing *create(const std::string &name, size_t slots,
+			size_t slotbytes) {
+		if (slots == 0 || slotbytes == 0) return nullptr;
+
+		const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0) return nullptr;
+
+		const size_t stride = strideOf(slotbytes);
+		const size_t mapsize = sizeof(Header) + slots * stride;
+		void *map = MAP_FAILED;
+		if (ftruncate(fd, mapsize) == 0) {
+			map = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0);
+		}
+		close(fd);
+		if (map == MAP_FAILED) {
+			shm_unlink(name.c_str());
+			return nullptr;
+		}
+
+		Header *hdr = new (map) Header();
+		std::memcpy(hdr->magic, magic(), sizeof(hdr->magic));
+		hdr->version = kVersion;
+		hdr->slots = static_cast<uint32_t>(slots);
+		hdr->slotbytes = slotbytes;
+		hdr->written = 0;
+		hdr->consumed = 0;
+		for (auto i = 0U; i < slots; ++i) {
+			Slot *slot = new (static_cast<uint8_t*>(map) + sizeof(Header) +
+				i * stride) Slot();
+			slot->seq = 0;
+			slot->size = 0;
+		}
+
+		return new ShmRing(name, map, mapsize, true);
+	}
+
+	/**
+	 * Map an existing ring as its reader.
+	 * @return The ring or nullptr if missing or not a valid ring.
+	 */
+	static ShmRing *open(const std::string &name) {
+		const int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if (fd < 0) return nullptr;
+
+		struct stat st;
+		void *map = MAP_FAILED;
+		if (fstat(fd, &st) == 0 &&
+				static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+			map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0);
+		}
+		close(fd);
+		if (map == MAP_FAILED) return nullptr;
+
+		const Header *hdr = static_cast<const Header*>(map);
+		if (std::memcmp(hdr->magic, magic(), sizeof(hdr->magic)) != 0 ||
+				hdr->version != kVersion || hdr->slots == 0 ||
+				hdr->slotbytes == 0 ||
+				hdr->slotbytes > static_cast<size_t>(st.st_size) ||
+				hdr->slots > (static_cast<size_t>(st.st_size) - sizeof(Header)) /
+				strideOf(hdr->slotbytes)) {
+			munmap(map, st.st_size);
+			return nullptr;
+		}
+
+		return new ShmRing(name, map, st.st_size, false);
+	}
+
+	const std::string &name() const { return name_; }
+	size_t slots() const { return slots_; }
+	size_t slotBytes() const { return slotbytes_; }
+
+	/**
+	 * Copy a frame into the next slot.
+	 * @return Sequence number of the frame, or 0 if it does not fit or every
+	 *         slot still holds a frame the reader has not consumed.
+	 */
+	uint64_t write(const uint8_t *data, size_t size) {
+		Header *hdr = header();
+		if (size > slotbytes_) return 0;
+
+		const uint64_t seq = hdr->written.load(std::memory_order_relaxed) + 1;
+		if (seq - hdr->consumed.load(std::memory_order_acquire) > slots_) {
+			return 0;
+		}
+
+		Slot *s = slot(seq);
+		s->seq.store(2 * seq - 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		std::memcpy(s->data(), data, size);
+		s->size = size;
+		s->seq.store(2 * seq, std::memory_order_release);
+		hdr->written.store(seq, std::memory_order_release);
+		return seq;
+	}
+
+	/**
+	 * Hand a written frame to f(const uint8_t *data, size_t size), in place,
+	 * then release its slot and any earlier ones to the writer.
+	 * @return False if that frame is not in the ring.
+	 */
+	template <typename F>
+	bool read(uint64_t seq, F f) {
+		Header *hdr = header();
+		if (seq == 0 || seq > hdr->written.load(std::memory_order_acquire)) {
+			return false;
+		}
+
+		Slot *s = slot(seq);
+		if (s->seq.load(std::memory_order_acquire) != 2 * seq) return false;
+
+		const size_t size = s->size;
+		if (size > slotbytes_) return false;
+		f(static_cast<const uint8_t*>(s->data()), size);
+
+		uint64_t consumed = hdr->consumed.load(std::memory_order_relaxed);
+		while (consumed < seq && !hdr->consumed.compare_exchange_weak(consumed,
+				seq, std::memory_order_release)) {}
+		return true;
+	}
+
+	private:
+	static const char *magic() { return "DHARCSHM"; }
+
+	struct alignas(kAlign) Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t slots;
+		uint64_t slotbytes;
+		alignas(kAlign) std::atomic<uint64_t> written;   // Last frame written.
+		alignas(kAlign) std::atomic<uint64_t> consumed;  // Last frame read.
+	};
+
+	struct alignas(kAlign) Slot {
+		std::atomic<uint64_t> seq;  // Twice the frame number, odd if writing.
+		uint64_t size;
+
+		uint8_t *data() { return reinterpret_cast<uint8_t*>(this + 1); }
+	};
+
+	// Geometry is read once, so a misbehaving writer cannot later change it
+	// to make the reader step outside the mapping.
+	ShmRing(const std::string &name, void *map, size_t mapsize, bool owner)
+		: name_(name), map_(map), mapsize_(mapsize), owner_(owner),
+			slots_(header()->slots), slotbytes_(header()->slotbytes) {}
+
+	static size_t strideOf(size_t slotbytes) {
+		return sizeof(Slot) + (slotbytes + kAlign - 1) / kAlign * kAlign;
+	}
+
+	Header *header() const { return static_cast<Header*>(map_); }
+
+	Slot *slot(uint64_t seq) const {
+		return reinterpret_cast<Slot*>(static_cast<uint8_t*>(map_) +
+			sizeof(Header) + ((seq - 1) % slots_) * strideOf(slotbytes_));
+	}
+
+	const std::string name_;
+	void *map_;
+	size_t mapsize_;
+	const bool owner_;
+	const size_t slots_;
+	const size_t slotbytes_;
+};
+};  // namespace dharc
+
+#endif  // DHARC_SHM_RING_HPP_
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_TILES_HPP_
+#define DHARC_TILES_HPP_
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+namespace dharc {
+/**
+ * An image of one byte pixels split into equal tiles, for sending only the
+ * tiles that changed. Changes are a bitmap with bit n % 8 of byte n / 8 set
+ * if tile n changed, tiles counted row by row, and then the pixels of each
+ * tile changed in turn, row by row. The tiles must cover the image exactly.
+ */
+struct TileGrid {
+	size_t width;
+	size_t height;
+	size_t tilew;
+	size_t tileh;
+
+	size_t tilesX() const { return (tilew > 0) ? width / tilew : 0; }
+	size_t tilesY() const { return (tileh > 0) ? height / tileh : 0; }
+	size_t count() const { return tilesX() * tilesY(); }
+	size_t bitmapBytes() const { return (count() + 7) / 8; }
+	size_t tileBytes() const { return tilew * tileh; }
+
+	bool operator==(const TileGrid &g) const {
+		return width == g.width && height == g.height && tilew == g.tilew &&
+			tileh == g.tileh;
+	}
+	bool operator!=(const TileGrid &g) const { return !(*this == g); }
+
+	/**
+	 * List the tiles of next with a pixel differing from prev by more than
+	 * threshold, with their pixels from next.
+	 * @return Number of tiles changed.
+	 */
+	size_t diff(const uint8_t *prev, const uint8_t *next, int threshold,
+			std::vector<uint8_t> &bitmap, std::vector<uint8_t> &tiles) const {
+		const size_t n = count();
+		const size_t tx = tilesX();
+		size_t changed = 0;
+		bitmap.assign(bitmapBytes(), 0);
+		tiles.clear();
+
+		for (auto i = 0U; i < n; ++i) {
+			const size_t off = (i / tx) * tileh * width + (i % tx) * tilew;
+			bool same = true;
+			for (auto y = 0U; same && y < tileh; ++y) {
+				const uint8_t *a = prev + off + y * width;
+				const uint8_t *b = next + off + y * width;
+				if (threshold <= 0) {
+					same = std::memcmp(a, b, tilew) == 0;
+					continue;
+				}
+				for (auto x = 0U; same && x < tilew; ++x) {
+					same = std::abs(static_cast<int>(a[x]) - b[x]) <= threshold;
+				}
+			}
+			if (same) continue;
+
+			bitmap[i / 8] |= 1U << (i % 8);
+			for (auto y = 0U; y < tileh; ++y) {
+				const uint8_t *row = next + off + y * width;
+				tiles.insert(tiles.end(), row, row + tilew);
+			}
+			++changed;
+		}
+		return changed;
+	}
+
+	/**
+	 * List every tile of an image as changed, for sending it whole.
+	 */
+	void all(const uint8_t *image, std::vector<uint8_t> &bitmap,
+			std::vector<uint8_t> &tiles) const {
+		const size_t n = count();
+		bitmap.assign(bitmapBytes(), 0);
+		for (auto i = 0U; i < n; ++i) bitmap[i / 8] |= 1U << (i % 8);
+
+		tiles.resize(n * tileBytes());
+		uint8_t *out = tiles.data();
+		for (auto i = 0U; i < n; ++i) {
+			const uint8_t *tile = image + (i / tilesX()) * tileh * width +
+				(i % tilesX()) * tilew;
+			for (auto y = 0U; y < tileh; ++y) {
+				std::memcpy(out, tile + y * width, tilew);
+				out += tilew;
+			}
+		}
+	}
+
+	/**
+	 * Do the bitmap and tiles fit this grid.
+	 */
+	bool valid(const uint8_t *bitmap, size_t bitmapsize,
+			size_t tilessize) const {
+		const size_t n = count();
+		if (n == 0 || bitmapsize != bitmapBytes()) return false;
+		// No bits may be set past the last tile.
+		if (n % 8 != 0 && (bitmap[bitmapsize - 1] >> (n % 8)) != 0) return false;
+
+		size_t changed = 0;
+		for (auto i = 0U; i < bitmapsize; ++i) {
+			changed += __builtin_popcount(bitmap[i]);
+		}
+		return changed * tileBytes() == tilessize;
+	}
+
+	/**
+	 * Shrink each tile of an image to tw by th pixels, each the mean of those
+	 * it covers, giving an image of tilesX() * tw by tilesY() * th. Pixels
+	 * right of or below the last whole tile are left out.
+	 * @return False, writing nothing, unless 1 <= tw <= tilew and
+	 *         1 <= th <= tileh.
+	 */
+	bool shrink(const uint8_t *image, size_t tw, size_t th,
+			uint8_t *out) const {
+		if (tw == 0 || th == 0 || tw > tilew || th > tileh) return false;
+		const size_t ow = tilesX() * tw;
+		const size_t oh = tilesY() * th;
+
+		for (auto y = 0U; y < oh; ++y) {
+			const size_t y0 = (y / th) * tileh + (y % th) * tileh / th;
+			const size_t y1 = (y / th) * tileh + (y % th + 1) * tileh / th;
+			for (auto x = 0U; x < ow; ++x) {
+				const size_t x0 = (x / tw) * tilew + (x % tw) * tilew / tw;
+				const size_t x1 = (x / tw) * tilew + (x % tw + 1) * tilew / tw;
+				size_t sum = 0;
+				for (auto yy = y0; yy < y1; ++yy) {
+					const uint8_t *row = image + yy * width;
+					for (auto xx = x0; xx < x1; ++xx) sum += row[xx];
+				}
+				const size_t n = (x1 - x0) * (y1 - y0);
+				out[y * ow + x] = static_cast<uint8_t>((sum + n / 2) / n);
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Copy the tiles changed into an image, which must first be checked
+	 * with valid.
+	 */
+	void apply(uint8_t *image, const uint8_t *bitmap,
+			const uint8_t *tiles) const {
+		const size_t n = count();
+		const size_t tx = tilesX();
+
+		for (auto i = 0U; i < n; ++i) {
+			if ((bitmap[i / 8] & (1U << (i % 8))) == 0) continue;
+			uint8_t *dst = image + (i / tx) * tileh * width + (i % tx) * tilew;
+			for (auto y = 0U; y < tileh; ++y) {
+				std::memcpy(dst + y * width, tiles, tilew);
+				tiles += tilew;
+			}
+		}
+	}
+};
+};  // namespace dharc
+
+#endif  // DHARC_TILES_HPP_
@@ -2,10 +2,18 @@
  * Copyright 2015 Nicolas Pope
  */
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <thread>
 #include <chrono>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 
 #include "zmq.hpp"
 #include "dharc/rpc.hpp"
@@ -13,63 +21,379 @@
 using dharc::Rpc;
 using std::cout;
 
+constexpr std::chrono::seconds Rpc::kTimeout;
+
 namespace {
-zmq::context_t context(1);
+std::mutex ctxlock;
+zmq::context_t *ctx = nullptr;
+int iothreads = 1;
+
+/*
+ * Parts sent without copying hold one of these, so that the last of them to
+ * be released by the socket tells the sender its arrays are free again.
+ */
+struct Release {
+	explicit Release(std::shared_ptr<std::promise<void>> p) : done(p) {}
+	~Release() { done->set_value(); }
+	std::shared_ptr<std::promise<void>> done;
+};
+
+void releasePart(void *data, void *hint) {
+	delete static_cast<std::shared_ptr<Release>*>(hint);
+}
+
+/* How a request that waits for its reply ended. */
+enum struct Outcome {
+	replied,
+	unreachable,  // No reply in time.
+	unreadable    // Too short for the results expected, see Rpc::send.
+};
 };
 
-Rpc::Rpc(const char *addr, int port) : sock_(context, ZMQ_REQ) {
-	uri_ = "tcp://";
-	uri_ += addr;
-	uri_ += ':';
-	uri_ += std::to_string(port);
+zmq::context_t &dharc::rpc::context() {
+	std::lock_guard<std::mutex> lk(ctxlock);
+	// Never destroyed, as terminating it waits for every socket to close.
+	if (ctx == nullptr) ctx = new zmq::context_t(iothreads);
+	return *ctx;
+}
 
+
+
+bool dharc::rpc::setIoThreads(int threads) {
+	std::lock_guard<std::mutex> lk(ctxlock);
+	if (ctx != nullptr || threads < 1) return false;
+	iothreads = threads;
+	return true;
+}
+
+
+
+Rpc::Rpc(const char *addr, int port)
+	: Rpc("tcp://" + std::string(addr) + ':' + std::to_string(port)) {
+}
+
+Rpc::Rpc(const std::string &endpoint)
+	: uri_(endpoint), sock_(rpc::context(), ZMQ_DEALER),
+		wakefd_(eventfd(0, EFD_NONBLOCK)), nextid_(0), stopping_(false),
+		compression_(rpc::Compression::none()) {
+	int linger = 0;
+	sock_.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
 	sock_.connect(uri_.c_str());
 
+	thread_ = std::thread(&Rpc::io, this);
+
 	// Do a version check!
-	if (send<Command::version>() != static_cast<int>(Command::end)) {
+	int version = static_cast<int>(Command::end);
+	try {
+		version = send<Command::version>();
+	} catch (const std::runtime_error &err) {
+		// Turned away by a busy server, which says nothing of its version.
+	}
+	if (version != static_cast<int>(Command::end)) {
 		cout << "!!! dharcd uses different version of rpc protocol !!!";
 		cout << std::endl;
 	}
 }
 
 Rpc::~Rpc() {
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		stopping_ = true;
+	}
+	const uint64_t one = 1;
+	if (write(wakefd_, &one, sizeof(one)) < 0) {}
+	thread_.join();
+	close(wakefd_);
+}
+
+
+
+bool Rpc::setCompression(const rpc::Compression &c) {
+	const uint32_t peer = send<Command::compression>(rpc::codecs(),
+		static_cast<int>(c.codec), c.level, c.threshold);
+
+	std::lock_guard<std::mutex> lk(lock_);
+	compression_ = rpc::negotiate(c, peer);
+	return peer != 0;
+}
+
+
+
+dharc::rpc::CompressStats Rpc::compressStats() {
+	return send<Command::compressstats>();
+}
+
+
+
+vector<dharc::rpc::CommandStats> Rpc::commandStats() {
+	return send<Command::rpcstats>();
+}
+
+
+
+vector<dharc::rpc::LaneStats> Rpc::laneStats() {
+	return send<Command::lanestats>();
+}
+
+
+
+dharc::rpc::Compression Rpc::compression() {
+	std::lock_guard<std::mutex> lk(lock_);
+	return compression_;
+}
+
+
+
+void Rpc::send(rpc::Batch &batch) {
+	assert(batch.size() <= rpc::kMaxBatch);
+	const uint32_t count = static_cast<uint32_t>(batch.size());
+	zmq::message_t msg(sizeof(Command) + sizeof(count) + batch.buf_.size());
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Writer w(msg.data(), &parts);
+	const Command c = Command::batch;
+	w.write(&c, sizeof(Command));
+	w.write(&count, sizeof(count));
+	w.write(batch.buf_.data(), batch.buf_.size());
+
+	// A command the server could not run ends the batch, so the reply is
+	// short of its results and those of every command after it.
+	request(&msg, batch.parts_, [&batch](rpc::Reader &r) {
+		for (auto &unpack : batch.unpack_) unpack(r);
+	});
+}
+
+
+
+void Rpc::request(zmq::message_t *msg,
+		const vector<rpc::View<uint8_t>> &parts,
+		std::function<void(rpc::Reader&)> unpack) {
+	// Promises are shared with the client's thread, which may still be
+	// finishing setting them when this returns.
+	auto replied = std::make_shared<std::promise<Outcome>>();
+	auto released = std::make_shared<std::promise<void>>();
+	auto outcome = replied->get_future();
+	auto done = released->get_future();
+
+	enqueue(msg, parts, [unpack, replied](rpc::Reader *r) {
+		if (r == nullptr) {
+			replied->set_value(Outcome::unreachable);
+			return;
+		}
+		unpack(*r);
+		replied->set_value(r->ok() ? Outcome::replied : Outcome::unreadable);
+	}, released);
+
+	const Outcome res = outcome.get();
+	done.wait();
+	if (res == Outcome::unreachable) exit(1);
+	if (res == Outcome::unreadable) {
+		throw std::runtime_error("Server could not run the command");
+	}
+}
+
+
+
+void Rpc::enqueue(zmq::message_t *msg,
+		const vector<rpc::View<uint8_t>> &parts,
+		Handler handler, std::shared_ptr<std::promise<void>> released) {
+	Request req;
+	req.frames.emplace_back(std::move(*msg));
+
+	std::shared_ptr<Release> hold;
+	if (released != nullptr) hold = std::make_shared<Release>(released);
+
+	for (auto &p : parts) {
+		if (hold) {
+			req.frames.emplace_back(const_cast<uint8_t*>(p.data), p.count,
+				releasePart, new std::shared_ptr<Release>(hold));
+		} else {
+			req.frames.emplace_back(p.count);
+			std::memcpy(req.frames.back().data(), p.data, p.count);
+		}
+	}
+	req.handler = std::move(handler);
+	req.deadline = std::chrono::steady_clock::now() + kTimeout;
+
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		req.id = ++nextid_;
+		outgoing_.push_back(std::move(req));
+	}
+
+	// Parts now hold the only references, so done is set when they are.
+	hold.reset();
+
+	const uint64_t one = 1;
+	if (write(wakefd_, &one, sizeof(one)) < 0) {}
 }
 
 
-std::string Rpc::send(const std::string &s) {
-	zmq::message_t req(const_cast<char*>(s.data()), s.size(), 0, 0);
+
+void Rpc::io() {
+	std::deque<Request> sending;  // Waiting for room in the socket.
+	auto heard = std::chrono::steady_clock::now();  // Last reply received.
 
 	while (true) {
+		// Sleep until a reply, a request, room to send or the next deadline.
+		long timeout = -1;
+		if (!pending_.empty() || !sending.empty()) {
+			auto first = std::chrono::steady_clock::time_point::max();
+			for (auto &p : pending_) first = std::min(first, p.second.deadline);
+			for (auto &r : sending) first = std::min(first, r.deadline);
+			timeout = std::max(0L, static_cast<long>(
+				std::chrono::duration_cast<std::chrono::milliseconds>(
+				first - std::chrono::steady_clock::now()).count()) + 1);
+		}
+
+		const short events = sending.empty() ? ZMQ_POLLIN :
+			(ZMQ_POLLIN | ZMQ_POLLOUT);
+		zmq::pollitem_t items[] = {
+			{ static_cast<void*>(sock_), 0, events, 0 },
+			{ nullptr, wakefd_, ZMQ_POLLIN, 0 }
+		};
 		try {
-			sock_.send(req);
+			zmq::poll(&items[0], 2, timeout);
+		} catch (const zmq::error_t &err) {
+			continue;
+		}
+
+		if (items[1].revents & ZMQ_POLLIN) {
+			uint64_t count;
+			if (read(wakefd_, &count, sizeof(count)) < 0) {}
+		}
+
+		bool stop;
+		{
+			std::lock_guard<std::mutex> lk(lock_);
+			for (auto &r : outgoing_) sending.push_back(std::move(r));
+			outgoing_.clear();
+			stop = stopping_;
+		}
+
+		if (stop) {
+			for (auto &r : sending) r.handler(nullptr);
 			break;
-		} catch (zmq::error_t err) {
-			cout << "ZMQ send error: " << err.what() << "\n";
+		}
+
+		// Each request goes out as its id, an empty delimiter and then its
+		// own frames, and the reply comes back the same way. Once the socket
+		// is full the rest wait, in order, for it to have room again.
+		while (!sending.empty()) {
+			Request &r = sending.front();
+			zmq::message_t id(sizeof(r.id));
+			std::memcpy(id.data(), &r.id, sizeof(r.id));
+			zmq::message_t empty;
+
+			try {
+				if (!sock_.send(id, ZMQ_SNDMORE | ZMQ_DONTWAIT)) break;
+				sock_.send(empty, ZMQ_SNDMORE);
+				for (auto i = 0U; i < r.frames.size(); ++i) {
+					sock_.send(r.frames[i],
+						(i + 1 < r.frames.size()) ? ZMQ_SNDMORE : 0);
+				}
+				pending_[r.id] = Pending{std::move(r.handler), r.deadline};
+			} catch (const zmq::error_t &err) {
+				cout << "ZMQ send error: " << err.what() << "\n";
+				r.handler(nullptr);
+			}
+			sending.pop_front();
+		}
+
+		if ((items[0].revents & ZMQ_POLLIN) && receive()) {
+			heard = std::chrono::steady_clock::now();
+		}
+
+		// A request that is late fails alone, unless the server has been
+		// silent for as long, when it is taken to be gone.
+		const auto now = std::chrono::steady_clock::now();
+		bool late = false;
+		for (auto it = sending.begin(); it != sending.end();) {
+			if (it->deadline > now) {
+				++it;
+				continue;
+			}
+			it->handler(nullptr);
+			it = sending.erase(it);
+			late = true;
+		}
+		for (auto it = pending_.begin(); it != pending_.end();) {
+			if (it->second.deadline > now) {
+				++it;
+				continue;
+			}
+			it->second.handler(nullptr);
+			it = pending_.erase(it);
+			late = true;
+		}
+
+		if (late && now - heard >= kTimeout) {
+			cout << "Server unreachable!\n";
+			reconnect();
+			heard = now;
 		}
 	}
 
-	zmq::message_t rep;
+	for (auto &p : pending_) p.second.handler(nullptr);
+	pending_.clear();
+}
+
+
+
+bool Rpc::receive() {
+	vector<zmq::message_t> msg;
+	vector<rpc::View<uint8_t>> parts;
+	bool any = false;
 
 	while (true) {
-		int retry = 500;
+		msg.clear();
+		msg.emplace_back();
 		try {
-			while (retry > 0 && !sock_.recv(&rep, ZMQ_NOBLOCK)) {
-				--retry;
-				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			if (!sock_.recv(&msg[0], ZMQ_DONTWAIT)) return any;
+			while (msg.back().more()) {
+				msg.emplace_back();
+				sock_.recv(&msg.back());
 			}
+		} catch (const zmq::error_t &err) {
+			cout << "ZMQ receive error: " << err.what() << "\n";
+			return any;
+		}
 
-			if (retry == 0) {
-				sock_.disconnect(uri_.c_str());
-				cout << "Server unreachable!\n";
-				exit(1);
-			}
+		uint64_t id = 0;
+		if (msg.size() < 3 || msg[0].size() != sizeof(id) ||
+				msg[1].size() != 0) {
+			continue;
+		}
+		std::memcpy(&id, msg[0].data(), sizeof(id));
+		any = true;
 
-			break;
-		} catch (zmq::error_t err) {
-			cout << "ZMQ receive error: " << err.what() << "\n";
+		// Replies to requests that timed out are ignored.
+		auto it = pending_.find(id);
+		if (it == pending_.end()) continue;
+
+		// Views are only taken now, since small messages move with their data.
+		parts.clear();
+		for (auto i = 3U; i < msg.size(); ++i) {
+			parts.emplace_back(static_cast<const uint8_t*>(msg[i].data()),
+				msg[i].size());
 		}
-	}
+		rpc::Reader r(msg[2].data(), msg[2].size(), parts.data(), parts.size());
 
-	return std::string((const char*)rep.data(), rep.size());
+		Handler handler = std::move(it->second.handler);
+		pending_.erase(it);
+		handler(&r);
+	}
 }
 
+
+
+void Rpc::reconnect() {
+	// Closing the socket drops whatever it still holds, releasing the parts
+	// of requests that never reached the server.
+	sock_ = zmq::socket_t(rpc::context(), ZMQ_DEALER);
+	int linger = 0;
+	sock_.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+	sock_.connect(uri_.c_str());
+
+	for (auto &p : pending_) p.second.handler(nullptr);
+	pending_.clear();
+}
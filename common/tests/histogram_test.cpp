@@ -0,0 +1,48 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#include "lest.hpp"
+
+#include "dharc/histogram.hpp"
+
+using dharc::Histogram;
+
+const lest::test specification[] = {
+
+CASE( "Small values are exact" ) {
+	for (auto i = 0U; i < Histogram::kSubBuckets * 2; ++i) {
+		EXPECT( Histogram::bucketValue(Histogram::index(i)) == i );
+	}
+},
+
+CASE( "Bucket lower bounds are within relative error" ) {
+	for (uint64_t v = 1; v < (1ULL << 40); v = v * 3 + 1) {
+		const uint64_t low = Histogram::bucketValue(Histogram::index(v));
+		const uint64_t err = (v - low) * Histogram::kSubBuckets;
+		EXPECT( low <= v );
+		EXPECT( err <= v );
+	}
+	EXPECT( Histogram::index(UINT64_MAX) == Histogram::kBuckets - 1 );
+},
+
+CASE( "Percentiles, mean and max" ) {
+	Histogram h;
+	for (auto i = 1U; i <= 1000; ++i) h.record(i);
+
+	EXPECT( h.count() == 1000U );
+	EXPECT( h.max() == 1000U );
+	EXPECT( h.mean() == 500.5 );
+	EXPECT( h.percentile(0.5) >= 500U );
+	EXPECT( h.percentile(0.5) <= 500U + 500U / Histogram::kSubBuckets );
+	EXPECT( h.percentile(1.0) == 1000U );
+
+	h.reset();
+	EXPECT( h.count() == 0U );
+	EXPECT( h.percentile(0.99) == 0U );
+}
+};
+
+int main(int argc, char *argv[]) {
+	return lest::run(specification, argc, argv);
+}
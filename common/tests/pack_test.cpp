@@ -8,7 +8,8 @@
 
 #include <vector>
 #include <list>
-#include <sstream>
+#include <string>
+#include <cstring>
 
 using namespace dharc;
 using std::vector;
@@ -17,38 +18,47 @@ using std::list;
 const lest::test specification[] = {
 
 CASE( "Pack numbers" ) {
-	std::stringstream ss;
-	rpc::Packer<int>::pack(ss, 3456);
-	EXPECT( ss.str() == "3456" );
+	vector<uint8_t> buf(rpc::packedSize(3456, 34.56f));
+	EXPECT( buf.size() == (sizeof(int) + sizeof(float)) );
 
-	ss.str("");
-	rpc::Packer<float>::pack(ss, 34.56);
-	EXPECT( ss.str() == "34.56" );
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Writer w(buf.data(), &parts);
+	rpc::packAll(w, 3456, 34.56f);
+	int i;
+	std::memcpy(&i, buf.data(), sizeof(i));
+	EXPECT( i == 3456 );
 },
 
 CASE( "Unpack numbers" ) {
-	std::stringstream ss;
-	ss.str("45667");
-	EXPECT( rpc::Packer<int>::unpack(ss) == 45667 );
+	const int x = 45667;
+	rpc::Reader r(&x, sizeof(x));
+	EXPECT( rpc::Packer<int>::unpack(r) == 45667 );
+	EXPECT( r.ok() );
 },
 
 CASE( "Unpack numbers (fail)" ) {
-	std::stringstream ss;
-	ss.str("@445");
-	EXPECT( rpc::Packer<int>::unpack(ss) == 0 );
+	const int x = 445;
+	rpc::Reader r(&x, sizeof(x) - 1);
+	EXPECT( rpc::Packer<int>::unpack(r) == 0 );
+	EXPECT( !r.ok() );
 },
 
 CASE( "Pack and unpack a vector of numbers" ) {
 	vector<int> vec = {
 		45, 46, 47, 48
 	};
-	std::stringstream ss;
-	rpc::Packer<vector<int>>::pack(ss, vec);
-	EXPECT( ss.str() == "[45,46,47,48]" );
+	vector<uint8_t> buf(rpc::packedSize(vec));
+	EXPECT( buf.size() == (8 + 4 * sizeof(int)) );
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Writer w(buf.data(), &parts);
+	rpc::Packer<vector<int>>::pack(w, vec);
+
+	rpc::Reader r(buf.data(), buf.size());
 	vector<int> res;
-	res = rpc::Packer<vector<int>>::unpack(ss);
+	res = rpc::Packer<vector<int>>::unpack(r);
 	EXPECT( res[0] == 45 );
 	EXPECT( res[3] == 48 );
+	EXPECT( r.ok() );
 },
 
 CASE( "Pack and unpack a vector of vectors" ) {
@@ -57,24 +67,168 @@ CASE( "Pack and unpack a vector of vectors" ) {
 		{ 23, 24, 25, 26 },
 		{ 34, 35, 36, 37 }
 	};
-	std::stringstream ss;
-	rpc::Packer<vector<vector<int>>>::pack(ss, vec);
-	EXPECT( ss.str() == "[[45,46,47,48],[23,24,25,26],[34,35,36,37]]" );
+	vector<uint8_t> buf(rpc::packedSize(vec));
+	EXPECT( buf.size() == (8 + 3 * (8 + 4 * sizeof(int))) );
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Writer w(buf.data(), &parts);
+	rpc::Packer<vector<vector<int>>>::pack(w, vec);
+
+	rpc::Reader r(buf.data(), buf.size());
 	vector<vector<int>> res;
-	res = rpc::Packer<vector<vector<int>>>::unpack(ss);
+	res = rpc::Packer<vector<vector<int>>>::unpack(r);
 	EXPECT( res[0][0] == 45 );
 	EXPECT( res[2][3] == 37 );
+	EXPECT( res == vec );
 },
 
 CASE( "Pack and unpack a list" ) {
 	list<int> lst = { 56, 57, 58 };
-	std::stringstream ss;
-	rpc::Packer<list<int>>::pack(ss, lst);
-	EXPECT( ss.str() == "[56,57,58]" );
+	vector<uint8_t> buf(rpc::packedSize(lst));
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Writer w(buf.data(), &parts);
+	rpc::Packer<list<int>>::pack(w, lst);
+
+	// The same on the wire as a vector.
+	rpc::Reader r(buf.data(), buf.size());
+	EXPECT( rpc::Packer<vector<int>>::unpack(r) == vector<int>({56, 57, 58}) );
+
+	rpc::Reader r2(buf.data(), buf.size());
 	list<int> res;
-	res = rpc::Packer<list<int>>::unpack(ss);
+	res = rpc::Packer<list<int>>::unpack(r2);
 	EXPECT( res.front() == 56 );
 	EXPECT( res.back() == 58 );
+},
+
+CASE( "Large lists and lists of strings round trip" ) {
+	list<Node> nodes;
+	for (auto i = 0U; i < rpc::kPartBytes; ++i) nodes.push_back(Node(i));
+	list<std::string> names = { "alpha", "", "gamma" };
+
+	vector<uint8_t> buf(rpc::packedSize(nodes, names));
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Writer w(buf.data(), &parts);
+	rpc::packAll(w, nodes, names);
+	EXPECT( parts.empty() );
+
+	rpc::Reader r(buf.data(), buf.size());
+	EXPECT( rpc::Packer<vector<Node>>::unpack(r).size() == nodes.size() );
+	EXPECT( rpc::Packer<list<std::string>>::unpack(r) == names );
+	EXPECT( r.ok() );
+	EXPECT( r.remaining() == 0U );
+},
+
+CASE( "Unpack a corrupt element count (fail)" ) {
+	const uint64_t count = 1000000;
+	rpc::Reader r(&count, sizeof(count));
+	EXPECT( rpc::Packer<vector<std::string>>::unpack(r).empty() );
+	EXPECT( !r.ok() );
+
+	// Inline arrays are never this large.
+	const uint64_t flagged = 3 | rpc::kPartFlag;
+	rpc::Reader r2(&flagged, sizeof(flagged));
+	EXPECT( rpc::Packer<vector<uint8_t>>::unpack(r2).empty() );
+	EXPECT( !r2.ok() );
+},
+
+CASE( "Pack into a buffer sized beforehand" ) {
+	vector<uint16_t> vec = { 1, 2, 3 };
+	vector<uint8_t> buf(rpc::packedSize(7, vec));
+	EXPECT( buf.size() == (sizeof(int) + 8 + 3 * sizeof(uint16_t)) );
+
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Writer w(buf.data(), &parts);
+	rpc::packAll(w, 7, vec);
+	EXPECT( parts.empty() );
+	EXPECT( w.written() == buf.size() );
+
+	rpc::Reader r(buf.data(), buf.size());
+	EXPECT( rpc::Packer<int>::unpack(r) == 7 );
+	EXPECT( rpc::Packer<vector<uint16_t>>::unpack(r) == vec );
+	EXPECT( r.ok() );
+	EXPECT( r.consumed() == buf.size() );
+},
+
+CASE( "Large arrays are separate parts referring to the original" ) {
+	vector<uint8_t> frame(rpc::kPartBytes, 42);
+	vector<uint8_t> buf(rpc::packedSize(rpc::View<uint8_t>(frame)));
+	EXPECT( buf.size() == 8U );
+
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Writer w(buf.data(), &parts);
+	rpc::Packer<rpc::View<uint8_t>>::pack(w, frame);
+	EXPECT( parts.size() == 1U );
+	EXPECT( parts[0].data == frame.data() );
+
+	// Unpacking a view refers into the part, a vector copies it.
+	rpc::Reader r(buf.data(), buf.size(), parts.data(), parts.size());
+	auto view = rpc::Packer<rpc::View<uint8_t>>::unpack(r);
+	EXPECT( view.data == frame.data() );
+	EXPECT( view.size() == frame.size() );
+
+	rpc::Reader r2(buf.data(), buf.size(), parts.data(), parts.size());
+	vector<uint8_t> res(10);
+	rpc::Packer<vector<uint8_t>>::unpack(r2, res);
+	EXPECT( res == frame );
+},
+
+CASE( "Unpack a short buffer (fail)" ) {
+	vector<uint8_t> buf(rpc::packedSize(std::string("hello")));
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Writer w(buf.data(), &parts);
+	rpc::Packer<std::string>::pack(w, "hello");
+
+	rpc::Reader r(buf.data(), buf.size() - 1);
+	EXPECT( rpc::Packer<std::string>::unpack(r).empty() );
+	EXPECT( rpc::Packer<int>::unpack(r) == 0 );
+	EXPECT( !r.ok() );
+
+	// A large array whose part is missing.
+	uint64_t count = rpc::kPartBytes | rpc::kPartFlag;
+	rpc::Reader r2(&count, sizeof(count));
+	EXPECT( rpc::Packer<vector<uint8_t>>::unpack(r2).empty() );
+	EXPECT( !r2.ok() );
+},
+
+CASE( "Large arrays are compressed if it is worth it" ) {
+	vector<uint16_t> frame(rpc::kCompressBytes, 42);
+	vector<uint8_t> noise(rpc::kCompressBytes);
+	uint32_t x = 1;
+	for (auto &n : noise) {
+		x = x * 1103515245 + 12345;
+		n = x >> 24;
+	}
+
+	vector<uint8_t> buf(rpc::packedSize(frame, noise));
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Compressor comp(rpc::Compression::dense());
+	rpc::Writer w(buf.data(), &parts, &comp);
+	rpc::packAll(w, frame, noise);
+	EXPECT( parts.size() == 2U );
+	EXPECT( parts[0].count < (frame.size() * sizeof(uint16_t)) );
+	EXPECT( parts[1].data == noise.data() );
+
+	rpc::Reader r(buf.data(), buf.size(), parts.data(), parts.size());
+	EXPECT( rpc::Packer<vector<uint16_t>>::unpack(r) == frame );
+	EXPECT( rpc::Packer<vector<uint8_t>>::unpack(r) == noise );
+	EXPECT( r.ok() );
+},
+
+CASE( "Unpack a corrupt compressed array (fail)" ) {
+	vector<uint8_t> frame(rpc::kCompressBytes, 42);
+	vector<uint8_t> buf(rpc::packedSize(frame));
+	vector<rpc::View<uint8_t>> parts;
+	rpc::Compressor comp(rpc::Compression::fast());
+	rpc::Writer w(buf.data(), &parts, &comp);
+	rpc::Packer<vector<uint8_t>>::pack(w, frame);
+	EXPECT( parts.size() == 1U );
+
+	vector<uint8_t> bad(parts[0].data, parts[0].data + parts[0].count);
+	bad[bad.size() / 2] ^= 0xFF;
+	bad.pop_back();
+	rpc::View<uint8_t> badpart(bad);
+	rpc::Reader r(buf.data(), buf.size(), &badpart, 1);
+	EXPECT( rpc::Packer<vector<uint8_t>>::unpack(r).empty() );
+	EXPECT( !r.ok() );
 }
 
 };
@@ -4,48 +4,98 @@
 
 #include "lest.hpp"
 
-// HACK
 #include "zmq.hpp"
-#define socket_t dummy
-namespace zmq {
-	typedef int dummy;
-};  // namespace zmq
-
 #include "dharc/rpc.hpp"
-#include "dharc/node.hpp"
-#include "dharc/tail.hpp"
 
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
-#include <list>
 
-using namespace dharc;
+using dharc::rpc::Batch;
 using std::vector;
-using std::list;
 
 /* ==== MOCKS =============================================================== */
 
-std::string dummy_result;
-std::string gen_string;
-
-
-dharc::Rpc::Rpc(const char *addr, int port) {
+namespace {
+/*
+ * Stands in for dharcd on an inproc endpoint, answering version as the real
+ * server would and every other request with whatever body it is given, so
+ * that the client can be shown replies the real one only sends when wrong.
+ */
+class FakeServer {
+	public:
+	explicit FakeServer(const std::string &endpoint)
+		: sock_(dharc::rpc::context(), ZMQ_ROUTER), stop_(false) {
+		int linger = 0;
+		sock_.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+		sock_.bind(endpoint);
+		thread_ = std::thread(&FakeServer::run, this);
+	}
 
-}
+	~FakeServer() {
+		stop_ = true;
+		thread_.join();
+	}
 
-dharc::Rpc::~Rpc() {
+	void reply(const vector<uint8_t> &body) {
+		std::lock_guard<std::mutex> lk(lock_);
+		reply_ = body;
+	}
 
-}
+	private:
+	void run() {
+		zmq::pollitem_t item = { static_cast<void*>(sock_), 0, ZMQ_POLLIN, 0 };
+		while (!stop_) {
+			if (zmq::poll(&item, 1, 10) <= 0) continue;
+
+			vector<zmq::message_t> msg;
+			do {
+				msg.emplace_back();
+				sock_.recv(&msg.back());
+			} while (msg.back().more());
+
+			// Routing id, request id and the empty delimiter, then the body.
+			int cmd = -1;
+			if (msg.size() > 3 && msg[3].size() >= sizeof(cmd)) {
+				std::memcpy(&cmd, msg[3].data(), sizeof(cmd));
+			}
+
+			vector<uint8_t> body;
+			if (cmd == static_cast<int>(Command::version)) {
+				const int version = static_cast<int>(Command::end);
+				body.resize(sizeof(version));
+				std::memcpy(body.data(), &version, sizeof(version));
+			} else {
+				std::lock_guard<std::mutex> lk(lock_);
+				body = reply_;
+			}
+
+			for (auto i = 0U; i < 3 && i < msg.size(); ++i) {
+				sock_.send(msg[i], ZMQ_SNDMORE);
+			}
+			zmq::message_t rep(body.size());
+			std::memcpy(rep.data(), body.data(), body.size());
+			sock_.send(rep);
+		}
+	}
 
-std::string dharc::Rpc::send(const std::string &s) {
-	gen_string = s;
-	return dummy_result;
-}
+	zmq::socket_t sock_;
+	std::atomic<bool> stop_;
+	std::mutex lock_;
+	vector<uint8_t> reply_;
+	std::thread thread_;
+};
 
-std::ostream &dharc::operator<<(std::ostream &os, const Node &n) {
-	os << '<' << static_cast<int>(n.value) << '>';
-	return os;
+vector<uint8_t> floats(const vector<float> &v) {
+	vector<uint8_t> res(v.size() * sizeof(float));
+	std::memcpy(res.data(), v.data(), res.size());
+	return res;
 }
+};  // namespace
 
 
 /* ========================================================================== */
@@ -53,24 +103,24 @@ std::ostream &dharc::operator<<(std::ostream &os, const Node &n) {
 
 class TestRpc : public dharc::Rpc {
 	public:
-	TestRpc() : Rpc("", 0) {}
-	~TestRpc() {}
+	explicit TestRpc(const std::string &endpoint) : Rpc(endpoint) {}
 
-	int version() {
-		return send<Command::version>();
+	float procps() {
+		return send<Command::procps>();
 	}
 
-	Node query(const Tail &tail) {
-		return send<Command::query>(tail);
+	std::future<float> procpsAsync() {
+		return async<Command::procps>();
 	}
 
-	bool define(const Tail &tail,
-				const vector<Node> &def) {
-		return send<Command::define>(tail, def);
+	dharc::Metrics metrics() {
+		return send<Command::metrics2d>(size_t(0));
 	}
 
-	vector<Tail> partners(const Node &n, const int &count) {
-		return send<Command::partners>(n, count);
+	void stats(float &procps, float &framecpu) {
+		Batch batch;
+		batch.add<Command::procps>(procps).add<Command::framecpu>(framecpu);
+		send(batch);
 	}
 };
 
@@ -79,52 +129,57 @@ class TestRpc : public dharc::Rpc {
 
 const lest::test specification[] = {
 
-CASE( "Version no arguments command send" ) {
-	TestRpc testrpc;
-	dummy_result = "66";
-	EXPECT( testrpc.version() == 66 );
-	EXPECT( gen_string == "{\"c\": 1, \"args\": []}" );
-},
+CASE( "Complete replies are unpacked" ) {
+	FakeServer server("inproc://rpc-test-complete");
+	TestRpc rpc("inproc://rpc-test-complete");
 
-CASE( "Query two Node argument command send" ) {
-	TestRpc testrpc;
-	dummy_result = "\"0:0\"";
-	EXPECT( testrpc.query(Tail{55_n, 66_n}) == null_n );
-	EXPECT( gen_string == "{\"c\": 2, \"args\": [[\"55\",\"66\"]]}" );
-},
+	server.reply(floats({2.5f}));
+	EXPECT( rpc.procps() == 2.5f );
+	EXPECT( rpc.procpsAsync().get() == 2.5f );
 
-CASE( "Define with vector argument" ) {
-	TestRpc testrpc;
-	dummy_result = "1";
-	vector<Node> def = {100_n, 200_n, 300_n};
-	EXPECT( testrpc.define(Tail{12_n, 13_n}, def) == true );
-	EXPECT( gen_string ==
-		"{\"c\": 4, \"args\": [[\"12\",\"13\"],[\"100\",\"200\",\"300\"]]}" );
+	float procps = 0.0f;
+	float framecpu = 0.0f;
+	server.reply(floats({1.0f, 3.0f}));
+	rpc.stats(procps, framecpu);
+	EXPECT( procps == 1.0f );
+	EXPECT( framecpu == 3.0f );
 },
 
-CASE( "Returning a vector" ) {
-	TestRpc testrpc;
-	dummy_result = "[[\"133\",\"344\"]]";
-	int count = 10;
-	vector<Tail> result = testrpc.partners(10_n, count);
-	EXPECT( result.front().at(0) == 133_n );
-	EXPECT( result.front().at(result.front().size() - 1) == 344_n );
-}
+CASE( "Empty replies to rejected requests fail the call" ) {
+	FakeServer server("inproc://rpc-test-rejected");
+	TestRpc rpc("inproc://rpc-test-rejected");
 
-/*
-CASE( "Invalid command (static fail)" ) {
-	rpc::send<static_cast<rpc::Command>(5000)>();
-},*/
+	server.reply({});
+	EXPECT_THROWS_AS( rpc.procps(), std::runtime_error );
+	EXPECT_THROWS_AS( rpc.procpsAsync().get(), std::runtime_error );
 
-/*
-CASE( "Incorrect arguments (static fail)" ) {
-	rpc::send<rpc::Command::partners>(44_n, 55_n);
+	// The client carries on once the server replies properly again.
+	server.reply(floats({4.0f}));
+	EXPECT( rpc.procps() == 4.0f );
+},
+
+CASE( "Replies too short for their result fail the call" ) {
+	FakeServer server("inproc://rpc-test-short");
+	TestRpc rpc("inproc://rpc-test-short");
+
+	server.reply(floats({1.0f, 2.0f}));
+	EXPECT_THROWS_AS( rpc.metrics(), std::runtime_error );
 },
-*/
 
+CASE( "Batches missing later results fail but keep the earlier ones" ) {
+	FakeServer server("inproc://rpc-test-batch");
+	TestRpc rpc("inproc://rpc-test-batch");
+
+	// As when the server stops at a command it cannot run.
+	float procps = 0.0f;
+	float framecpu = 0.0f;
+	server.reply(floats({7.0f}));
+	EXPECT_THROWS_AS( rpc.stats(procps, framecpu), std::runtime_error );
+	EXPECT( procps == 7.0f );
+	EXPECT( framecpu == 0.0f );
+}
 };
 
 int main(int argc, char *argv[]) {
 	return lest::run(specification, argc, argv);
 }
-
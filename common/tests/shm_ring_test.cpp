@@ -0,0 +1,87 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lest.hpp"
+
+#include "dharc/shm_ring.hpp"
+
+using dharc::ShmRing;
+using std::vector;
+
+namespace {
+std::string ringName() {
+	return "/dharc-test-" + std::to_string(getpid());
+}
+};
+
+const lest::test specification[] = {
+
+CASE( "Reader sees frames written by the writer" ) {
+	std::unique_ptr<ShmRing> w(ShmRing::create(ringName(), 2, 16));
+	EXPECT( w != nullptr );
+	std::unique_ptr<ShmRing> r(ShmRing::open(ringName()));
+	EXPECT( r != nullptr );
+	EXPECT( r->slots() == 2U );
+	EXPECT( r->slotBytes() == 16U );
+
+	const vector<uint8_t> frame{1, 2, 3, 4, 5};
+	const uint64_t seq = w->write(frame.data(), frame.size());
+	EXPECT( seq == 1U );
+
+	vector<uint8_t> got;
+	EXPECT( r->read(seq, [&got](const uint8_t *d, size_t n) {
+		got.assign(d, d + n);
+	}) );
+	EXPECT( got == frame );
+	EXPECT( !r->read(seq + 1, [](const uint8_t*, size_t) {}) );
+},
+
+CASE( "Writer never overwrites an unconsumed frame" ) {
+	std::unique_ptr<ShmRing> w(ShmRing::create(ringName(), 2, 16));
+	std::unique_ptr<ShmRing> r(ShmRing::open(ringName()));
+	const uint8_t frame[16] = {0};
+
+	EXPECT( w->write(frame, 17) == 0U );
+	EXPECT( w->write(frame, 16) == 1U );
+	EXPECT( w->write(frame, 16) == 2U );
+	EXPECT( w->write(frame, 16) == 0U );
+
+	// Consuming the second releases the first as well.
+	EXPECT( r->read(2, [](const uint8_t*, size_t) {}) );
+	EXPECT( w->write(frame, 16) == 3U );
+	EXPECT( w->write(frame, 16) == 4U );
+	EXPECT( !r->read(1, [](const uint8_t*, size_t) {}) );
+},
+
+CASE( "Open fails for missing rings and creation for existing ones" ) {
+	EXPECT( ShmRing::open(ringName()) == nullptr );
+	std::unique_ptr<ShmRing> w(ShmRing::create(ringName(), 2, 16));
+	EXPECT( ShmRing::create(ringName(), 2, 16) == nullptr );
+},
+
+CASE( "Open rejects rings claiming more slots than they hold" ) {
+	std::unique_ptr<ShmRing> w(ShmRing::create(ringName(), 2, 16));
+
+	// The slot count follows the magic and version in the header.
+	const uint32_t slots = 0xffffffff;
+	const int fd = shm_open(ringName().c_str(), O_RDWR, 0);
+	EXPECT( pwrite(fd, &slots, sizeof(slots), 12) ==
+		static_cast<ssize_t>(sizeof(slots)) );
+	close(fd);
+	EXPECT( ShmRing::open(ringName()) == nullptr );
+}
+};
+
+int main(int argc, char *argv[]) {
+	return lest::run(specification, argc, argv);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#include "lest.hpp"
+
+#include <vector>
+
+#include "dharc/tiles.hpp"
+
+using dharc::TileGrid;
+using std::vector;
+
+const lest::test specification[] = {
+
+CASE( "Only tiles changed beyond the threshold are listed" ) {
+	const TileGrid grid{12, 8, 4, 4};
+	vector<uint8_t> prev(12 * 8, 100);
+	vector<uint8_t> next(prev);
+	next[1 * 12 + 5] = 103;   // Tile 1, within the threshold.
+	next[6 * 12 + 10] = 120;  // Tile 5.
+
+	vector<uint8_t> bitmap;
+	vector<uint8_t> tiles;
+	EXPECT( grid.diff(prev.data(), next.data(), 4, bitmap, tiles) == 1U );
+	EXPECT( bitmap.size() == 1U );
+	EXPECT( bitmap[0] == 0x20 );
+	EXPECT( tiles.size() == 16U );
+	EXPECT( tiles[2 * 4 + 2] == 120 );
+
+	// Without a threshold any change counts.
+	EXPECT( grid.diff(prev.data(), next.data(), 0, bitmap, tiles) == 2U );
+	EXPECT( bitmap[0] == 0x22 );
+},
+
+CASE( "Applying a diff or every tile gives the image back" ) {
+	const TileGrid grid{12, 8, 4, 4};
+	vector<uint8_t> prev(12 * 8);
+	vector<uint8_t> next(12 * 8);
+	for (auto i = 0U; i < next.size(); ++i) {
+		prev[i] = i % 7;
+		next[i] = (i < 40) ? i % 7 : i % 5;
+	}
+
+	vector<uint8_t> bitmap;
+	vector<uint8_t> tiles;
+	grid.diff(prev.data(), next.data(), 0, bitmap, tiles);
+	EXPECT( grid.valid(bitmap.data(), bitmap.size(), tiles.size()) );
+	grid.apply(prev.data(), bitmap.data(), tiles.data());
+	EXPECT( prev == next );
+
+	vector<uint8_t> image(12 * 8, 0);
+	grid.all(next.data(), bitmap, tiles);
+	EXPECT( tiles.size() == next.size() );
+	grid.apply(image.data(), bitmap.data(), tiles.data());
+	EXPECT( image == next );
+},
+
+CASE( "Bitmaps and tiles not fitting the grid are invalid" ) {
+	const TileGrid grid{12, 8, 4, 4};
+	const uint8_t one = 0x01;
+	const uint8_t past = 0x40;
+	const uint8_t two[] = {0x01, 0x00};
+	EXPECT( grid.valid(&one, 1, 16) );
+	EXPECT( !grid.valid(&one, 1, 15) );
+	EXPECT( !grid.valid(&past, 1, 16) );
+	EXPECT( !grid.valid(two, 2, 16) );
+	EXPECT( !TileGrid({12, 8, 0, 4}).valid(&one, 1, 16) );
+},
+
+CASE( "Shrinking tiles averages the pixels each covers" ) {
+	const TileGrid grid{12, 8, 4, 4};
+	vector<uint8_t> image(12 * 8);
+	for (auto i = 0U; i < image.size(); ++i) image[i] = (i % 12) * 10;
+
+	// One pixel per tile.
+	vector<uint8_t> out(3 * 2);
+	EXPECT( grid.shrink(image.data(), 1, 1, out.data()) );
+	EXPECT( out == vector<uint8_t>({15, 55, 95, 15, 55, 95}) );
+
+	// Halved, and a whole tile gives the image back.
+	out.resize(6 * 4);
+	EXPECT( grid.shrink(image.data(), 2, 2, out.data()) );
+	EXPECT( out[0] == 5 );
+	EXPECT( out[1] == 25 );
+	EXPECT( out[6 + 5] == 105 );
+	out.resize(image.size());
+	EXPECT( grid.shrink(image.data(), 4, 4, out.data()) );
+	EXPECT( out == image );
+
+	EXPECT( !grid.shrink(image.data(), 0, 1, out.data()) );
+	EXPECT( !grid.shrink(image.data(), 5, 4, out.data()) );
+}
+};
+
+int main(int argc, char *argv[]) {
+	return lest::run(specification, argc, argv);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_FABRIC_CHECKPOINT_HPP_
+#define DHARC_FABRIC_CHECKPOINT_HPP_
+
+#include <cstdint>
+#include <cstddef>
+
+namespace dharc {
+namespace fabric {
+/**
+ * On disk layout of a region checkpoint. The header is followed, at a page
+ * aligned offset, by an exact image of the region's state block: one fixed
+ * size record per unit holding its scalar state, inputs, outputs, counts and
+ * links. Restoring maps the records straight into the region, so nothing is
+ * parsed and pages are only read from disk as units first touch them.
+ *
+ * Records are in native byte order and float format, so checkpoints are only
+ * portable between machines of the same architecture.
+ */
+struct CheckpointHeader {
+	char magic[8];        // kCheckpointMagic, not null terminated.
+	uint32_t version;     // Bumped whenever the record layout changes.
+	uint32_t linkbytes;   // Size of a link, guards against layout drift.
+	uint64_t width;
+	uint64_t height;
+	uint64_t unitsx;
+	uint64_t unitsy;
+	uint64_t unitbytes;   // Size of each unit record.
+	uint64_t offset;      // File offset of the first unit record.
+	uint64_t bytes;       // Total size of all unit records.
+};
+
+constexpr char kCheckpointMagic[8] = {'D', 'H', 'A', 'R', 'C', 'C', 'K', 'P'};
+constexpr uint32_t kCheckpointVersion = 1;
+
+/**
+ * Unit records start on a page boundary so that the whole state block can be
+ * mapped from the file, and each record is padded to a cache line.
+ */
+constexpr uint64_t kCheckpointOffset = 4096;
+constexpr size_t kRecordAlign = 64;
+};  // namespace fabric
+};  // namespace dharc
+
+#endif  // DHARC_FABRIC_CHECKPOINT_HPP_
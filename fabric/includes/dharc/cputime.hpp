@@ -0,0 +1,27 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_FABRIC_CPUTIME_HPP_
+#define DHARC_FABRIC_CPUTIME_HPP_
+
+#include <cstdint>
+#include <ctime>
+
+namespace dharc {
+namespace fabric {
+/**
+ * CPU time used by the calling thread alone, in nanoseconds. Unlike process
+ * CPU time this is not inflated by RPC, publishing or other passes running
+ * at the same time.
+ */
+inline uint64_t threadCpu() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL +
+		static_cast<uint64_t>(ts.tv_nsec);
+}
+};  // namespace fabric
+};  // namespace dharc
+
+#endif  // DHARC_FABRIC_CPUTIME_HPP_
@@ -11,13 +11,27 @@
 #include <atomic>
 #include <cassert>
 #include <mutex>
+#include <condition_variable>
+#include <string>
+#include <memory>
+#include <map>
+#include <set>
+#include <functional>
 
 #include "dharc/region.hpp"
+#include "dharc/scheduler.hpp"
+#include "dharc/registry.hpp"
+#include "dharc/pool.hpp"
+#include "dharc/shm_ring.hpp"
 
 using std::vector;
 using std::chrono::time_point;
 using std::size_t;
 using dharc::fabric::Region;
+using dharc::fabric::Scheduler;
+using dharc::fabric::Registry;
+using dharc::fabric::Pool;
+using dharc::ShmRing;
 // using dharc::LIFOBuffer;
 
 namespace dharc {
@@ -30,38 +44,298 @@ namespace dharc {
  *     search and access functions are provided, usually to significance sorted
  *     data, that can then be manipulated by higher-level pattern matching and
  *     search algorithms. This class hides any storage concerns and is
- *     threadsafe. The class is entirely static, only one fabric is possible
- *     per instance of the fabric server.
+ *     threadsafe. Several fabrics may exist in one process, each is processed
+ *     by a worker Pool that can be shared between them.
  */
 class Fabric {
 	public:
-	Fabric() = delete;
+	/**
+	 * How the process thread decides when to run a process pass.
+	 */
+	enum struct Policy : int {
+		input,  // Sleep until a region receives new input (default).
+		rate,   // Process every region at a fixed rate.
+		poll    // Spin waiting for new input, lowest latency but burns a core.
+	};
+
+	/**
+	 * Longest step2D waits for a process pass.
+	 */
+	static constexpr auto kMaxStepWait = std::chrono::seconds(1);
+
+	/**
+	 * Largest region create2D and resize2D accept, in pixels, units and
+	 * bytes of links, so that a request over RPC cannot exhaust memory.
+	 */
+	static constexpr size_t kMaxPixels = 4096 * 4096;
+	static constexpr size_t kMaxUnits = 65536;
+	static constexpr uint64_t kMaxLinkBytes = 1ULL << 30;
+
+	/** Most levels of an image pyramid, see pyramid2D. */
+	static constexpr size_t kMaxPyramid = 8;
+
+	/**
+	 * An empty fabric, processed by the given pool once started or by a
+	 * single worker of its own if none is given.
+	 */
+	explicit Fabric(Pool *pool = nullptr);
+
+	/**
+	 * Stops processing, then destroys every region.
+	 */
+	~Fabric();
+
+	Fabric(const Fabric&) = delete;
+	Fabric &operator=(const Fabric&) = delete;
+
+	/**
+	 * Start processing regions. A fabric can be stopped and started again.
+	 */
+	void start();
+
+	/**
+	 * Stop processing, returning once no pass of this fabric is running.
+	 * Regions keep their state and still accept frames.
+	 */
+	void stop();
+
+	bool running() const { return running_; }
+
+	/**
+	 * Hand a frame to a region, see Region::write. Frames for missing regions
+	 * or of the wrong size are rejected.
+	 */
+	WriteStatus write2D(RegionID regid, const vector<uint8_t> &v);
+
+	/**
+	 * Hand a frame to a region straight from the caller's memory, for senses
+	 * embedding the fabric in-process.
+	 */
+	WriteStatus write2D(RegionID regid, const uint8_t *data, size_t size);
+
+	/**
+	 * Hand a region only the units of a frame that changed since the last,
+	 * see Region::writeDelta. Deltas for missing regions or with units of
+	 * the wrong size are rejected.
+	 */
+	WriteStatus writeDelta2D(RegionID regid, uint64_t base,
+		const uint8_t *bitmap, size_t bitmapsize, const uint8_t *tiles,
+		size_t tilessize, size_t uw, size_t uh);
+
+	/**
+	 * Accept frames for a region through a shared memory ring created by a
+	 * sense on this host, replacing any ring it had before.
+	 * @param name Name of the ring's shared memory object.
+	 */
+	bool attachShm(RegionID regid, const std::string &name);
+	bool detachShm(RegionID regid);
+
+	/**
+	 * Hand a frame already written to a region's shared memory ring to the
+	 * region, copying it from the ring directly.
+	 * @param seq Sequence number the ring gave the frame.
+	 */
+	WriteStatus writeShm(RegionID regid, uint64_t seq);
+
+	/**
+	 * Reform a region with its units uw by uh pixels, from the region's own
+	 * unit size for full resolution down to 1 by 1 for a value per unit, each
+	 * pixel the mean of those it covers. See TileGrid::shrink.
+	 * @return The output, or empty if the region is missing or the units are
+	 *         not from 1 to its own size.
+	 */
+	vector<uint8_t> reform2D(RegionID regid, size_t uw, size_t uh);
+
+	/**
+	 * Reform a region once into an image pyramid, for thumbnails and
+	 * overviews at several scales without sending the whole output.
+	 * @param levels Wanted, up to kMaxPyramid. The first is full resolution
+	 *        and each after it half the width and height of the one before,
+	 *        rounded down, stopping early if a level would be empty.
+	 * @return The levels, or none if the region is missing.
+	 */
+	vector<vector<uint8_t>> pyramid2D(RegionID regid, size_t levels);
+
+	/**
+	 * Reform a region into the caller's buffer.
+	 * @return Bytes written, 0 if the region is missing or size is too small.
+	 */
+	size_t reform2D(RegionID regid, uint8_t *out, size_t size);
+
+	/**
+	 * Write a frame and reform the region in one call. With a wait, the output
+	 * is taken the moment the process pass over this frame completes,
+	 * otherwise it is the current output.
+	 * @param uw Width of the units in the output, as for reform2D.
+	 * @param uh Height of the units in the output.
+	 * @param wait Longest to wait for the pass, up to kMaxStepWait.
+	 * @return The output, or empty if the frame was not accepted, the units
+	 *         are out of range or the pass did not complete in time.
+	 */
+	vector<uint8_t> step2D(RegionID regid, const uint8_t *data, size_t size,
+		size_t uw, size_t uh, std::chrono::microseconds wait);
+
+	/**
+	 * Step with a frame already written to the region's shared memory ring,
+	 * as step2D does with one passed in. See writeShm.
+	 */
+	vector<uint8_t> stepShm(RegionID regid, uint64_t seq, size_t uw, size_t uh,
+		std::chrono::microseconds wait);
+
+	/**
+	 * Receives the output of each process pass of a published region, with
+	 * the region, the number of the pass and the output's units as tiles.
+	 * See Region::setOutputHook.
+	 */
+	typedef std::function<void(RegionID, uint64_t, const TileGrid&,
+		const vector<uint8_t>&)> OutputSink;
+
+	/**
+	 * Set where the outputs of published regions go, or stop them with an
+	 * empty sink. Once this returns the old sink is no longer called.
+	 */
+	void setOutputSink(OutputSink sink);
+
+	/**
+	 * Start or stop reforming a region after every pass and handing the
+	 * output to the sink. This carries on if the region is resized,
+	 * restored or destroyed and created again.
+	 */
+	void publish2D(RegionID regid, bool on);
+
+	/**
+	 * Create a new 2D region, with its own id, and start processing it.
+	 * @param width Input width in pixels, must be a multiple of unitsx.
+	 * @param height Input height in pixels, must be a multiple of unitsy.
+	 * @return New region id or RegionID::INVALID, also if the region would
+	 *         be larger than kMaxPixels, kMaxUnits or kMaxLinkBytes or there
+	 *         is not the memory for it.
+	 */
+	RegionID create2D(size_t width, size_t height,
+		size_t unitsx, size_t unitsy);
+
+	/**
+	 * Replace an existing region with one of a different geometry. Anything
+	 * the region had learnt is discarded.
+	 */
+	bool resize2D(RegionID regid, size_t width, size_t height,
+		size_t unitsx, size_t unitsy);
+
+	/**
+	 * Stop processing a region and reclaim it once no longer in use.
+	 */
+	bool destroy(RegionID regid);
+
+	/**
+	 * Write a checkpoint of a region's learnt state, see Region::save.
+	 */
+	bool save(RegionID regid, const std::string &path);
+
+	/**
+	 * Load a checkpoint, replacing an existing region or, given
+	 * RegionID::INVALID, as a new region.
+	 * @return Id of the restored region or RegionID::INVALID on failure,
+	 *         also if regid is given but has no region.
+	 */
+	RegionID restore(RegionID regid, const std::string &path);
+
+	/**
+	 * Checkpoint a region in the background, see Region::snapshot.
+	 * @param rate Write rate limit in bytes per second, 0 for unlimited.
+	 */
+	bool snapshot(RegionID regid, const std::string &path, size_t rate);
+
+	/**
+	 * Statistic: Duration and worst pass stall of a region's last snapshot.
+	 */
+	SnapshotStats snapshotStats(RegionID regid);
+
+	/**
+	 * Limit the time each process pass of a region may take, see
+	 * Region::setBudget. Returns false if the region does not exist.
+	 */
+	bool setBudget(RegionID regid, std::chrono::microseconds budget);
+
+	/**
+	 * Statistic: Unit coverage of the last process pass of a region.
+	 */
+	Coverage coverage(RegionID regid);
 
-	static void initialise();
-	static void finalise();
+	/**
+	 * Choose how a region handles frames arriving faster than it processes
+	 * them, see Region::setIngest.
+	 */
+	bool setIngest(RegionID regid, Ingest mode, size_t depth);
 
-	static void write2D(RegionID regid, const vector<uint8_t> &v);
+	/**
+	 * Statistic: Accepted, coalesced and dropped frame counts of a region.
+	 */
+	IngestStats ingestStats(RegionID regid);
 
-	static vector<uint8_t> reform2D(RegionID regid, size_t uw, size_t uh);
+	void setPolicy(Policy policy);
+	Policy policy() { return policy_; }
 
-	static Region *getRegion(RegionID regid);
+	/**
+	 * Process passes per second of every region, sets all their periods.
+	 */
+	void setRate(float hz);
 
 	/**
-	 * Statistic: Approximate number of hyperarc modifications per second.
+	 * Set the period and priority of a region. Passes not completed within
+	 * one period of their release count as deadline misses.
 	 */
-	static float  processedPerSecond() {
-		return (static_cast<float>(processed__) /
-				static_cast<float>(counter__)) *
-				static_cast<float>(counterResolution());
+	bool setSchedule(RegionID regid, std::chrono::nanoseconds period,
+		int priority);
+
+	/**
+	 * Statistic: Deadline misses, lateness and jitter of a region.
+	 */
+	TickStats tickStats(RegionID regid);
+
+	/**
+	 * Statistic: Raw lateness histogram of a region, in nanoseconds.
+	 */
+	vector<uint64_t> lateness(RegionID regid);
+
+	/**
+	 * Statistic: Work rates and operation latencies of a region.
+	 */
+	Metrics metrics(RegionID regid);
+
+	/**
+	 * Statistic: Raw latency histogram of a region operation, in nanoseconds.
+	 */
+	vector<uint64_t> latency(RegionID regid, Latency op);
+
+	/**
+	 * Statistic: Microseconds of CPU time spent per processed frame. This is
+	 * the time of the threads running passes and of their OpenMP helpers,
+	 * and also the time spent looking for, polling for or waking for passes
+	 * under the current policy. Other threads, such as RPC, are left out.
+	 */
+	float cpuPerFrame();
+
+	/**
+	 * Statistic: Units processed per second, averaged since creation.
+	 */
+	float processedPerSecond() const {
+		return static_cast<float>(processed_) /
+				(static_cast<float>(counter() + 1) *
+				static_cast<float>(counterResolution()) / 1000.0f);
 	}
 
 
 
 	/**
-	 * Number of ticks since program start. Used to record when a relation
-	 * was last accessed or changed.
+	 * Number of ticks since the fabric was created. Used to record when a relation
+	 * was last accessed or changed. Derived from the monotonic clock so it
+	 * never drifts.
 	 */
-	inline static unsigned long long counter() { return counter__; }
+	unsigned long long counter() const {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - start_).count() /
+			counterResolution();
+	}
 
 
 
@@ -73,15 +347,53 @@ class Fabric {
 
 
 	private:
-	static std::atomic<size_t> processed__;
+	friend class dharc::fabric::Pool;
+
+	std::chrono::steady_clock::time_point start_;
+	std::atomic<size_t> processed_;
+
+	Registry registry_;
+
+	Scheduler scheduler_;
+	std::atomic<Policy> policy_;
+	std::atomic<unsigned long long> frames_;
+	std::atomic<unsigned long long> cputime_;  // Nanoseconds
+
+	std::map<RegionID, std::shared_ptr<ShmRing>> rings_;
+	std::mutex ringlock_;
+
+	OutputSink sink_;
+	std::set<RegionID> published_;
+	std::mutex publock_;
 
-	static std::atomic<unsigned long long> counter__;
+	std::unique_ptr<Pool> ownpool_;
+	Pool *pool_;
+	std::atomic<bool> running_;
+	std::mutex runlock_;
 
-	static vector<Region*> regions__;
-	//static vector<vector<float>> region_inputs__;
+	static bool validGeometry(size_t width, size_t height,
+		size_t unitsx, size_t unitsy);
 
-	static void counterThread();
-	static void processThread();
+	/* Reform for step2D and stepShm once their frame is written. */
+	vector<uint8_t> stepAfter(RegionID regid, const WriteStatus &status,
+		size_t uw, size_t uh, std::chrono::microseconds wait);
+
+	/* Give a region the output hook it needs, if it is published. */
+	void hookOutput(RegionID regid, Region *reg);
+
+	/**
+	 * Called by pool workers to run one released process pass.
+	 * @param wake Brought forward to this fabric's next periodic release.
+	 * @param spin Set if the policy wants polling rather than sleeping.
+	 * @return false if no pass was released.
+	 */
+	bool runOnce(Pool::clock::time_point &wake, bool &spin);
+
+	/**
+	 * Called by pool workers with the CPU time, in nanoseconds, they spent
+	 * polling or waking for this fabric without running a pass.
+	 */
+	void chargeIdle(uint64_t ns) { cputime_ += ns; }
 };
 };  // namespace dharc
 
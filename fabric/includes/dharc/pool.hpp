@@ -0,0 +1,87 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_FABRIC_POOL_HPP_
+#define DHARC_FABRIC_POOL_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::vector;
+
+namespace dharc {
+class Fabric;
+
+namespace fabric {
+/**
+ * Worker threads that run process passes for any number of fabrics. Each
+ * worker takes attached fabrics in turn and runs one released pass of the
+ * first that has one, sleeping until the earliest periodic release or new
+ * input when none do. Several small fabrics can so share a host's cores
+ * without each needing threads of its own.
+ */
+class Pool {
+	public:
+	typedef std::chrono::steady_clock clock;
+
+	/**
+	 * Longest a worker sleeps before checking every fabric again.
+	 */
+	static constexpr auto kMaxWait = std::chrono::milliseconds(100);
+
+	explicit Pool(size_t threads);
+
+	/**
+	 * Stops and joins all workers. Fabrics still attached are no longer
+	 * processed.
+	 */
+	~Pool();
+
+	Pool(const Pool&) = delete;
+	Pool &operator=(const Pool&) = delete;
+
+	size_t size() const { return threads_.size(); }
+
+	void attach(Fabric *fabric);
+
+	/**
+	 * Stop processing a fabric, returning once no worker is running a pass of
+	 * it.
+	 */
+	void detach(Fabric *fabric);
+
+	/**
+	 * Wake sleeping workers, for new input or a change of schedule.
+	 */
+	void notify();
+
+	private:
+	struct Member {
+		Fabric *fabric;
+		size_t busy;    // Workers running a pass of this fabric.
+		bool detached;
+	};
+
+	void worker();
+
+	/* Share CPU time spent idle among those fabrics, with lock_ held. */
+	void chargeIdle(const vector<Member*> &idle, uint64_t ns);
+
+	vector<std::thread> threads_;
+	vector<std::unique_ptr<Member>> members_;
+	size_t next_;
+	uint64_t seq_;  // Changes on every notify.
+	bool running_;
+	std::mutex lock_;
+	std::condition_variable wake_;
+	std::condition_variable idle_;
+};
+};  // namespace fabric
+};  // namespace dharc
+
+#endif  // DHARC_FABRIC_POOL_HPP_
@@ -9,11 +9,32 @@
 #include <mutex>
 #include <cassert>
 #include <cmath>
+#include <chrono>
+#include <utility>
+#include <atomic>
+#include <deque>
+#include <condition_variable>
+#include <string>
+#include <thread>
+#include <functional>
 
 #include "dharc/regions.hpp"
+#include "dharc/lock.hpp"
+#include "dharc/histogram.hpp"
+#include "dharc/checkpoint.hpp"
+#include "dharc/tiles.hpp"
 
 using std::vector;
 using dharc::RegionID;
+using dharc::Coverage;
+using dharc::Metrics;
+using dharc::Latency;
+using dharc::Histogram;
+using dharc::Ingest;
+using dharc::IngestStats;
+using dharc::WriteStatus;
+using dharc::SnapshotStats;
+using std::pair;
 
 namespace dharc {
 namespace fabric {
@@ -22,16 +43,192 @@ class Region {
 	static constexpr auto kSuppressionRate = 0.5;
 	static constexpr auto kLearnRate = 0.01f;
 	static constexpr auto kContrastMax = 10.0f;
+	static constexpr auto kAgeSalience = 0.02f;
+	static constexpr int kLockstepTimeout = 1000;  // Milliseconds
 
 	Region(size_t width, size_t height, size_t unitsx, size_t unitsy);
 	~Region();
 
-	void write(const vector<uint8_t> &v);
+	Region(const Region&) = delete;
+	Region &operator=(const Region&) = delete;
 
-	void process();
+	/**
+	 * Checks the geometry of a region before any of it is allocated.
+	 */
+	typedef bool (*GeometryCheck)(size_t width, size_t height, size_t unitsx,
+		size_t unitsy);
+
+	/**
+	 * Create a region from a checkpoint written by save. The file is mapped
+	 * privately, so learning carries on in memory and never modifies it.
+	 * @param valid Limits on the geometry in the checkpoint, if any.
+	 * @return New region or nullptr if the file is missing or incompatible.
+	 * @throw std::bad_alloc if the region does not fit in memory.
+	 */
+	static Region *restore(const std::string &path,
+		GeometryCheck valid = nullptr);
+
+	/**
+	 * Bytes of links a region of this geometry would have. Every unit links
+	 * each of its inputs to each of its outputs, so this grows with the
+	 * square of the unit size.
+	 */
+	static uint64_t linkBytes(size_t width, size_t height, size_t unitsx,
+		size_t unitsy);
+
+	/**
+	 * Write a checkpoint of the region's geometry and learnt state, waiting
+	 * for it to complete. Processing continues meanwhile, see snapshot.
+	 */
+	bool save(const std::string &path);
+
+	/**
+	 * Start writing a checkpoint in the background, capturing the region as
+	 * it is between two process passes. Processing carries on: a unit is
+	 * copied aside only if a pass is about to change links not yet written.
+	 * The file is written alongside and renamed into place when complete.
+	 * @param rate Write rate limit in bytes per second, 0 for unlimited.
+	 * @return False if a snapshot is already in progress or on error.
+	 */
+	bool snapshot(const std::string &path, size_t rate);
+
+	/**
+	 * Statistic: Duration of the last snapshot and the stall it caused.
+	 */
+	SnapshotStats snapshotStats();
+
+	size_t width() const { return width_; }
+	size_t height() const { return height_; }
+	size_t unitsX() const { return unitsx_; }
+	size_t unitsY() const { return unitsy_; }
+	size_t unitWidth() const { return uwidth_; }
+	size_t unitHeight() const { return uheight_; }
+
+	/**
+	 * Hand a frame to the region. It is applied to the units at the start of
+	 * a later process pass, according to the ingest mode. In lockstep mode
+	 * this blocks until the previous frame has been taken for processing.
+	 */
+	WriteStatus write(const vector<uint8_t> &v);
+
+	/**
+	 * Write a frame straight from a caller's buffer of width * height bytes.
+	 */
+	WriteStatus write(const uint8_t *data, size_t size);
+
+	/**
+	 * Write a frame as the units that changed since the last frame written,
+	 * which must be frame number base. Only the units changed are updated
+	 * when the frame is applied.
+	 * @param bitmap Bit per unit, row by row of units, set if it changed.
+	 * @param tiles Pixels of each unit changed, in order, row by row.
+	 * @return Rejected if the sizes do not match or base is not the last frame
+	 *         written, in which case the writer should send a whole frame.
+	 */
+	WriteStatus writeDelta(uint64_t base, const uint8_t *bitmap,
+		size_t bitmapsize, const uint8_t *tiles, size_t tilessize);
+
+	/**
+	 * Run one process pass, applying the next pending frame first.
+	 * @return Number of units processed.
+	 */
+	size_t process();
 
 	void reform(vector<uint8_t> &v);
 
+	/**
+	 * Reform into a caller's buffer of width * height bytes.
+	 */
+	void reform(uint8_t *out, size_t size);
+
+	/**
+	 * Reform into a caller's buffer as soon as a process pass over the frame
+	 * with sequence number seq, or a later one, completes. If that pass has
+	 * already completed, the current output is taken instead.
+	 * @return False if no such pass completed within the timeout.
+	 */
+	bool reformAfter(uint64_t seq, uint8_t *out, size_t size,
+		std::chrono::microseconds timeout);
+
+	/**
+	 * Receives the output of a completed process pass and the number of
+	 * that pass. The output is only valid during the call.
+	 */
+	typedef std::function<void(uint64_t, const vector<uint8_t>&)> OutputHook;
+
+	/**
+	 * Reform the region at the end of every process pass, handing the output
+	 * to a hook that is called by the processing thread so must be quick.
+	 * Waits for any pass in progress, after which the old hook is no longer
+	 * called. An empty hook stops this.
+	 */
+	void setOutputHook(OutputHook hook);
+
+	/**
+	 * Are frames waiting to be processed.
+	 */
+	bool hasInput() const { return pending_ > 0; }
+
+	/**
+	 * Change how frames are accepted. Frames already pending are kept.
+	 * @param depth Maximum pending frames in Ingest::queue mode.
+	 */
+	void setIngest(Ingest mode, size_t depth);
+
+	/**
+	 * Statistic: Frames accepted, coalesced, dropped and reprocessed.
+	 */
+	IngestStats ingestStats();
+
+	/**
+	 * When the oldest input not yet processed was written.
+	 */
+	std::chrono::steady_clock::time_point inputTime() const {
+		return std::chrono::steady_clock::time_point(
+			std::chrono::steady_clock::duration(inputtime_));
+	}
+
+	/**
+	 * Limit the time a single process pass may take. Units are then ranked
+	 * by salience (recent input change, output activity and time since they
+	 * were last processed) and the most salient are processed first, any
+	 * left when the budget runs out are deferred to a later pass. A budget of
+	 * zero processes every unit every pass. The most salient unit is always
+	 * processed, so however small the budget every unit is reached in time.
+	 */
+	void setBudget(std::chrono::microseconds budget) {
+		budget_.store(budget.count(), std::memory_order_relaxed);
+	}
+	std::chrono::microseconds budget() const {
+		return std::chrono::microseconds(
+			budget_.load(std::memory_order_relaxed));
+	}
+
+	/**
+	 * Statistic: Coverage of the most recent process pass.
+	 */
+	Coverage coverage();
+
+	/**
+	 * Statistic: Work rates and operation latencies of this region. Counting
+	 * is a few relaxed atomic adds per unit so is always on.
+	 */
+	Metrics metrics();
+
+	/**
+	 * Statistic: Raw latency histogram in nanoseconds.
+	 */
+	vector<uint64_t> latency(Latency op) const;
+
+	/**
+	 * Statistic: Nanoseconds of CPU time OpenMP threads other than the caller
+	 * of process have spent on its passes, in total. The caller's own time is
+	 * left for it to measure.
+	 */
+	uint64_t helperCpu() const {
+		return helpercpu_.load(std::memory_order_relaxed);
+	}
+
 	private:
 	const size_t unitsx_;
 	const size_t unitsy_;
@@ -46,21 +243,140 @@ class Region {
 		float depol;
 	};
 
-	struct Unit {
+	/**
+	 * Fixed size array within the state block.
+	 */
+	template <typename T>
+	struct Slice {
+		T *data;
+		size_t count;
+
+		T &operator[](size_t i) const { return data[i]; }
+		size_t size() const { return count; }
+	};
+
+	/**
+	 * Start of each unit record in the state block, see CheckpointHeader.
+	 */
+	struct UnitState {
 		float modulation;
-		vector<float> inputs;
-		vector<float> outputs;
-		vector<float> counts;
-		vector<Link> links;
+		float change;    // Input change since last processed.
+		float activity;  // Output change when last processed.
+		uint32_t age;    // Passes since last processed.
+	};
+
+	/**
+	 * A unit's view of its record in the state block.
+	 */
+	struct Unit {
+		size_t index;  // Of its record in the state block.
+		UnitState *state;
+		Slice<float> inputs;
+		Slice<float> outputs;
+		Slice<float> counts;
+		Slice<Link> links;
+	};
+
+	struct Frame {
+		vector<uint8_t> data;
+		vector<uint8_t> dirty;  // Bit per unit as for writeDelta, empty if all.
+		uint64_t seq;
+		std::chrono::steady_clock::time_point time;
+	};
+
+	/* A caller of reformAfter, waiting for its pass. */
+	struct Waiter {
+		uint64_t seq;
+		uint8_t *out;
+		size_t size;
+		bool claimed;  // A pass is reforming into out.
+		bool done;
 	};
 
-	void makeInputLayer();
+	template <typename F>
+	WriteStatus ingest(uint64_t base, F fill);
+	void applyFrame(const Frame &frame);
+	bool takeFrame(Frame &frame);
+	void reformWaiters(uint64_t seq, const vector<uint8_t> *output);
+
+	Region(size_t width, size_t height, size_t unitsx, size_t unitsy,
+		void *map, size_t mapsize);
+
+	struct Snapshot;
+
+	size_t unitBytes() const;
+	size_t headBytes() const;
+	bool startSnapshot(const std::string &path, size_t rate);
+	void writeSnapshot(Snapshot *snap);
+	void preserve(const Unit &unit);
+	void makeInputLayer(bool init);
 	void initUnit(Unit &unit, size_t iwidth, size_t iheight);
-	void processLayer(size_t layer);
+	size_t processLayer(size_t layer);
+	size_t processSalient(size_t layer, std::chrono::microseconds budget);
 	void processUnit(Unit &unit);
 
+	void *map_;         // Checkpoint file or anonymous memory.
+	size_t mapsize_;
+	uint8_t *state_;    // Unit records, within map_.
+	size_t statesize_;
+	std::mutex statelock_;
+	uint64_t epoch_;         // Passes completed, under statelock_.
+	OutputHook outhook_;     // Under statelock_.
+	vector<uint8_t> output_;
+
+	std::atomic<Snapshot*> snap_;
+	std::atomic<bool> snapcancel_;
+	bool snapok_;
+	std::thread snapthread_;
+	std::mutex snaplock_;
+	SnapshotStats snapstats_;
+	dharc::Lock snapstatslock_;
+
 	vector<vector<vector<Unit>>> units_;
-	
+	vector<pair<float, Unit*>> ranked_;
+
+	std::deque<Frame> frames_;
+	vector<vector<uint8_t>> spare_;
+	Frame current_;
+	std::mutex ingestlock_;
+	std::condition_variable ingestcv_;
+	vector<Waiter*> waiters_;
+	std::condition_variable donecv_;
+	Ingest ingest_;
+	size_t depth_;
+	std::atomic<size_t> pending_;
+	std::atomic<std::chrono::steady_clock::rep> inputtime_;
+	uint64_t inseq_;
+	uint64_t doneseq_;  // Frame of the last completed pass.
+	uint64_t accepted_;
+	uint64_t coalesced_;
+	uint64_t dropped_;
+	uint64_t reprocessed_;
+
+	std::atomic<std::chrono::microseconds::rep> budget_;  // Set by RPC.
+	Coverage coverage_;
+	dharc::Lock coveragelock_;
+
+	std::atomic<uint64_t> unitcount_;
+	std::atomic<uint64_t> linkcount_;
+	std::atomic<uint64_t> learncount_;
+	std::atomic<uint64_t> helpercpu_;
+	Histogram writelat_;
+	Histogram processlat_;
+	Histogram reformlat_;
+
+	struct Sample {
+		std::chrono::steady_clock::time_point time;
+		uint64_t units;
+		uint64_t links;
+		uint64_t learns;
+		float unitsps;
+		float linksps;
+		float learnsps;
+	};
+
+	Sample sample_;
+	dharc::Lock samplelock_;
 };
 };
 };
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_FABRIC_REGISTRY_HPP_
+#define DHARC_FABRIC_REGISTRY_HPP_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "dharc/regions.hpp"
+#include "dharc/region.hpp"
+
+using std::vector;
+using dharc::RegionID;
+
+namespace dharc {
+namespace fabric {
+/**
+ * All regions of a fabric, indexed by RegionID. Lookups never lock: readers
+ * pin the current immutable table of regions with a Guard, and writers
+ * publish a modified copy of the table. A replaced or destroyed region is
+ * only deleted once every Guard that could have seen it has been released,
+ * and every pin taken on it has been dropped.
+ */
+class Registry {
+	private:
+	struct Table {
+		vector<std::shared_ptr<Region>> regions;
+	};
+
+	public:
+	static constexpr size_t kMaxRegions = 4096;
+
+	/**
+	 * Keeps every region looked up through it alive until destroyed.
+	 */
+	class Guard {
+		public:
+		explicit Guard(Registry &reg);
+		~Guard();
+
+		Guard(const Guard&) = delete;
+		Guard &operator=(const Guard&) = delete;
+
+		Region *get(RegionID regid) const {
+			const auto ix = static_cast<size_t>(regid);
+			return (ix < table_->regions.size()) ?
+				table_->regions[ix].get() : nullptr;
+		}
+
+		/**
+		 * Keep a region alive after this guard is released, for callers
+		 * that would otherwise hold the guard for long and so block every
+		 * region being created or destroyed.
+		 */
+		std::shared_ptr<Region> pin(RegionID regid) const {
+			const auto ix = static_cast<size_t>(regid);
+			return (ix < table_->regions.size()) ?
+				table_->regions[ix] : nullptr;
+		}
+
+		/**
+		 * Call f(RegionID, Region*) for each existing region.
+		 */
+		template <typename F>
+		void forEach(F f) const {
+			for (auto i = 0U; i < table_->regions.size(); ++i) {
+				if (table_->regions[i] != nullptr) {
+					f(static_cast<RegionID>(i), table_->regions[i].get());
+				}
+			}
+		}
+
+		private:
+		Registry &reg_;
+		size_t slot_;
+		const Table *table_;
+	};
+
+	Registry();
+	~Registry();
+
+	/**
+	 * Add a region using the lowest free id.
+	 * @return The new id or RegionID::INVALID if the registry is full.
+	 */
+	RegionID insert(Region *region);
+
+	/**
+	 * Put a region in place of the one at an id, retiring the old one.
+	 * @return False if there is no region at the id, which is then left
+	 *         empty, as ids are only handed out by insert.
+	 */
+	bool replace(RegionID regid, Region *region);
+
+	/**
+	 * Remove and retire a region. Blocks until it is safe to delete.
+	 */
+	bool erase(RegionID regid);
+
+	private:
+	void publish(Table *table, std::shared_ptr<Region> retired);
+	void synchronize();
+
+	std::atomic<Table*> table_;
+	std::atomic<size_t> epoch_;
+	std::atomic<size_t> readers_[2];
+	std::mutex writelock_;
+};
+};  // namespace fabric
+};  // namespace dharc
+
+#endif  // DHARC_FABRIC_REGISTRY_HPP_
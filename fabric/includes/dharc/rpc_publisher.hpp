@@ -0,0 +1,124 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_RPC_PUBLISHER_HPP_
+#define DHARC_RPC_PUBLISHER_HPP_
+
+#include <csignal>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "zmq.hpp"
+#include "dharc/regions.hpp"
+#include "dharc/tiles.hpp"
+
+namespace dharc {
+class Fabric;
+
+namespace rpc {
+
+/**
+ * Publishes the output of regions after each of their process passes, so
+ * that any number of viewers and recorders can watch without polling. Each
+ * region has two topics, see rpc_outputs.hpp: its whole outputs, and only
+ * the tiles that changed by more than a threshold since the last message.
+ * Only regions somebody has subscribed to are reformed, once per pass however
+ * many subscribers there are. A subscriber too slow to keep up misses
+ * passes rather than holding them up.
+ *
+ * Every subscriber to a region's deltas shares one chain of them, relative
+ * to what the publisher last sent rather than to what each has seen, as a
+ * publisher cannot hear from subscribers other than through subscriptions.
+ * Subscribing to the deltas again, which a subscriber does when it notices
+ * a gap in the chain, makes the next one whole.
+ */
+class Publisher {
+	public:
+	/**
+	 * Outputs queued for each subscriber before later ones are dropped.
+	 */
+	static constexpr int kHighWater = 4;
+
+	/**
+	 * Most deltas sent between whole outputs, to bound how long a subscriber
+	 * that misses one unnoticed is out.
+	 */
+	static constexpr size_t kKeyframe = 250;
+
+	Publisher(Fabric &fabric, zmq::context_t &context);
+
+	/**
+	 * Stops publishing, so the fabric no longer reforms for it.
+	 */
+	~Publisher();
+
+	Publisher(const Publisher&) = delete;
+	Publisher &operator=(const Publisher&) = delete;
+
+	/**
+	 * Publish on a ZMQ endpoint, as for Server::bind.
+	 */
+	void bind(const std::string &endpoint);
+
+	/**
+	 * Only send tiles of deltas with a pixel changed by more than threshold
+	 * from what was last sent, 0 for any change. Call before run.
+	 */
+	void setThreshold(int threshold) { threshold_ = threshold; }
+
+	/**
+	 * Track subscriptions and send outputs until stop is set. The socket is
+	 * only used by the thread calling this once it is running.
+	 */
+	void run(const volatile std::sig_atomic_t &stop);
+
+	private:
+	struct Output {
+		uint64_t epoch;
+		TileGrid grid;
+		std::vector<uint8_t> *data;  // Null once sent.
+	};
+
+	struct Subscribed {
+		bool outputs;
+		bool deltas;
+	};
+
+	/* What subscribers to a region's deltas were last sent. */
+	struct Reference {
+		uint64_t epoch;  // 0 to send the next whole.
+		TileGrid grid;
+		size_t count;    // Deltas since it was last sent whole.
+		std::vector<uint8_t> image;
+	};
+
+	void publish(RegionID regid, uint64_t epoch, const TileGrid &grid,
+		const std::vector<uint8_t> &out);
+	void subscriptions();
+	void send();
+	void sendOutput(RegionID regid, const Output &o);
+	void sendDelta(RegionID regid, const Output &o);
+
+	Fabric &fabric_;
+	zmq::socket_t sock_;
+	int wakefd_;
+	int threshold_;
+
+	// Only used by the running thread.
+	std::map<RegionID, Subscribed> subscribed_;
+	std::map<RegionID, Reference> refs_;
+	std::vector<uint8_t> bitmap_;
+	std::vector<uint8_t> tiles_;
+
+	std::map<RegionID, Output> outputs_;  // Latest not yet sent.
+	std::mutex lock_;
+};
+
+
+};  // namespace rpc
+};  // namespace dharc
+
+#endif  /* DHARC_RPC_PUBLISHER_HPP_ */
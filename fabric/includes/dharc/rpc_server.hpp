@@ -5,19 +5,185 @@
 #ifndef DHARC_RPC_SERVER_HPP_
 #define DHARC_RPC_SERVER_HPP_
 
-#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "zmq.hpp"
+#include "dharc/histogram.hpp"
+#include "dharc/rpc_commands.hpp"
+#include "dharc/rpc_compress.hpp"
 
 namespace dharc {
+class Fabric;
+
 namespace rpc {
 
 /**
- * Read a command and all of its arguments from the input stream.
+ * What the server remembers about a client between its requests.
+ */
+struct Session {
+	/** How arrays in replies to the client are compressed. */
+	Compression replies = Compression::none();
+};
+
+/**
+ * Read a command and all of its arguments from a request message.
  * Execute the correct handler for that command.
- * Write the result of the command to the output stream.
- * @param is Input stream containing RPC message.
- * @param os Output stream to be filled with result message.
+ * Build the reply message from the result of the command. Large arrays in
+ * either message are in parts of their own after the first.
+ * @param f Fabric the command applies to.
+ * @param s Session of the client that sent the request.
+ * @param req Parts of the request, which arguments may refer into.
+ * @param rep Filled with the parts of the reply.
  */
-void process_msg(std::istream &is, std::ostream &os);
+void process_msg(Fabric &f, Session &s, std::vector<zmq::message_t> &req,
+	std::vector<zmq::message_t> &rep);
+
+/**
+ * Directory that checkpoints named by save2d, load2d and snapshot2d are
+ * kept in, by default the working directory. Set it before serving. Names
+ * given over RPC must be bare file names, so that clients cannot reach any
+ * other file.
+ */
+void setCheckpointDir(const std::string &dir);
+
+/**
+ * Totals of a lane over every server of the process, kept by the servers and
+ * reported by the lanestats command.
+ */
+struct LaneCounters {
+	std::atomic<uint64_t> requests{0};
+	std::atomic<uint64_t> deferred{0};
+	std::atomic<uint64_t> rejected{0};
+	Histogram queueing;  // Nanoseconds from receiving to a worker taking it.
+};
+
+LaneCounters &laneCounters(Lane lane);
+
+/**
+ * RPC frontend of a fabric. A ROUTER socket receives requests from any number
+ * of clients and queues them for a pool of worker threads, so that a slow
+ * command only holds up its own client. Requests from one client are still
+ * handled one at a time and in the order sent, whatever their lanes, since
+ * commands such as reform2d after write2d rely on that order. A client that
+ * sends several requests before their replies, as Rpc::async allows, saves
+ * the round trips but not the time to handle each. Each reply carries its
+ * request's envelope back unchanged, so both REQ and DEALER clients work.
+ *
+ * Requests are queued by lane, see rpc::lane. Between clients, workers take
+ * sensor requests before any others, and the rest are limited to a rate so
+ * that monitors polling cannot add to the latency of frames.
+ */
+class Server {
+	public:
+	static constexpr size_t kDefaultWorkers = 4;
+
+	/**
+	 * Sensor requests waiting for a worker before the server stops reading
+	 * more, leaving further ones queued in the socket.
+	 */
+	static constexpr size_t kMaxQueue = 1024;
+
+	/**
+	 * Other requests waiting before more that are rpc::droppable are turned
+	 * away with an empty reply, which clients raise as an error, so that
+	 * they never stop the server reading sensor requests. The rest are
+	 * turned away only past kMaxQueue.
+	 */
+	static constexpr size_t kMaxMonitorQueue = 256;
+
+	/** Requests a second of the monitor lane, unless set otherwise. */
+	static constexpr double kDefaultMonitorRate = 200.0;
+
+	/** Monitor requests that may be handled at once after a quiet spell. */
+	static constexpr double kMonitorBurst = 20.0;
+
+	/**
+	 * Sessions kept before those of idle clients are forgotten, which then
+	 * get uncompressed replies until they negotiate again.
+	 */
+	static constexpr size_t kMaxSessions = 4096;
+
+	Server(Fabric &fabric, zmq::context_t &context, size_t workers);
+
+	/**
+	 * Stops and joins the workers, dropping any requests still queued.
+	 */
+	~Server();
+
+	Server(const Server&) = delete;
+	Server &operator=(const Server&) = delete;
+
+	/**
+	 * Listen on a ZMQ endpoint, tcp, ipc or inproc. Call once for each of
+	 * any number of endpoints, before run.
+	 */
+	void bind(const std::string &endpoint);
+
+	/**
+	 * Limit requests of the monitor lane to a rate a second, or 0 for no
+	 * limit. Those over it wait in the queue rather than being dropped.
+	 */
+	void setMonitorRate(double rate);
+
+	/**
+	 * Receive requests and send replies until stop is set.
+	 */
+	void run(const volatile std::sig_atomic_t &stop);
+
+	size_t workers() const { return threads_.size(); }
+
+	private:
+	struct Job {
+		std::vector<zmq::message_t> msg;
+		size_t body;         // Index of the first frame after the envelope.
+		std::string client;  // Identity of the sending peer.
+		Lane lane;
+		std::chrono::steady_clock::time_point received;
+		uint64_t seq;        // Order received, across lanes.
+		bool deferred;       // Already counted as held back by the rate.
+	};
+
+	std::deque<Job> &queue(Lane lane) {
+		return queues_[static_cast<int>(lane)];
+	}
+
+	std::deque<Job>::iterator next(Lane lane);
+	bool waitingBefore(const Job &job, Lane lane);
+	bool takeToken(std::chrono::steady_clock::time_point now);
+
+	void worker();
+	void receive();
+	void reply();
+	void reject(std::vector<zmq::message_t> &msg, size_t body);
+
+	Fabric &fabric_;
+	zmq::context_t &context_;
+	zmq::socket_t frontend_;
+	zmq::socket_t replies_;       // Workers' replies, to send on the frontend.
+	std::string replyaddr_;
+	std::vector<std::thread> threads_;
+	std::deque<Job> queues_[static_cast<int>(Lane::end)];
+	std::set<std::string> busy_;  // Clients with a request being handled.
+	std::map<std::string, Session> sessions_;
+	bool running_;
+	double rate_;                 // Of the monitor lane, 0 if unlimited.
+	double tokens_;               // Monitor requests that may start now.
+	std::chrono::steady_clock::time_point refilled_;
+	uint64_t received_;           // Requests queued, to number them.
+	std::mutex lock_;
+	std::condition_variable wake_;
+};
+
 
 };  // namespace rpc
 };  // namespace dharc
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_FABRIC_SCHEDULER_HPP_
+#define DHARC_FABRIC_SCHEDULER_HPP_
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "dharc/regions.hpp"
+#include "dharc/histogram.hpp"
+#include "dharc/region.hpp"
+#include "dharc/registry.hpp"
+
+using std::vector;
+using dharc::RegionID;
+using dharc::TickStats;
+
+namespace dharc {
+namespace fabric {
+/**
+ * Deadline based scheduling of region process passes, driven entirely by
+ * the monotonic clock. Every region has a period and a priority. A pass is
+ * released either periodically or when new input arrives, and when several
+ * are released the highest priority, then earliest deadline, runs first.
+ * Lateness, jitter and deadline misses are recorded for each region.
+ */
+class Scheduler {
+	public:
+	typedef std::chrono::steady_clock clock;
+
+	/**
+	 * @param period Default period of regions.
+	 */
+	explicit Scheduler(std::chrono::nanoseconds period)
+		: period_(period), generation_(0) {}
+	~Scheduler() = default;
+
+	void add(RegionID regid, int priority = 0);
+	void remove(RegionID regid);
+
+	bool setSchedule(RegionID regid, std::chrono::nanoseconds period,
+		int priority);
+
+	/**
+	 * Change the period of every region, and the default period.
+	 */
+	void setPeriod(std::chrono::nanoseconds period);
+
+	/**
+	 * Run the most urgent released process pass. Safe to call from several
+	 * threads, a region is only ever processed by one of them at a time.
+	 * @param regions Regions to be scheduled.
+	 * @param periodic Release on each period rather than on new input.
+	 * @param units Set to the number of units processed.
+	 * @param helpercpu Set to the CPU time of OpenMP threads other than the
+	 *        caller's in the pass, see Region::helperCpu.
+	 * @return false if nothing was released.
+	 */
+	bool runNext(const Registry::Guard &regions, bool periodic, size_t &units,
+		uint64_t &helpercpu);
+
+	/**
+	 * Earliest time a region will be released when periodic.
+	 */
+	clock::time_point nextRelease();
+
+	TickStats stats(RegionID regid);
+
+	/**
+	 * Raw lateness histogram in nanoseconds, see Histogram::bucketValue.
+	 */
+	vector<uint64_t> lateness(RegionID regid);
+
+	private:
+	struct Entry {
+		std::chrono::nanoseconds period;
+		int priority;
+		clock::time_point release;
+		std::chrono::nanoseconds lastlate;
+		uint64_t ticks;
+		uint64_t missed;
+		uint64_t skipped;
+		float jitter;  // Nanoseconds
+		bool running;  // Being processed by another thread.
+		uint64_t generation;  // Tells apart entries added for a reused id.
+		Histogram late;
+	};
+
+	void complete(Entry &e, clock::time_point release, clock::time_point start,
+		clock::time_point finish, bool periodic);
+
+	std::map<RegionID, std::unique_ptr<Entry>> entries_;
+	std::chrono::nanoseconds period_;
+	uint64_t generation_;
+	std::mutex lock_;
+};
+};  // namespace fabric
+};  // namespace dharc
+
+#endif  // DHARC_FABRIC_SCHEDULER_HPP_
@@ -18,8 +18,11 @@
 #include <deque>
 #include <iostream>
 #include <mutex>
+#include <new>
+#include <ctime>
 
 #include "dharc/region.hpp"
+#include "dharc/cputime.hpp"
 
 #include "region.cpp"
 
@@ -31,90 +34,606 @@ using std::mutex;
 using std::unique_lock;
 using std::condition_variable;
 using dharc::fabric::Region;
+using dharc::fabric::threadCpu;
 
+constexpr std::chrono::seconds Fabric::kMaxStepWait;
+constexpr size_t Fabric::kMaxPixels;
+constexpr size_t Fabric::kMaxUnits;
+constexpr uint64_t Fabric::kMaxLinkBytes;
+constexpr size_t Fabric::kMaxPyramid;
 
 
-atomic<unsigned long long> Fabric::counter__(0);
-atomic<size_t> Fabric::processed__(0);
-vector<Region*> Fabric::regions__;
 
+Fabric::Fabric(Pool *pool)
+	: start_(std::chrono::steady_clock::now()), processed_(0),
+		scheduler_{std::chrono::milliseconds(counterResolution())},
+		policy_(Policy::input), frames_(0), cputime_(0),
+		ownpool_((pool == nullptr) ? new Pool(1) : nullptr),
+		pool_((pool == nullptr) ? ownpool_.get() : pool),
+		running_(false) {}
 
 
 
-void Fabric::counterThread() {
-	while (true) {
-		++counter__;
+Fabric::~Fabric() {
+	stop();
+}
 
-		std::this_thread::sleep_for(
-			std::chrono::milliseconds(counterResolution()));
-	}
+
+
+void Fabric::start() {
+	std::lock_guard<mutex> lk(runlock_);
+	if (running_) return;
+
+	running_ = true;
+	pool_->attach(this);
 }
 
 
 
-void Fabric::processThread() {
-	while (true) {
-		for (auto i : regions__) {
-			i->process();
+void Fabric::stop() {
+	std::lock_guard<mutex> lk(runlock_);
+	if (!running_) return;
+
+	pool_->detach(this);
+	running_ = false;
+}
+
+
+
+bool Fabric::runOnce(Pool::clock::time_point &wake, bool &spin) {
+	const Policy policy = policy_;
+
+	bool ran;
+	size_t units = 0;
+	uint64_t helpercpu = 0;
+	const uint64_t cpu = threadCpu();
+	{
+		Registry::Guard regions(registry_);
+		// Only a fixed rate reprocesses unchanged input.
+		ran = scheduler_.runNext(regions, policy == Policy::rate, units,
+			helpercpu);
+	}
+
+	// Looking for a pass costs CPU too, which polling does continually.
+	cputime_ += threadCpu() - cpu + helpercpu;
+	if (ran) {
+		// A pass that found nothing to do is not a frame, but its CPU counts.
+		if (units > 0) {
+			processed_ += units;
+			++frames_;
 		}
-		//std::this_thread::sleep_for(
-			//std::chrono::milliseconds(10));
-		std::this_thread::yield();
+		return true;
 	}
+
+	switch (policy) {
+	case Policy::input:
+		break;
+	case Policy::rate:
+		wake = std::min(wake, scheduler_.nextRelease());
+		break;
+	case Policy::poll:
+		spin = true;
+		break;
+	}
+	return false;
 }
 
 
 
-void Fabric::initialise() {
-	regions__.resize(1);
+void Fabric::setPolicy(Policy policy) {
+	policy_ = policy;
+	pool_->notify();
+}
 
-	regions__[static_cast<size_t>(RegionID::SENSE_CAMERA_0_LUMINANCE)] =
-		new Region(320, 240, 64, 48);
 
-	std::thread t(counterThread);
-	t.detach();
 
+void Fabric::setRate(float hz) {
+	if (hz <= 0.0f) return;
+	scheduler_.setPeriod(std::chrono::nanoseconds(
+		static_cast<long long>(1000000000.0f / hz)));
+	pool_->notify();
+}
 
-	std::thread p(processThread);
-	p.detach();
-	//std::thread p2(processThread);
-	//p2.detach();
+
+
+bool Fabric::setSchedule(RegionID regid, std::chrono::nanoseconds period,
+		int priority) {
+	if (!scheduler_.setSchedule(regid, period, priority)) return false;
+	pool_->notify();
+	return true;
 }
 
 
 
-void Fabric::finalise() {
+TickStats Fabric::tickStats(RegionID regid) {
+	return scheduler_.stats(regid);
+}
+
+
+
+vector<uint64_t> Fabric::lateness(RegionID regid) {
+	return scheduler_.lateness(regid);
+}
+
+
+
+Metrics Fabric::metrics(RegionID regid) {
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg == nullptr) return Metrics{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+	return reg->metrics();
+}
+
+
+
+vector<uint64_t> Fabric::latency(RegionID regid, Latency op) {
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg == nullptr) return vector<uint64_t>();
+
+	return reg->latency(op);
+}
+
+
+
+float Fabric::cpuPerFrame() {
+	const unsigned long long frames = frames_;
+	if (frames == 0) return 0.0f;
+	return static_cast<float>(cputime_) / static_cast<float>(frames) / 1000.0f;
 }
 
 
 
 vector<uint8_t> Fabric::reform2D(RegionID regid, size_t uw, size_t uh) {
 	vector<uint8_t> out;
-	Region *reg = getRegion(regid);
-	if (reg == nullptr) return out;
+	TileGrid grid{0, 0, 0, 0};
+	{
+		Registry::Guard regions(registry_);
+		Region *reg = regions.get(regid);
+		if (reg == nullptr) return out;
+
+		grid = TileGrid{reg->width(), reg->height(), reg->unitWidth(),
+			reg->unitHeight()};
+		if (uw == 0 || uh == 0 || uw > grid.tilew || uh > grid.tileh) {
+			return out;
+		}
+		reg->reform(out);
+	}
+
+	if (uw == grid.tilew && uh == grid.tileh) return out;
+	vector<uint8_t> small(grid.tilesX() * uw * grid.tilesY() * uh);
+	grid.shrink(out.data(), uw, uh, small.data());
+	return small;
+}
+
+
+
+vector<vector<uint8_t>> Fabric::pyramid2D(RegionID regid, size_t levels) {
+	vector<vector<uint8_t>> out;
+	size_t width;
+	size_t height;
+	{
+		Registry::Guard regions(registry_);
+		Region *reg = regions.get(regid);
+		if (reg == nullptr || levels == 0) return out;
 
-	reg->reform(out);
+		width = reg->width();
+		height = reg->height();
+		out.emplace_back();
+		reg->reform(out.back());
+	}
+
+	if (levels > kMaxPyramid) levels = kMaxPyramid;
+	while (out.size() < levels && width >= 2 && height >= 2) {
+		// Each 2 by 2 block of the level before is a unit of one pixel.
+		const TileGrid grid{width, height, 2, 2};
+		width /= 2;
+		height /= 2;
+		vector<uint8_t> level(width * height);
+		grid.shrink(out.back().data(), 1, 1, level.data());
+		out.push_back(std::move(level));
+	}
 	return out;
 }
 
 
 
-void Fabric::write2D(
+size_t Fabric::reform2D(RegionID regid, uint8_t *out, size_t size) {
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg == nullptr) return 0;
+
+	const size_t bytes = reg->width() * reg->height();
+	if (size < bytes) return 0;
+
+	reg->reform(out, bytes);
+	return bytes;
+}
+
+
+
+vector<uint8_t> Fabric::step2D(RegionID regid, const uint8_t *data,
+		size_t size, size_t uw, size_t uh, std::chrono::microseconds wait) {
+	return stepAfter(regid, write2D(regid, data, size), uw, uh, wait);
+}
+
+
+
+vector<uint8_t> Fabric::stepShm(RegionID regid, uint64_t seq, size_t uw,
+		size_t uh, std::chrono::microseconds wait) {
+	return stepAfter(regid, writeShm(regid, seq), uw, uh, wait);
+}
+
+
+
+vector<uint8_t> Fabric::stepAfter(RegionID regid, const WriteStatus &status,
+		size_t uw, size_t uh, std::chrono::microseconds wait) {
+	vector<uint8_t> out;
+	if (status.result == WriteResult::rejected ||
+			status.result == WriteResult::dropped) {
+		return out;
+	}
+
+	if (wait > kMaxStepWait) wait = kMaxStepWait;
+
+	// Pinned rather than guarded while waiting, so that regions can still be
+	// created and destroyed. One destroyed or replaced meanwhile is not
+	// processed again, so the wait times out.
+	std::shared_ptr<Region> reg;
+	{
+		Registry::Guard regions(registry_);
+		reg = regions.pin(regid);
+	}
+	if (reg == nullptr) return out;
+
+	const TileGrid grid{reg->width(), reg->height(), reg->unitWidth(),
+		reg->unitHeight()};
+	if (uw == 0 || uh == 0 || uw > grid.tilew || uh > grid.tileh) return out;
+
+	out.resize(grid.width * grid.height);
+	if (wait.count() == 0) {
+		reg->reform(out.data(), out.size());
+	} else if (!reg->reformAfter(status.seq, out.data(), out.size(), wait)) {
+		out.clear();
+		return out;
+	}
+
+	if (uw == grid.tilew && uh == grid.tileh) return out;
+	vector<uint8_t> small(grid.tilesX() * uw * grid.tilesY() * uh);
+	grid.shrink(out.data(), uw, uh, small.data());
+	return small;
+}
+
+
+
+WriteStatus Fabric::write2D(
 		RegionID regid,
 		const vector<uint8_t> &v) {
-	Region *reg = getRegion(regid);
-	if (reg == nullptr) return;
+	return write2D(regid, v.data(), v.size());
+}
+
+
+
+WriteStatus Fabric::write2D(RegionID regid, const uint8_t *data, size_t size) {
+	WriteStatus status{WriteResult::rejected, 0, 0, 0};
+
+	{
+		Registry::Guard regions(registry_);
+		Region *reg = regions.get(regid);
+		if (reg == nullptr) return status;
+		if (size != reg->width() * reg->height()) return status;
+
+		status = reg->write(data, size);
+	}
+
+	if (status.result != WriteResult::dropped) pool_->notify();
+	return status;
+}
+
+
+
+WriteStatus Fabric::writeDelta2D(RegionID regid, uint64_t base,
+		const uint8_t *bitmap, size_t bitmapsize, const uint8_t *tiles,
+		size_t tilessize, size_t uw, size_t uh) {
+	WriteStatus status{WriteResult::rejected, 0, 0, 0};
+
+	{
+		Registry::Guard regions(registry_);
+		Region *reg = regions.get(regid);
+		if (reg == nullptr) return status;
+		if (uw != reg->unitWidth() || uh != reg->unitHeight()) return status;
+
+		status = reg->writeDelta(base, bitmap, bitmapsize, tiles, tilessize);
+	}
+
+	if (status.result != WriteResult::dropped &&
+			status.result != WriteResult::rejected) {
+		pool_->notify();
+	}
+	return status;
+}
+
+
+
+bool Fabric::attachShm(RegionID regid, const std::string &name) {
+	std::shared_ptr<ShmRing> ring(ShmRing::open(name));
+	if (!ring) return false;
+
+	// Checked under the ring lock, so a destroy either comes first or drops
+	// the ring after it.
+	std::lock_guard<mutex> lk(ringlock_);
+	{
+		Registry::Guard regions(registry_);
+		if (regions.get(regid) == nullptr) return false;
+	}
+	rings_[regid] = ring;
+	return true;
+}
+
 
-	reg->write(v);
+
+bool Fabric::detachShm(RegionID regid) {
+	std::lock_guard<mutex> lk(ringlock_);
+	return rings_.erase(regid) > 0;
+}
+
+
+
+WriteStatus Fabric::writeShm(RegionID regid, uint64_t seq) {
+	std::shared_ptr<ShmRing> ring;
+	{
+		std::lock_guard<mutex> lk(ringlock_);
+		auto it = rings_.find(regid);
+		if (it != rings_.end()) ring = it->second;
+	}
+
+	WriteStatus status{WriteResult::rejected, 0, 0, 0};
+	if (!ring) return status;
+
+	ring->read(seq, [this, regid, &status](const uint8_t *data, size_t size) {
+		status = write2D(regid, data, size);
+	});
+	return status;
+}
+
+
+
+bool Fabric::validGeometry(size_t width, size_t height,
+		size_t unitsx, size_t unitsy) {
+	if (unitsx == 0 || unitsy == 0 || width < unitsx || height < unitsy ||
+			width % unitsx != 0 || height % unitsy != 0) {
+		return false;
+	}
+
+	// Checked in turn so that none of the products can overflow.
+	if (width > kMaxPixels || height > kMaxPixels / width) return false;
+	if (unitsx * unitsy > kMaxUnits) return false;
+	return Region::linkBytes(width, height, unitsx, unitsy) <= kMaxLinkBytes;
 }
 
 
 
-Region *Fabric::getRegion(RegionID regid) {
-	if (static_cast<size_t>(regid) >= regions__.size()) {
-		return nullptr;
-	} else {
-		return regions__[static_cast<size_t>(regid)];
+RegionID Fabric::create2D(size_t width, size_t height,
+		size_t unitsx, size_t unitsy) {
+	if (!validGeometry(width, height, unitsx, unitsy)) {
+		return RegionID::INVALID;
+	}
+
+	Region *region;
+	try {
+		region = new Region(width, height, unitsx, unitsy);
+	} catch (const std::bad_alloc&) {
+		return RegionID::INVALID;
 	}
+
+	const RegionID regid = registry_.insert(region);
+	if (regid == RegionID::INVALID) {
+		delete region;
+		return regid;
+	}
+
+	hookOutput(regid, region);
+	scheduler_.add(regid);
+	return regid;
 }
 
+
+
+bool Fabric::resize2D(RegionID regid, size_t width, size_t height,
+		size_t unitsx, size_t unitsy) {
+	if (!validGeometry(width, height, unitsx, unitsy)) return false;
+
+	{
+		Registry::Guard regions(registry_);
+		if (regions.get(regid) == nullptr) return false;
+	}
+
+	Region *region;
+	try {
+		region = new Region(width, height, unitsx, unitsy);
+	} catch (const std::bad_alloc&) {
+		return false;
+	}
+
+	hookOutput(regid, region);
+	if (!registry_.replace(regid, region)) {
+		delete region;
+		return false;
+	}
+	return true;
+}
+
+
+
+bool Fabric::destroy(RegionID regid) {
+	// Unscheduled first, as once erased the id may be reused by a create
+	// that schedules it again.
+	scheduler_.remove(regid);
+	if (!registry_.erase(regid)) return false;
+
+	// A region created later with the same id must not read this ring.
+	std::lock_guard<mutex> lk(ringlock_);
+	rings_.erase(regid);
+	return true;
+}
+
+
+
+bool Fabric::save(RegionID regid, const std::string &path) {
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg == nullptr) return false;
+
+	return reg->save(path);
+}
+
+
+
+bool Fabric::snapshot(RegionID regid, const std::string &path, size_t rate) {
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg == nullptr) return false;
+
+	return reg->snapshot(path, rate);
+}
+
+
+
+SnapshotStats Fabric::snapshotStats(RegionID regid) {
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg == nullptr) return SnapshotStats{0, 0, 0, 0, 0, 0.0f, 0.0f};
+
+	return reg->snapshotStats();
+}
+
+
+
+RegionID Fabric::restore(RegionID regid, const std::string &path) {
+	if (regid != RegionID::INVALID) {
+		Registry::Guard regions(registry_);
+		if (regions.get(regid) == nullptr) return RegionID::INVALID;
+	}
+
+	Region *region;
+	try {
+		region = Region::restore(path, &Fabric::validGeometry);
+	} catch (const std::bad_alloc&) {
+		return RegionID::INVALID;
+	}
+	if (region == nullptr) return RegionID::INVALID;
+
+	if (regid != RegionID::INVALID) {
+		hookOutput(regid, region);
+		if (!registry_.replace(regid, region)) {
+			delete region;
+			return RegionID::INVALID;
+		}
+		return regid;
+	}
+
+	regid = registry_.insert(region);
+	if (regid == RegionID::INVALID) {
+		delete region;
+		return regid;
+	}
+
+	hookOutput(regid, region);
+	scheduler_.add(regid);
+	return regid;
+}
+
+
+
+void Fabric::setOutputSink(OutputSink sink) {
+	std::set<RegionID> published;
+	{
+		std::lock_guard<mutex> lk(publock_);
+		sink_ = std::move(sink);
+		published = published_;
+	}
+
+	Registry::Guard regions(registry_);
+	for (auto regid : published) {
+		Region *reg = regions.get(regid);
+		if (reg != nullptr) hookOutput(regid, reg);
+	}
+}
+
+
+
+void Fabric::publish2D(RegionID regid, bool on) {
+	{
+		std::lock_guard<mutex> lk(publock_);
+		if (on) {
+			published_.insert(regid);
+		} else {
+			published_.erase(regid);
+		}
+	}
+
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg != nullptr) hookOutput(regid, reg);
+}
+
+
+
+void Fabric::hookOutput(RegionID regid, Region *reg) {
+	std::lock_guard<mutex> lk(publock_);
+	if (!sink_ || published_.count(regid) == 0) {
+		reg->setOutputHook(nullptr);
+		return;
+	}
+
+	OutputSink sink = sink_;
+	const TileGrid grid{reg->width(), reg->height(), reg->unitWidth(),
+		reg->unitHeight()};
+	reg->setOutputHook([sink, regid, grid](uint64_t epoch,
+			const vector<uint8_t> &out) {
+		sink(regid, epoch, grid, out);
+	});
+}
+
+
+
+bool Fabric::setBudget(RegionID regid, std::chrono::microseconds budget) {
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg == nullptr) return false;
+
+	reg->setBudget(budget);
+	return true;
+}
+
+
+
+Coverage Fabric::coverage(RegionID regid) {
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg == nullptr) return Coverage{0, 0, 0, 0, 0, 0.0f};
+
+	return reg->coverage();
+}
+
+
+
+bool Fabric::setIngest(RegionID regid, Ingest mode, size_t depth) {
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg == nullptr) return false;
+
+	reg->setIngest(mode, depth);
+	return true;
+}
+
+
+
+IngestStats Fabric::ingestStats(RegionID regid) {
+	Registry::Guard regions(registry_);
+	Region *reg = regions.get(regid);
+	if (reg == nullptr) return IngestStats{Ingest::latest, 0, 0, 0, 0, 0, 0};
+
+	return reg->ingestStats();
+}
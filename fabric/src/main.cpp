@@ -2,38 +2,155 @@
  * Copyright 2015 Nicolas Pope
  */
 
+#include <chrono>
 #include <iostream>
-#include <sstream>
 #include <string>
 #include <csignal>
+#include <thread>
+#include <vector>
 
 #include "zmq.hpp"
+#include "dharc/rpc.hpp"
 #include "dharc/rpc_server.hpp"
+#include "dharc/rpc_publisher.hpp"
 #include "dharc/fabric.hpp"
 
 using std::cout;
 using std::string;
 using dharc::Fabric;
 
-void signal_handler(int param) {
-	std::cout << std::endl;
+namespace {
+volatile std::sig_atomic_t interrupted = 0;
+};
 
-	exit(0);
+void signal_handler(int param) {
+	interrupted = 1;
 }
 
 
 int main(int argc, char *argv[]) {
 	int i = 1;
-	zmq::message_t msg;
+	size_t workers = dharc::rpc::Server::kDefaultWorkers;
+	int threshold = 0;
+	double monitorRate = dharc::rpc::Server::kDefaultMonitorRate;
+	bool hasBudget = false;
+	std::chrono::microseconds budget(0);
+	std::vector<string> endpoints;
+	std::vector<string> outputs;
 
 	signal(SIGINT, signal_handler);
 
-	Fabric::initialise();
+	Fabric fabric;
+	fabric.create2D(320, 240, 64, 48);  // SENSE_CAMERA_0_LUMINANCE
 
 	// Process command line arguments.
 	while (i < argc) {
-		if (argv[i][0] == '-') {
+		// Replace the camera region with a saved checkpoint.
+		if (string(argv[i]) == "--restore") {
+			if (++i >= argc) {
+				cout << "Missing checkpoint argument." << std::endl;
+				return -1;
+			}
+			if (fabric.restore(dharc::RegionID::SENSE_CAMERA_0_LUMINANCE,
+					argv[i]) == dharc::RegionID::INVALID) {
+				cout << "Could not restore checkpoint: " << argv[i] << std::endl;
+				return -1;
+			}
+		} else if (argv[i][0] == '-') {
 			switch (argv[i][1]) {
+			// Per pass time budget in microseconds, 0 for unlimited.
+			case 'b':
+				if (++i >= argc) {
+					cout << "Missing budget argument." << std::endl;
+					return -1;
+				}
+				budget = std::chrono::microseconds(std::stoul(argv[i]));
+				hasBudget = true;
+				break;
+			// Process policy: input, rate or poll.
+			case 'p':
+				if (++i >= argc) {
+					cout << "Missing policy argument." << std::endl;
+					return -1;
+				}
+				if (string(argv[i]) == "input") {
+					fabric.setPolicy(Fabric::Policy::input);
+				} else if (string(argv[i]) == "rate") {
+					fabric.setPolicy(Fabric::Policy::rate);
+				} else if (string(argv[i]) == "poll") {
+					fabric.setPolicy(Fabric::Policy::poll);
+				} else {
+					cout << "Unknown policy: " << argv[i] << std::endl;
+					return -1;
+				}
+				break;
+			// Process rate in Hz for the rate policy.
+			case 'r':
+				if (++i >= argc) {
+					cout << "Missing rate argument." << std::endl;
+					return -1;
+				}
+				fabric.setRate(std::stof(argv[i]));
+				break;
+			// Least change of a pixel worth sending in output deltas.
+			case 't':
+				if (++i >= argc) {
+					cout << "Missing threshold argument." << std::endl;
+					return -1;
+				}
+				threshold = std::stoi(argv[i]);
+				break;
+			// Endpoint to listen for RPC on, any number of times.
+			case 'e':
+				if (++i >= argc) {
+					cout << "Missing endpoint argument." << std::endl;
+					return -1;
+				}
+				endpoints.push_back(argv[i]);
+				break;
+			// Endpoint to publish region outputs on, any number of times.
+			case 'o':
+				if (++i >= argc) {
+					cout << "Missing endpoint argument." << std::endl;
+					return -1;
+				}
+				outputs.push_back(argv[i]);
+				break;
+			// Number of ZMQ I/O threads.
+			case 'i':
+				if (++i >= argc) {
+					cout << "Missing threads argument." << std::endl;
+					return -1;
+				}
+				if (!dharc::rpc::setIoThreads(std::stoi(argv[i]))) {
+					cout << "Invalid number of I/O threads." << std::endl;
+					return -1;
+				}
+				break;
+			// Number of threads handling RPC requests.
+			case 'w':
+				if (++i >= argc) {
+					cout << "Missing workers argument." << std::endl;
+					return -1;
+				}
+				workers = std::stoul(argv[i]);
+				break;
+			// Directory of checkpoints named by clients.
+			case 'c':
+				if (++i >= argc) {
+					cout << "Missing checkpoint directory argument." << std::endl;
+					return -1;
+				}
+				dharc::rpc::setCheckpointDir(argv[i]);
+				break;
+			// Requests a second from monitors, 0 for unlimited.
+			case 'm':
+				if (++i >= argc) {
+					cout << "Missing monitor rate argument." << std::endl;
+					return -1;
+				}
+				monitorRate = std::stod(argv[i]);
+				break;
 			default:
 				cout << "Unrecognised command line argument." << std::endl;
 				return -1;
@@ -42,53 +159,49 @@ int main(int argc, char *argv[]) {
 		++i;
 	}
 
-	zmq::context_t context(1);
+	// Only now, so that it applies to the region as restored.
+	if (hasBudget && !fabric.setBudget(
+			dharc::RegionID::SENSE_CAMERA_0_LUMINANCE, budget)) {
+		cout << "No region to apply the budget to." << std::endl;
+		return -1;
+	}
+
+	fabric.start();
 
-	zmq::socket_t rpc(context, ZMQ_REP);
-	rpc.bind("tcp://*:7878");
+	if (endpoints.empty()) endpoints.push_back("tcp://*:7878");
+	if (outputs.empty()) outputs.push_back("tcp://*:7879");
+	zmq::context_t &context = dharc::rpc::context();
 
-	zmq::pollitem_t items [] = {
-		{ rpc, 0, ZMQ_POLLIN, 0 }
-	};
+	// Region outputs for viewers, published from a thread of their own.
+	dharc::rpc::Publisher publisher(fabric, context);
+	publisher.setThreshold(threshold);
+	dharc::rpc::Server server(fabric, context, workers);
+	server.setMonitorRate(monitorRate);
 
-	while (true) {
+	// Bind everything before the publishing thread starts, so a failure can
+	// still return cleanly.
+	for (auto &e : outputs) {
 		try {
-			zmq::poll(&items[0], 1, -1);
-		} catch (zmq::error_t ex) {
-			cout << "zmq error\n";
-			continue;
+			publisher.bind(e);
+		} catch (const zmq::error_t &err) {
+			cout << "Could not bind " << e << ": " << err.what() << std::endl;
+			return -1;
 		}
-
-		if (items[0].revents & ZMQ_POLLIN) {
-			while (true) {
-				try {
-					rpc.recv(&msg);
-					break;
-				} catch (zmq::error_t err) {}
-			}
-
-
-			std::istringstream is(string((const char*)msg.data(), msg.size()),
-									std::ios_base::in | std::ios_base::binary);
-			std::ostringstream os(std::ios_base::out | std::ios_base::binary);
-
-			dharc::rpc::process_msg(is, os);
-
-			string res = os.str();
-			zmq::message_t rep(const_cast<char*>(res.data()), os.tellp(), 0);
-
-			while (true) {
-				try {
-					rpc.send(res.data(), os.tellp());
-					break;
-				} catch (zmq::error_t err) {
-					std::cout << "Oops, send error\n";
-				}
-			}
-
-			items[0].revents = 0;
+	}
+	for (auto &e : endpoints) {
+		try {
+			server.bind(e);
+		} catch (const zmq::error_t &err) {
+			cout << "Could not bind " << e << ": " << err.what() << std::endl;
+			return -1;
 		}
 	}
 
+	std::thread publishing([&publisher]() { publisher.run(interrupted); });
+	server.run(interrupted);
+
+	publishing.join();
+
+	cout << std::endl;
 	return 0;
 }
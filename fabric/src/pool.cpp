@@ -0,0 +1,137 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#include "dharc/pool.hpp"
+
+#include <algorithm>
+
+#include "dharc/cputime.hpp"
+#include "dharc/fabric.hpp"
+
+using dharc::fabric::Pool;
+using dharc::Fabric;
+using dharc::fabric::threadCpu;
+
+constexpr std::chrono::milliseconds Pool::kMaxWait;
+
+
+
+Pool::Pool(size_t threads) : next_(0), seq_(0), running_(true) {
+	if (threads == 0) threads = 1;
+	for (auto i = 0U; i < threads; ++i) {
+		threads_.emplace_back(&Pool::worker, this);
+	}
+}
+
+
+
+Pool::~Pool() {
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		running_ = false;
+	}
+	wake_.notify_all();
+
+	for (auto &t : threads_) t.join();
+}
+
+
+
+void Pool::attach(Fabric *fabric) {
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		for (auto &m : members_) {
+			if (m->fabric == fabric && !m->detached) return;
+		}
+		members_.emplace_back(new Member{fabric, 0, false});
+		++seq_;
+	}
+	wake_.notify_all();
+}
+
+
+
+void Pool::detach(Fabric *fabric) {
+	std::unique_lock<std::mutex> lk(lock_);
+	auto it = std::find_if(members_.begin(), members_.end(),
+		[fabric](const std::unique_ptr<Member> &m) {
+			return m->fabric == fabric && !m->detached;
+		});
+	if (it == members_.end()) return;
+
+	Member *m = it->get();
+	m->detached = true;
+	idle_.wait(lk, [m]() { return m->busy == 0; });
+
+	members_.erase(std::find_if(members_.begin(), members_.end(),
+		[m](const std::unique_ptr<Member> &p) { return p.get() == m; }));
+}
+
+
+
+void Pool::notify() {
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		++seq_;
+	}
+	wake_.notify_all();
+}
+
+
+
+void Pool::chargeIdle(const vector<Member*> &idle, uint64_t ns) {
+	if (idle.empty()) return;
+
+	// Shared by the fabrics that had nothing to run, if still attached.
+	const uint64_t share = ns / idle.size();
+	for (auto m : idle) {
+		const bool attached = std::any_of(members_.begin(), members_.end(),
+			[m](const std::unique_ptr<Member> &p) { return p.get() == m; });
+		if (attached && !m->detached) m->fabric->chargeIdle(share);
+	}
+}
+
+
+
+void Pool::worker() {
+	std::unique_lock<std::mutex> lk(lock_);
+	vector<Member*> idle;  // Fabrics tried without running a pass.
+
+	while (running_) {
+		const uint64_t seq = seq_;
+		auto wake = clock::now() + kMaxWait;
+		bool spin = false;
+		bool ran = false;
+		idle.clear();
+
+		// Try each fabric once, starting after the last one tried by any
+		// worker so that none is starved.
+		for (auto n = members_.size(); n > 0 && !ran && running_; --n) {
+			if (members_.empty()) break;
+			Member *m = members_[next_++ % members_.size()].get();
+			if (m->detached) continue;
+
+			++m->busy;
+			lk.unlock();
+			ran = m->fabric->runOnce(wake, spin);
+			lk.lock();
+			if (!ran) idle.push_back(m);
+			if (--m->busy == 0 && m->detached) idle_.notify_all();
+		}
+
+		if (ran) continue;
+
+		const uint64_t cpu = threadCpu();
+		if (spin) {
+			lk.unlock();
+			std::this_thread::yield();
+			lk.lock();
+		} else {
+			wake_.wait_until(lk, wake, [this, seq]() {
+				return !running_ || seq_ != seq;
+			});
+		}
+		chargeIdle(idle, threadCpu() - cpu);
+	}
+}
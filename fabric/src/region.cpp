@@ -3,37 +3,421 @@
  */
 
 #include "dharc/region.hpp"
+#include "dharc/cputime.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <cstring>
+#include <cstdio>
+#include <omp.h>
 
 using dharc::fabric::Region;
 using std::pair;
+using std::atomic;
+using std::chrono::steady_clock;
+
+constexpr int Region::kLockstepTimeout;
+
+namespace {
+/* Snapshot progress of each unit */
+constexpr uint8_t kTileLive = 0;    // Not yet written, links unchanged.
+constexpr uint8_t kTileBusy = 1;    // Being written or copied.
+constexpr uint8_t kTileDone = 2;    // Written from the live links.
+constexpr uint8_t kTileCopied = 3;  // Links copied aside before a change.
+
+bool writeAll(int fd, const void *data, size_t size, uint64_t offset) {
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	while (size > 0) {
+		const ssize_t n = pwrite(fd, p, size, offset);
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+};  // namespace
+
+/**
+ * A checkpoint being written in the background, see Region::snapshot.
+ */
+struct Region::Snapshot {
+	Snapshot(const std::string &p, int f, size_t r, size_t count,
+			size_t hb)
+		: path(p), fd(f), rate(r), headbytes(hb), heads(count * hb),
+			tiles(new std::atomic<uint8_t>[count]), copies(count), copied(0),
+			maxstall(0), pass(0), passstall(0) {
+		for (auto i = 0U; i < count; ++i) tiles[i] = kTileLive;
+	}
+
+	const std::string path;
+	const int fd;
+	const size_t rate;
+	const size_t headbytes;
+	vector<uint8_t> heads;  // Record of each unit up to its links.
+	std::unique_ptr<std::atomic<uint8_t>[]> tiles;
+	vector<std::unique_ptr<uint8_t[]>> copies;
+	std::atomic<uint32_t> copied;
+	steady_clock::time_point start;
+	uint64_t maxstall;                // Nanoseconds
+	std::atomic<uint64_t> pass;       // Passes since the snapshot started.
+	std::atomic<uint64_t> passstall;  // Nanoseconds, in the current pass.
+};
 
 
 Region::Region(size_t width, size_t height, size_t unitsx, size_t unitsy)
+	: Region(width, height, unitsx, unitsy, nullptr, 0) {}
+
+
+
+Region::Region(size_t width, size_t height, size_t unitsx, size_t unitsy,
+		void *map, size_t mapsize)
 	: unitsx_(unitsx), unitsy_(unitsy), width_(width), height_(height),
 		uwidth_(width / unitsx), uheight_(height / unitsy),
-		outsize_(uwidth_ * uheight_) {
+		outsize_(uwidth_ * uheight_), map_(map), mapsize_(mapsize),
+		epoch_(0), snap_(nullptr), snapcancel_(false), snapok_(false),
+		ingest_(Ingest::latest), depth_(1),
+		pending_(0), inputtime_(0), inseq_(0), doneseq_(0), accepted_(0),
+		coalesced_(0), dropped_(0), reprocessed_(0), budget_(0),
+		unitcount_(0), linkcount_(0), learncount_(0), helpercpu_(0) {
 	assert(width % unitsx == 0);
 	assert(height % unitsy == 0);
 
+	statesize_ = unitBytes() * unitsx_ * unitsy_;
+
+	// A new region gets anonymous memory laid out exactly like a checkpoint,
+	// a restored one keeps the mapped file.
+	const bool init = (map_ == nullptr);
+	if (init) {
+		mapsize_ = statesize_;
+		map_ = mmap(nullptr, mapsize_, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map_ == MAP_FAILED) throw std::bad_alloc();
+		state_ = static_cast<uint8_t*>(map_);
+	} else {
+		state_ = static_cast<uint8_t*>(map_) + kCheckpointOffset;
+	}
+
 	units_.resize(1);
-	makeInputLayer();
+	makeInputLayer(init);
+
+	coverage_ = {0, static_cast<uint32_t>(unitsx_ * unitsy_),
+		static_cast<uint32_t>(unitsx_ * unitsy_), 0, 0, 0.0f};
+	sample_ = {steady_clock::now(), 0, 0, 0, 0.0f, 0.0f, 0.0f};
+	snapstats_ = {0, 0, 0, 0, 0, 0.0f, 0.0f};
 }
 
 
 
 Region::~Region() {
+	snapcancel_ = true;
+	{
+		std::lock_guard<std::mutex> lk(snaplock_);
+		if (snapthread_.joinable()) snapthread_.join();
+	}
+	munmap(map_, mapsize_);
+}
+
+
+
+uint64_t Region::linkBytes(size_t width, size_t height, size_t unitsx,
+		size_t unitsy) {
+	const uint64_t insize = (width / unitsx) * (height / unitsy);
+	return static_cast<uint64_t>(width) * height * insize * sizeof(Link);
 }
 
 
 
-void Region::makeInputLayer() {
+size_t Region::unitBytes() const {
+	const size_t insize = uwidth_ * uheight_;
+	const size_t bytes = sizeof(UnitState) + (insize + 2 * outsize_) *
+		sizeof(float) + outsize_ * insize * sizeof(Link);
+	return (bytes + kRecordAlign - 1) / kRecordAlign * kRecordAlign;
+}
+
+
+
+void Region::makeInputLayer(bool init) {
+	const size_t insize = uwidth_ * uheight_;
+	const size_t unitbytes = unitBytes();
+	uint8_t *rec = state_;
+
 	units_[0].resize(unitsx_);
 	for (auto x = 0U; x < unitsx_; ++x) {
 		units_[0][x].resize(unitsy_);
 		for (auto y = 0U; y < unitsy_; ++y) {
-			initUnit(units_[0][x][y], uwidth_, uheight_);
+			Unit &unit = units_[0][x][y];
+			float *f = reinterpret_cast<float*>(rec + sizeof(UnitState));
+
+			unit.index = x * unitsy_ + y;
+			unit.state = reinterpret_cast<UnitState*>(rec);
+			unit.inputs = {f, insize};
+			unit.outputs = {f + insize, outsize_};
+			unit.counts = {f + insize + outsize_, outsize_};
+			unit.links = {reinterpret_cast<Link*>(f + insize + 2 * outsize_),
+				outsize_ * insize};
+
+			if (init) initUnit(unit, uwidth_, uheight_);
+			rec += unitbytes;
+		}
+	}
+}
+
+
+
+Region *Region::restore(const std::string &path, GeometryCheck valid) {
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return nullptr;
+
+	CheckpointHeader hdr;
+	struct stat st;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			fstat(fd, &st) != 0 ||
+			std::memcmp(hdr.magic, kCheckpointMagic, sizeof(hdr.magic)) != 0 ||
+			hdr.version != kCheckpointVersion ||
+			hdr.linkbytes != sizeof(Link) ||
+			hdr.offset != kCheckpointOffset ||
+			hdr.unitsx == 0 || hdr.unitsy == 0 ||
+			hdr.width < hdr.unitsx || hdr.height < hdr.unitsy ||
+			hdr.width % hdr.unitsx != 0 || hdr.height % hdr.unitsy != 0 ||
+			(valid != nullptr &&
+				!valid(hdr.width, hdr.height, hdr.unitsx, hdr.unitsy)) ||
+			static_cast<uint64_t>(st.st_size) < hdr.offset ||
+			hdr.bytes > static_cast<uint64_t>(st.st_size) - hdr.offset) {
+		close(fd);
+		return nullptr;
+	}
+
+	// Private mapping: pages fault in from the file on first use and are
+	// copied on write, so the checkpoint itself stays unchanged.
+	const size_t mapsize = hdr.offset + hdr.bytes;
+	void *map = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return nullptr;
+
+	Region *reg;
+	try {
+		reg = new Region(hdr.width, hdr.height, hdr.unitsx, hdr.unitsy,
+			map, mapsize);
+	} catch (const std::bad_alloc&) {
+		munmap(map, mapsize);
+		throw;
+	}
+
+	// Geometry is consistent but the record layout may not be.
+	if (reg->unitBytes() != hdr.unitbytes || reg->statesize_ != hdr.bytes) {
+		delete reg;
+		return nullptr;
+	}
+	return reg;
+}
+
+
+
+bool Region::save(const std::string &path) {
+	std::lock_guard<std::mutex> lk(snaplock_);
+	if (!startSnapshot(path, 0)) return false;
+
+	snapthread_.join();
+	return snapok_;
+}
+
+
+
+bool Region::snapshot(const std::string &path, size_t rate) {
+	std::lock_guard<std::mutex> lk(snaplock_);
+	return startSnapshot(path, rate);
+}
+
+
+
+SnapshotStats Region::snapshotStats() {
+	std::lock_guard<dharc::Lock> lk(snapstatslock_);
+	return snapstats_;
+}
+
+
+
+size_t Region::headBytes() const {
+	// Everything in a unit record before its links.
+	return sizeof(UnitState) + (uwidth_ * uheight_ + 2 * outsize_) *
+		sizeof(float);
+}
+
+
+
+bool Region::startSnapshot(const std::string &path, size_t rate) {
+	if (snap_.load() != nullptr) return false;
+	if (snapthread_.joinable()) snapthread_.join();
+
+	const std::string tmp = path + ".tmp";
+	const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+
+	const size_t count = unitsx_ * unitsy_;
+	const size_t headbytes = headBytes();
+	Snapshot *snap = new Snapshot(path, fd, rate, count, headbytes);
+
+	{
+		// Everything but the links is small and changes every pass, so is
+		// copied up front. Links are left in place until written.
+		std::lock_guard<std::mutex> state(statelock_);
+		const auto start = steady_clock::now();
+		for (auto i = 0U; i < count; ++i) {
+			std::memcpy(&snap->heads[i * headbytes], state_ + i * unitBytes(),
+				headbytes);
 		}
+		snap->maxstall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			steady_clock::now() - start).count();
+		snap->start = start;
+		snap_.store(snap);
+	}
+
+	{
+		std::lock_guard<dharc::Lock> lk(snapstatslock_);
+		snapstats_.active = 1;
 	}
+
+	snapthread_ = std::thread(&Region::writeSnapshot, this, snap);
+	return true;
+}
+
+
+
+void Region::writeSnapshot(Snapshot *snap) {
+	const size_t count = unitsx_ * unitsy_;
+	const size_t unitbytes = unitBytes();
+	const size_t headbytes = snap->headbytes;
+	const size_t linkbytes = outsize_ * uwidth_ * uheight_ * sizeof(Link);
+
+	CheckpointHeader hdr;
+	std::memset(&hdr, 0, sizeof(hdr));
+	std::memcpy(hdr.magic, kCheckpointMagic, sizeof(hdr.magic));
+	hdr.version = kCheckpointVersion;
+	hdr.linkbytes = sizeof(Link);
+	hdr.width = width_;
+	hdr.height = height_;
+	hdr.unitsx = unitsx_;
+	hdr.unitsy = unitsy_;
+	hdr.unitbytes = unitbytes;
+	hdr.offset = kCheckpointOffset;
+	hdr.bytes = statesize_;
+
+	// Size the file first so record padding reads back as zeros.
+	bool ok = ftruncate(snap->fd, kCheckpointOffset + statesize_) == 0 &&
+		writeAll(snap->fd, &hdr, sizeof(hdr), 0);
+	uint64_t written = sizeof(hdr);
+
+	for (auto i = 0U; ok && i < count; ++i) {
+		if (snapcancel_) {
+			ok = false;
+			break;
+		}
+
+		const uint64_t offset = kCheckpointOffset + i * unitbytes;
+		ok = writeAll(snap->fd, &snap->heads[i * headbytes], headbytes, offset);
+
+		auto &tile = snap->tiles[i];
+		uint8_t expect = kTileLive;
+		if (tile.compare_exchange_strong(expect, kTileBusy)) {
+			// Passes touching this unit wait until its links are written.
+			ok = ok && writeAll(snap->fd, state_ + i * unitbytes + headbytes,
+				linkbytes, offset + headbytes);
+			tile.store(kTileDone);
+		} else {
+			while (tile.load() == kTileBusy) std::this_thread::yield();
+			ok = ok && writeAll(snap->fd, snap->copies[i].get(), linkbytes,
+				offset + headbytes);
+			snap->copies[i].reset();
+		}
+
+		written += headbytes + linkbytes;
+		if (snap->rate > 0) {
+			std::this_thread::sleep_until(snap->start +
+				std::chrono::microseconds(written * 1000000 / snap->rate));
+		}
+	}
+
+	ok = ok && fsync(snap->fd) == 0;
+	ok = (close(snap->fd) == 0) && ok;
+	const std::string tmp = snap->path + ".tmp";
+	ok = ok && std::rename(tmp.c_str(), snap->path.c_str()) == 0;
+	if (!ok) unlink(tmp.c_str());
+
+	// No pass can be using the snapshot once this lock is held.
+	{
+		std::lock_guard<std::mutex> state(statelock_);
+		snap_.store(nullptr);
+	}
+
+	{
+		std::lock_guard<dharc::Lock> lk(snapstatslock_);
+		snapstats_.active = 0;
+		if (ok) {
+			++snapstats_.snapshots;
+			snapstats_.bytes = kCheckpointOffset + statesize_;
+			snapstats_.copied = snap->copied;
+			snapstats_.duration = static_cast<float>(
+				std::chrono::duration_cast<std::chrono::microseconds>(
+				steady_clock::now() - snap->start).count());
+			snapstats_.maxstall = static_cast<float>(snap->maxstall) / 1000.0f;
+		} else {
+			++snapstats_.failed;
+		}
+	}
+
+	snapok_ = ok;
+	delete snap;
+}
+
+
+
+void Region::preserve(const Unit &unit) {
+	Snapshot *snap = snap_.load();
+	if (snap == nullptr) return;
+
+	auto &tile = snap->tiles[unit.index];
+	uint8_t expect = tile.load();
+	if (expect == kTileDone || expect == kTileCopied) return;
+
+	// Either copy the links aside or wait for the writer to finish with them,
+	// the time taken is a stall added to this pass.
+	const auto start = steady_clock::now();
+	if (expect == kTileLive && tile.compare_exchange_strong(expect, kTileBusy)) {
+		const size_t linkbytes = unit.links.size() * sizeof(Link);
+		snap->copies[unit.index].reset(new uint8_t[linkbytes]);
+		std::memcpy(snap->copies[unit.index].get(), unit.links.data, linkbytes);
+		++snap->copied;
+		tile.store(kTileCopied);
+	} else {
+		while (tile.load() == kTileBusy) std::this_thread::yield();
+	}
+
+	// Threads of a pass stall in parallel, so the pass is delayed by the
+	// most any one thread stalled rather than by the total.
+	static thread_local struct {
+		const Snapshot *snap;
+		uint64_t pass;
+		uint64_t stall;
+	} local = {nullptr, 0, 0};
+
+	const uint64_t pass = snap->pass.load();
+	if (local.snap != snap || local.pass != pass) local = {snap, pass, 0};
+	local.stall += std::chrono::duration_cast<std::chrono::nanoseconds>(
+		steady_clock::now() - start).count();
+
+	uint64_t max = snap->passstall.load();
+	while (local.stall > max &&
+		!snap->passstall.compare_exchange_weak(max, local.stall)) {}
 }
 
 
@@ -43,12 +427,6 @@ void Region::initUnit(Unit &unit, size_t iwidth, size_t iheight) {
 								(float)(iheight * iheight)) / 3.0f;
 
 	const auto insize = iwidth * iheight;
-	const auto linksize = outsize_ * insize;
-
-	unit.inputs.resize(insize);
-	unit.outputs.resize(outsize_);
-	unit.links.resize(linksize);
-	unit.counts.resize(outsize_);
 
 	for (auto x = 0U; x < outsize_; ++x) {
 		const int xi = (int)(((float)x / (float)outsize_) * (float)insize);
@@ -75,30 +453,176 @@ void Region::initUnit(Unit &unit, size_t iwidth, size_t iheight) {
 		}
 	}
 
-	unit.modulation = 0.5f;
+	unit.state->modulation = 0.5f;
+	unit.state->change = 0.0f;
+	unit.state->activity = 0.0f;
+	unit.state->age = 0;
+}
+
+
+
+WriteStatus Region::write(const vector<uint8_t> &v) {
+	return write(v.data(), v.size());
+}
+
+
+
+template <typename F>
+WriteStatus Region::ingest(uint64_t base, F fill) {
+	const auto start = steady_clock::now();
+	WriteStatus status{WriteResult::accepted, 0, 0, 0};
+
+	{
+		std::unique_lock<std::mutex> lk(ingestlock_);
+
+		const bool coalesce = ingest_ == Ingest::latest && !frames_.empty();
+		if (ingest_ == Ingest::lockstep) {
+			// Wait until the previous frame is taken for processing.
+			if (!ingestcv_.wait_for(lk,
+					std::chrono::milliseconds(kLockstepTimeout),
+					[this]() { return frames_.empty(); })) {
+				++dropped_;
+				status.result = WriteResult::dropped;
+			}
+		} else if (ingest_ == Ingest::queue && frames_.size() >= depth_) {
+			++dropped_;
+			status.result = WriteResult::dropped;
+		}
+
+		// A delta needs the frame it is relative to, the last one written.
+		const vector<uint8_t> &last = (frames_.empty()) ?
+			current_.data : frames_.back().data;
+		if (status.result == WriteResult::accepted && base != 0 &&
+				(base != inseq_ || last.size() != width_ * height_)) {
+			status.result = WriteResult::rejected;
+		}
+
+		if (status.result == WriteResult::accepted) {
+			if (coalesce) {
+				// Keep the original arrival time, it is still unprocessed.
+				fill(frames_.back(), nullptr);
+				++coalesced_;
+				status.result = WriteResult::coalesced;
+			} else {
+				frames_.emplace_back();
+				if (!spare_.empty()) {
+					frames_.back().data = std::move(spare_.back());
+					spare_.pop_back();
+				}
+				// Growing the deque leaves last where it was.
+				fill(frames_.back(), &last);
+				frames_.back().time = start;
+			}
+			frames_.back().seq = ++inseq_;
+			status.seq = inseq_;
+			++accepted_;
+		}
+
+		if (frames_.size() == 1) {
+			inputtime_ = frames_.front().time.time_since_epoch().count();
+		}
+		pending_ = frames_.size();
+		status.pending = static_cast<uint32_t>(frames_.size());
+	}
+
+	// Suggest waiting for as many passes as the writer is ahead by.
+	size_t ahead = 0;
+	if (status.result == WriteResult::coalesced ||
+			status.result == WriteResult::dropped) {
+		ahead = 1;
+	} else if (status.pending > 1) {
+		ahead = status.pending - 1;
+	}
+	status.backoff = static_cast<uint32_t>(
+		processlat_.percentile(0.5) / 1000 * ahead);
+
+	writelat_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		steady_clock::now() - start).count());
+	return status;
 }
 
 
 
-void Region::write(const vector<uint8_t> &v) {
-	assert(v.size() == width_ * height_);
+WriteStatus Region::write(const uint8_t *data, size_t size) {
+	assert(size == width_ * height_);
+
+	return ingest(0, [data, size](Frame &frame, const vector<uint8_t> *last) {
+		frame.data.assign(data, data + size);
+		frame.dirty.clear();
+	});
+}
+
+
+
+WriteStatus Region::writeDelta(uint64_t base, const uint8_t *bitmap,
+		size_t bitmapsize, const uint8_t *tiles, size_t tilessize) {
+	const TileGrid grid{width_, height_, uwidth_, uheight_};
+	if (base == 0 || !grid.valid(bitmap, bitmapsize, tilessize)) {
+		return WriteStatus{WriteResult::rejected, 0, 0, 0};
+	}
+
+	return ingest(base, [&](Frame &frame, const vector<uint8_t> *last) {
+		if (last != nullptr) {
+			frame.data.assign(last->begin(), last->end());
+			frame.dirty.assign(bitmap, bitmap + bitmapsize);
+		} else if (!frame.dirty.empty()) {
+			// Replacing a delta not yet processed, so both sets changed.
+			for (auto i = 0U; i < bitmapsize; ++i) frame.dirty[i] |= bitmap[i];
+		}
+		grid.apply(frame.data.data(), bitmap, tiles);
+	});
+}
+
+
+
+bool Region::takeFrame(Frame &frame) {
+	std::lock_guard<std::mutex> lk(ingestlock_);
+	if (frames_.empty()) return false;
+
+	// Recycle the buffer of the frame previously processed.
+	if (frame.data.capacity() > 0) spare_.push_back(std::move(frame.data));
+	frame = std::move(frames_.front());
+	frames_.pop_front();
+
+	if (!frames_.empty()) {
+		inputtime_ = frames_.front().time.time_since_epoch().count();
+	}
+	pending_ = frames_.size();
+	ingestcv_.notify_all();
+	return true;
+}
+
+
+
+void Region::applyFrame(const Frame &frame) {
+	const vector<uint8_t> &v = frame.data;
+	const bool all = frame.dirty.empty();
 
 	for (auto x = 0U; x < unitsx_; ++x) {
 		for (auto y = 0U; y < unitsy_; ++y) {
+			// Units a delta left alone have the same input as before.
+			const size_t i = y * unitsx_ + x;
+			if (!all && (frame.dirty[i / 8] & (1U << (i % 8))) == 0) continue;
+
 			float mininput = 1.1f;
 			float maxinput = 0.0f;
+			float change = 0.0f;
 			Unit &unit = units_[0][x][y];
 
 			for (auto xx = 0U; xx < uwidth_; ++xx) {
 				for (auto yy = 0U; yy < uheight_; ++yy) {
 					const auto ix = (x * uwidth_) + xx + ((y * uheight_ + yy) * width_);
 					const auto ux = xx + (yy * uwidth_);
-					unit.inputs[ux] = (float)v[ix] / 255.0f;
+					const float input = (float)v[ix] / 255.0f;
+					change += std::fabs(input - unit.inputs[ux]);
+					unit.inputs[ux] = input;
 					if (unit.inputs[ux] < mininput) mininput = unit.inputs[ux];
 					if (unit.inputs[ux] > maxinput) maxinput = unit.inputs[ux];
 				}
 			}
 
+			unit.state->change += change / static_cast<float>(unit.inputs.size());
+
 			/*float scale = 1.0f / (maxinput - mininput);
 			if (scale > kContrastMax) scale = kContrastMax;
 
@@ -112,7 +636,41 @@ void Region::write(const vector<uint8_t> &v) {
 
 
 
-void Region::process() {
+void Region::setIngest(Ingest mode, size_t depth) {
+	std::lock_guard<std::mutex> lk(ingestlock_);
+	ingest_ = mode;
+	depth_ = (depth > 0) ? depth : 1;
+	ingestcv_.notify_all();
+}
+
+
+
+IngestStats Region::ingestStats() {
+	std::lock_guard<std::mutex> lk(ingestlock_);
+	return IngestStats{ingest_, static_cast<uint32_t>(depth_),
+		static_cast<uint32_t>(frames_.size()), accepted_, coalesced_, dropped_,
+		reprocessed_};
+}
+
+
+
+size_t Region::process() {
+	const auto start = steady_clock::now();
+	size_t units = 0;
+
+	// Held for the whole pass so that checkpoints are consistent.
+	std::lock_guard<std::mutex> state(statelock_);
+
+	const bool fresh = takeFrame(current_);
+	if (fresh) {
+		applyFrame(current_);
+	} else {
+		std::lock_guard<std::mutex> lk(ingestlock_);
+		// Never process the same frame twice in lockstep.
+		if (ingest_ == Ingest::lockstep) return 0;
+		++reprocessed_;
+	}
+
 	//adjustModulation();
 
 	//#pragma omp parallel for
@@ -120,27 +678,197 @@ void Region::process() {
 		//decaySpatial(i);
 		//activate(units_[i], &inputs_[i * USIZE], USIZE);
 		//adjustSpatial(i, s);
-		processLayer(i);
+		units += processLayer(i);
+	}
+
+	Snapshot *snap = snap_.load();
+	if (snap != nullptr) {
+		const uint64_t stall = snap->passstall.exchange(0);
+		if (stall > snap->maxstall) snap->maxstall = stall;
+		++snap->pass;
+	}
+
+	// Still under the state lock, so no later pass can change the output.
+	++epoch_;
+	if (outhook_) {
+		reform(output_);
+		outhook_(epoch_, output_);
 	}
+	if (fresh) reformWaiters(current_.seq, (outhook_) ? &output_ : nullptr);
+
+	unitcount_.fetch_add(units, std::memory_order_relaxed);
+	linkcount_.fetch_add(units * outsize_ * uwidth_ * uheight_,
+		std::memory_order_relaxed);
+	processlat_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		steady_clock::now() - start).count());
+	return units;
 }
 
 
 
-void Region::processLayer(size_t layer) {
-	#pragma omp parallel for
+size_t Region::processLayer(size_t layer) {
+	const auto budget = this->budget();
+	if (budget.count() > 0) {
+		return processSalient(layer, budget);
+	}
+
+	#pragma omp parallel
+	{
+		const uint64_t cpu = dharc::fabric::threadCpu();
+		#pragma omp for
+		for (auto x = 0U; x < unitsx_; ++x) {
+			for (auto y = 0U; y < unitsy_; ++y) {
+				processUnit(units_[layer][x][y]);
+				units_[layer][x][y].state->age = 0;
+			}
+		}
+		if (omp_get_thread_num() != 0) {
+			helpercpu_ += dharc::fabric::threadCpu() - cpu;
+		}
+	}
+
+	std::lock_guard<dharc::Lock> lock(coveragelock_);
+	++coverage_.pass;
+	coverage_.processed = coverage_.units;
+	coverage_.deferred = 0;
+	coverage_.maxage = 0;
+	coverage_.cutoff = 0.0f;
+	return coverage_.units;
+}
+
+
+
+size_t Region::processSalient(size_t layer,
+		std::chrono::microseconds budget) {
+	const auto deadline = steady_clock::now() + budget;
+
+	// Rank units, most salient first. Age ensures that peripheral units
+	// that never change still get processed eventually.
+	ranked_.clear();
 	for (auto x = 0U; x < unitsx_; ++x) {
 		for (auto y = 0U; y < unitsy_; ++y) {
-			processUnit(units_[layer][x][y]);
+			Unit &unit = units_[layer][x][y];
+			UnitState &s = *unit.state;
+			++s.age;
+			ranked_.push_back({s.change + s.activity +
+				kAgeSalience * static_cast<float>(s.age), &unit});
+		}
+	}
+
+	std::sort(ranked_.begin(), ranked_.end(), [](auto &a, auto &b) {
+		return a.first > b.first;
+	});
+
+	atomic<size_t> next(0);
+	atomic<size_t> done(0);
+
+	#pragma omp parallel
+	{
+		const uint64_t cpu = dharc::fabric::threadCpu();
+		while (true) {
+			const size_t i = next++;
+			if (i >= ranked_.size()) break;
+			if (i > 0 && steady_clock::now() >= deadline) break;
+
+			processUnit(*ranked_[i].second);
+			ranked_[i].second->state->age = 0;
+			++done;
 		}
+		if (omp_get_thread_num() != 0) {
+			helpercpu_ += dharc::fabric::threadCpu() - cpu;
+		}
+	}
+
+	uint32_t maxage = 0;
+	float cutoff = 0.0f;
+	for (auto &r : ranked_) {
+		const uint32_t age = r.second->state->age;
+		if (age > maxage) maxage = age;
+		if (age == 0) cutoff = r.first;
 	}
+
+	std::lock_guard<dharc::Lock> lock(coveragelock_);
+	++coverage_.pass;
+	coverage_.processed = static_cast<uint32_t>(done);
+	coverage_.deferred = coverage_.units - coverage_.processed;
+	coverage_.maxage = maxage;
+	coverage_.cutoff = cutoff;
+	return coverage_.processed;
+}
+
+
+
+Coverage Region::coverage() {
+	std::lock_guard<dharc::Lock> lock(coveragelock_);
+	return coverage_;
+}
+
+
+
+Metrics Region::metrics() {
+	const auto now = steady_clock::now();
+	const uint64_t units = unitcount_.load(std::memory_order_relaxed);
+	const uint64_t links = linkcount_.load(std::memory_order_relaxed);
+	const uint64_t learns = learncount_.load(std::memory_order_relaxed);
+
+	std::lock_guard<dharc::Lock> lock(samplelock_);
+	const float secs = std::chrono::duration<float>(now - sample_.time).count();
+
+	// Average rates over at least a second so frequent queries stay smooth.
+	if (secs >= 1.0f) {
+		sample_.unitsps = static_cast<float>(units - sample_.units) / secs;
+		sample_.linksps = static_cast<float>(links - sample_.links) / secs;
+		sample_.learnsps = static_cast<float>(learns - sample_.learns) / secs;
+		sample_.time = now;
+		sample_.units = units;
+		sample_.links = links;
+		sample_.learns = learns;
+	}
+
+	Metrics res;
+	res.units = units;
+	res.links = links;
+	res.learns = learns;
+	res.unitsps = sample_.unitsps;
+	res.linksps = sample_.linksps;
+	res.learnsps = sample_.learnsps;
+	res.writep50 = static_cast<float>(writelat_.percentile(0.5)) / 1000.0f;
+	res.writep99 = static_cast<float>(writelat_.percentile(0.99)) / 1000.0f;
+	res.writemax = static_cast<float>(writelat_.max()) / 1000.0f;
+	res.processp50 = static_cast<float>(processlat_.percentile(0.5)) / 1000.0f;
+	res.processp99 = static_cast<float>(processlat_.percentile(0.99)) / 1000.0f;
+	res.processmax = static_cast<float>(processlat_.max()) / 1000.0f;
+	res.reformp50 = static_cast<float>(reformlat_.percentile(0.5)) / 1000.0f;
+	res.reformp99 = static_cast<float>(reformlat_.percentile(0.99)) / 1000.0f;
+	res.reformmax = static_cast<float>(reformlat_.max()) / 1000.0f;
+	return res;
+}
+
+
+
+vector<uint64_t> Region::latency(Latency op) const {
+	switch (op) {
+	case Latency::write:   return writelat_.buckets();
+	case Latency::process: return processlat_.buckets();
+	case Latency::reform:  return reformlat_.buckets();
+	}
+	return vector<uint64_t>();
 }
 
 
 
 void Region::reform(vector<uint8_t> &v) {
 	v.resize(width_ * height_);
+	reform(v.data(), v.size());
+}
+
+
+
+void Region::reform(uint8_t *out, size_t size) {
+	assert(size == width_ * height_);
+	const auto start = steady_clock::now();
 
-	for (auto i = 0U; i < v.size(); ++i) {
+	for (auto i = 0U; i < size; ++i) {
 		const auto y = i / width_;
 		const auto x = i % width_;
 		const auto uy = y / uheight_;
@@ -162,8 +890,79 @@ void Region::reform(vector<uint8_t> &v) {
 		//tmp = unit.outputs[uix];
 		tmp /= count;
 		if (tmp > 1.0f) tmp = 1.0f;
-		v[i] = tmp * 255.0f;
+		out[i] = tmp * 255.0f;
 	}
+
+	reformlat_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		steady_clock::now() - start).count());
+}
+
+
+
+bool Region::reformAfter(uint64_t seq, uint8_t *out, size_t size,
+		std::chrono::microseconds timeout) {
+	Waiter w{seq, out, size, false, false};
+	{
+		std::unique_lock<std::mutex> lk(ingestlock_);
+		if (doneseq_ < seq) {
+			waiters_.push_back(&w);
+			donecv_.wait_for(lk, timeout, [&w]() { return w.claimed; });
+			if (!w.claimed) {
+				waiters_.erase(std::find(waiters_.begin(), waiters_.end(), &w));
+				return false;
+			}
+			// The pass is reforming into out, which must outlive it.
+			donecv_.wait(lk, [&w]() { return w.done; });
+			return true;
+		}
+	}
+
+	reform(out, size);
+	return true;
+}
+
+
+
+void Region::setOutputHook(OutputHook hook) {
+	std::lock_guard<std::mutex> state(statelock_);
+	outhook_ = std::move(hook);
+	if (!outhook_) vector<uint8_t>().swap(output_);
+}
+
+
+
+void Region::reformWaiters(uint64_t seq, const vector<uint8_t> *output) {
+	vector<Waiter*> ready;
+	{
+		std::lock_guard<std::mutex> lk(ingestlock_);
+		doneseq_ = seq;
+		for (auto w : waiters_) {
+			if (!w->claimed && w->seq <= seq) {
+				w->claimed = true;
+				ready.push_back(w);
+			}
+		}
+		if (ready.empty()) return;
+	}
+	donecv_.notify_all();
+
+	// Copy the output if it has already been reformed this pass.
+	for (auto w : ready) {
+		if (output != nullptr && output->size() == w->size) {
+			std::memcpy(w->out, output->data(), w->size);
+		} else {
+			reform(w->out, w->size);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(ingestlock_);
+		for (auto w : ready) {
+			w->done = true;
+			waiters_.erase(std::find(waiters_.begin(), waiters_.end(), w));
+		}
+	}
+	donecv_.notify_all();
 }
 
 
@@ -175,6 +974,9 @@ void Region::processUnit(Unit &unit) {
 		Link *link;
 	};
 
+	// Links are about to change, keep a copy for any snapshot in progress.
+	preserve(unit);
+
 	vector<pair<size_t, float>> total_depol(outsize_, {0, 0.0f});
 	vector<vector<LinkState>> linkstates(outsize_);
 
@@ -184,6 +986,8 @@ void Region::processUnit(Unit &unit) {
 	}
 
 	float insize = uwidth_ * uheight_;
+	float activity = 0.0f;
+	uint64_t learns = 0;
 	// Percentage of max possible
 	float linklimit = 0.2f * (float)insize;
 
@@ -255,16 +1059,24 @@ void Region::processUnit(Unit &unit) {
 					depolsum += l.depol;
 				}
 
+				learns += linkstates[d.first].size();
+
 				// Resort after changes.
 				//std::sort(i + 1, total_depol.end(), [](auto a, auto b) {
 				//	return a.second > b.second;
 				//});
 			}
 
+			activity += std::fabs(newoutput - unit.outputs[d.first]);
 			unit.outputs[d.first] = newoutput;
 		} else {
+			activity += unit.outputs[d.first];
 			unit.outputs[d.first] = 0.0f;
 		}
 	}
+
+	unit.state->change = 0.0f;
+	unit.state->activity = activity / static_cast<float>(outsize_);
+	learncount_.fetch_add(learns, std::memory_order_relaxed);
 }
 
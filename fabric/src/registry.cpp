@@ -0,0 +1,125 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#include "dharc/registry.hpp"
+
+#include <thread>
+#include <mutex>
+
+using dharc::fabric::Registry;
+using dharc::fabric::Region;
+
+
+
+Registry::Guard::Guard(Registry &reg) : reg_(reg) {
+	slot_ = reg_.epoch_.load() & 1;
+	reg_.readers_[slot_].fetch_add(1);
+	table_ = reg_.table_.load();
+}
+
+
+
+Registry::Guard::~Guard() {
+	reg_.readers_[slot_].fetch_sub(1);
+}
+
+
+
+Registry::Registry() : table_(new Table()), epoch_(0) {
+	readers_[0] = 0;
+	readers_[1] = 0;
+}
+
+
+
+Registry::~Registry() {
+	delete table_.load();
+}
+
+
+
+RegionID Registry::insert(Region *region) {
+	std::lock_guard<std::mutex> lk(writelock_);
+	Table *table = new Table(*table_.load());
+
+	size_t ix = 0;
+	while (ix < table->regions.size() && table->regions[ix] != nullptr) ++ix;
+
+	if (ix >= kMaxRegions) {
+		delete table;
+		return RegionID::INVALID;
+	}
+
+	if (ix == table->regions.size()) table->regions.push_back(nullptr);
+	table->regions[ix].reset(region);
+
+	publish(table, nullptr);
+	return static_cast<RegionID>(ix);
+}
+
+
+
+bool Registry::replace(RegionID regid, Region *region) {
+	const auto ix = static_cast<size_t>(regid);
+	if (ix >= kMaxRegions) return false;
+
+	std::lock_guard<std::mutex> lk(writelock_);
+	const Table *current = table_.load();
+	if (ix >= current->regions.size() || current->regions[ix] == nullptr) {
+		return false;
+	}
+
+	Table *table = new Table(*current);
+	std::shared_ptr<Region> old = std::move(table->regions[ix]);
+	table->regions[ix].reset(region);
+
+	publish(table, std::move(old));
+	return true;
+}
+
+
+
+bool Registry::erase(RegionID regid) {
+	const auto ix = static_cast<size_t>(regid);
+
+	std::lock_guard<std::mutex> lk(writelock_);
+	const Table *current = table_.load();
+	if (ix >= current->regions.size() || current->regions[ix] == nullptr) {
+		return false;
+	}
+
+	Table *table = new Table(*current);
+	std::shared_ptr<Region> old = std::move(table->regions[ix]);
+
+	// Trim so ids at the end can be reused.
+	while (!table->regions.empty() && table->regions.back() == nullptr) {
+		table->regions.pop_back();
+	}
+
+	publish(table, std::move(old));
+	return true;
+}
+
+
+
+void Registry::publish(Table *table, std::shared_ptr<Region> retired) {
+	Table *old = table_.exchange(table);
+	synchronize();
+	delete old;
+
+	// Deleted here unless pinned, in which case by whoever drops the last pin.
+	retired.reset();
+}
+
+
+
+void Registry::synchronize() {
+	// Flip twice so that readers counted under either parity before the new
+	// table was published have released their guards. New readers always
+	// join the other parity so neither wait can be starved.
+	for (auto i = 0; i < 2; ++i) {
+		const size_t slot = epoch_.fetch_add(1) & 1;
+		while (readers_[slot].load() != 0) std::this_thread::yield();
+	}
+}
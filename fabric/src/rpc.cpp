@@ -4,19 +4,30 @@
 
 #include "dharc/rpc.hpp"
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <list>
 #include <utility>
 #include <tuple>
+#include <memory>
 
 #include "dharc/rpc_commands.hpp"
 #include "dharc/fabric.hpp"
+#include "dharc/histogram.hpp"
 #include "dharc/rpc_packer.hpp"
 #include "dharc/rpc_server.hpp"
 
+using dharc::rpc::Codec;
+using dharc::rpc::Compression;
+using dharc::rpc::Compressor;
 using dharc::rpc::Packer;
+using dharc::rpc::Reader;
+using dharc::rpc::View;
+using dharc::rpc::Writer;
 using std::cout;
 using std::istream;
 using std::ostream;
@@ -26,8 +37,45 @@ using std::list;
 using std::pair;
 using dharc::Fabric;
 using dharc::rpc::Command;
+using dharc::rpc::CommandStats;
+using dharc::rpc::Lane;
+using dharc::rpc::LaneStats;
+using std::chrono::steady_clock;
 
 namespace {
+constexpr int kCommands = static_cast<int>(Command::end);
+
+/* Fabric the current thread is handling a message for, see process_msg */
+thread_local Fabric *current = nullptr;
+
+/* Client the current thread is handling a message from */
+thread_local dharc::rpc::Session *session = nullptr;
+
+/* Where checkpoints named over RPC are, see rpc::setCheckpointDir */
+std::string checkpointdir = ".";
+
+/* Path of a checkpoint named by a client, or false unless the name is a
+ * bare file name that cannot lead out of the checkpoint directory. */
+bool checkpointPath(const std::string &name, std::string &path) {
+	if (name.empty() || name[0] == '.' || name.find('/') != string::npos ||
+			name.find('\0') != string::npos) {
+		return false;
+	}
+	path = checkpointdir + "/" + name;
+	return true;
+}
+
+/* What process_msg has handled of each command, see rpc_rpcstats */
+struct Instrument {
+	std::atomic<uint64_t> calls{0};
+	std::atomic<uint64_t> rejected{0};
+	std::atomic<uint64_t> bytesin{0};
+	std::atomic<uint64_t> bytesout{0};
+	dharc::Histogram latency;
+};
+
+/* The last is for messages rejected before a command could be read. */
+Instrument instruments[kCommands + 1];
 
 /* rpc::Command::nop */
 bool rpc_nop() {
@@ -39,13 +87,219 @@ int rpc_version() {
 	return static_cast<int>(Command::end);
 }
 
-bool rpc_write2d(const size_t &regid, const vector<uint8_t> &values, const size_t &uw, const size_t &uh) {
-	Fabric::write2D(static_cast<dharc::RegionID>(regid), values);
-	return true;
+dharc::WriteStatus rpc_write2d(const size_t &regid, const View<uint8_t> &values, const size_t &uw, const size_t &uh) {
+	return current->write2D(static_cast<dharc::RegionID>(regid), values.data,
+		values.size());
 }
 
 vector<uint8_t> rpc_reform2d(const size_t &regid, const size_t &uw, const size_t &uh) {
-	return Fabric::reform2D(static_cast<dharc::RegionID>(regid), uw, uh);
+	return current->reform2D(static_cast<dharc::RegionID>(regid), uw, uh);
+}
+
+/* rpc::Command::budget2d */
+bool rpc_budget2d(const size_t &regid, const size_t &us) {
+	return current->setBudget(static_cast<dharc::RegionID>(regid),
+		std::chrono::microseconds(us));
+}
+
+/* rpc::Command::coverage2d */
+dharc::Coverage rpc_coverage2d(const size_t &regid) {
+	return current->coverage(static_cast<dharc::RegionID>(regid));
+}
+
+/* rpc::Command::framecpu */
+float rpc_framecpu() {
+	return current->cpuPerFrame();
+}
+
+/* rpc::Command::schedule2d */
+bool rpc_schedule2d(const size_t &regid, const size_t &us, const int &prio) {
+	return current->setSchedule(static_cast<dharc::RegionID>(regid),
+		std::chrono::microseconds(us), prio);
+}
+
+/* rpc::Command::ticks2d */
+dharc::TickStats rpc_ticks2d(const size_t &regid) {
+	return current->tickStats(static_cast<dharc::RegionID>(regid));
+}
+
+/* rpc::Command::lateness2d */
+vector<uint64_t> rpc_lateness2d(const size_t &regid) {
+	return current->lateness(static_cast<dharc::RegionID>(regid));
+}
+
+/* rpc::Command::create2d */
+size_t rpc_create2d(const size_t &width, const size_t &height,
+		const size_t &unitsx, const size_t &unitsy) {
+	return static_cast<size_t>(
+		current->create2D(width, height, unitsx, unitsy));
+}
+
+/* rpc::Command::resize2d */
+bool rpc_resize2d(const size_t &regid, const size_t &width,
+		const size_t &height, const size_t &unitsx, const size_t &unitsy) {
+	return current->resize2D(static_cast<dharc::RegionID>(regid),
+		width, height, unitsx, unitsy);
+}
+
+/* rpc::Command::destroy2d */
+bool rpc_destroy2d(const size_t &regid) {
+	return current->destroy(static_cast<dharc::RegionID>(regid));
+}
+
+/* rpc::Command::procps */
+float rpc_procps() {
+	return current->processedPerSecond();
+}
+
+/* rpc::Command::metrics2d */
+dharc::Metrics rpc_metrics2d(const size_t &regid) {
+	return current->metrics(static_cast<dharc::RegionID>(regid));
+}
+
+/* rpc::Command::latency2d */
+vector<uint64_t> rpc_latency2d(const size_t &regid, const int &op) {
+	if (op < 0 || op > static_cast<int>(dharc::Latency::reform)) {
+		return vector<uint64_t>();
+	}
+	return current->latency(static_cast<dharc::RegionID>(regid),
+		static_cast<dharc::Latency>(op));
+}
+
+/* rpc::Command::ingest2d */
+bool rpc_ingest2d(const size_t &regid, const int &mode, const size_t &depth) {
+	if (mode < 0 || mode > static_cast<int>(dharc::Ingest::lockstep)) {
+		return false;
+	}
+	return current->setIngest(static_cast<dharc::RegionID>(regid),
+		static_cast<dharc::Ingest>(mode), depth);
+}
+
+/* rpc::Command::ingeststats2d */
+dharc::IngestStats rpc_ingeststats2d(const size_t &regid) {
+	return current->ingestStats(static_cast<dharc::RegionID>(regid));
+}
+
+/* rpc::Command::save2d */
+bool rpc_save2d(const size_t &regid, const std::string &name) {
+	std::string path;
+	if (!checkpointPath(name, path)) return false;
+	return current->save(static_cast<dharc::RegionID>(regid), path);
+}
+
+/* rpc::Command::load2d */
+size_t rpc_load2d(const size_t &regid, const std::string &name) {
+	std::string path;
+	if (!checkpointPath(name, path)) {
+		return static_cast<size_t>(dharc::RegionID::INVALID);
+	}
+	return static_cast<size_t>(
+		current->restore(static_cast<dharc::RegionID>(regid), path));
+}
+
+/* rpc::Command::snapshot2d */
+bool rpc_snapshot2d(const size_t &regid, const std::string &name,
+		const size_t &rate) {
+	std::string path;
+	if (!checkpointPath(name, path)) return false;
+	return current->snapshot(static_cast<dharc::RegionID>(regid), path, rate);
+}
+
+/* rpc::Command::snapstats2d */
+dharc::SnapshotStats rpc_snapstats2d(const size_t &regid) {
+	return current->snapshotStats(static_cast<dharc::RegionID>(regid));
+}
+
+/* rpc::Command::shmattach2d */
+bool rpc_shmattach2d(const size_t &regid, const std::string &name) {
+	return current->attachShm(static_cast<dharc::RegionID>(regid), name);
+}
+
+/* rpc::Command::shmwrite2d */
+dharc::WriteStatus rpc_shmwrite2d(const size_t &regid, const size_t &seq) {
+	return current->writeShm(static_cast<dharc::RegionID>(regid), seq);
+}
+
+/* rpc::Command::shmdetach2d */
+bool rpc_shmdetach2d(const size_t &regid) {
+	return current->detachShm(static_cast<dharc::RegionID>(regid));
+}
+
+/* rpc::Command::step2d */
+vector<uint8_t> rpc_step2d(const size_t &regid, const View<uint8_t> &values,
+		const size_t &uw, const size_t &uh, const size_t &wait) {
+	return current->step2D(static_cast<dharc::RegionID>(regid), values.data,
+		values.size(), uw, uh, std::chrono::microseconds(wait));
+}
+
+/* rpc::Command::batch, only reached if nested since process_msg runs each
+ * command of a batch itself. */
+bool rpc_batch() {
+	return false;
+}
+
+/* rpc::Command::compression, settling how replies to this client are
+ * compressed. */
+uint32_t rpc_compression(const uint32_t &codecs, const int &codec,
+		const int &level, const size_t &threshold) {
+	if (codec < 0 || codec >= static_cast<int>(Codec::end)) {
+		session->replies = Compression::none();
+	} else {
+		session->replies = dharc::rpc::negotiate(Compression{
+			static_cast<Codec>(codec), level, threshold}, codecs);
+	}
+	return dharc::rpc::codecs();
+}
+
+/* rpc::Command::compressstats */
+dharc::rpc::CompressStats rpc_compressstats() {
+	return Compressor::stats();
+}
+
+/* rpc::Command::delta2d */
+dharc::WriteStatus rpc_delta2d(const size_t &regid, const size_t &base,
+		const View<uint8_t> &bitmap, const View<uint8_t> &tiles,
+		const size_t &uw, const size_t &uh) {
+	return current->writeDelta2D(static_cast<dharc::RegionID>(regid), base,
+		bitmap.data, bitmap.size(), tiles.data, tiles.size(), uw, uh);
+}
+
+/* rpc::Command::rpcstats, an entry for each command and then one for
+ * messages too short or with an unknown command. */
+vector<CommandStats> rpc_rpcstats() {
+	vector<CommandStats> res(kCommands + 1);
+	for (auto i = 0; i <= kCommands; ++i) {
+		const Instrument &in = instruments[i];
+		res[i] = CommandStats{in.calls.load(), in.rejected.load(),
+			in.bytesin.load(), in.bytesout.load(), in.latency.percentile(0.5),
+			in.latency.percentile(0.99), in.latency.max()};
+	}
+	return res;
+}
+
+/* rpc::Command::lanestats, an entry for each rpc::Lane */
+vector<LaneStats> rpc_lanestats() {
+	vector<LaneStats> res;
+	for (auto i = 0; i < static_cast<int>(Lane::end); ++i) {
+		const auto &c = dharc::rpc::laneCounters(static_cast<Lane>(i));
+		res.push_back(LaneStats{c.requests.load(), c.deferred.load(),
+			c.rejected.load(), c.queueing.percentile(0.5),
+			c.queueing.percentile(0.99), c.queueing.max()});
+	}
+	return res;
+}
+
+/* rpc::Command::pyramid2d */
+vector<vector<uint8_t>> rpc_pyramid2d(const size_t &regid,
+		const size_t &levels) {
+	return current->pyramid2D(static_cast<dharc::RegionID>(regid), levels);
+}
+
+/* rpc::Command::shmstep2d */
+vector<uint8_t> rpc_shmstep2d(const size_t &regid, const size_t &seq,
+		const size_t &uw, const size_t &uh, const size_t &wait) {
+	return current->stepShm(static_cast<dharc::RegionID>(regid), seq, uw, uh,
+		std::chrono::microseconds(wait));
 }
 
 /* Register the handler for each rpc command */
@@ -53,7 +307,37 @@ dharc::rpc::commands_t commands {
 	rpc_nop,
 	rpc_version,
 	rpc_write2d,
-	rpc_reform2d
+	rpc_reform2d,
+	rpc_budget2d,
+	rpc_coverage2d,
+	rpc_framecpu,
+	rpc_schedule2d,
+	rpc_ticks2d,
+	rpc_lateness2d,
+	rpc_create2d,
+	rpc_resize2d,
+	rpc_destroy2d,
+	rpc_procps,
+	rpc_metrics2d,
+	rpc_latency2d,
+	rpc_ingest2d,
+	rpc_ingeststats2d,
+	rpc_save2d,
+	rpc_load2d,
+	rpc_snapshot2d,
+	rpc_snapstats2d,
+	rpc_shmattach2d,
+	rpc_shmwrite2d,
+	rpc_shmdetach2d,
+	rpc_step2d,
+	rpc_batch,
+	rpc_compression,
+	rpc_compressstats,
+	rpc_delta2d,
+	rpc_rpcstats,
+	rpc_lanestats,
+	rpc_pyramid2d,
+	rpc_shmstep2d
 };
 };  // namespace
 
@@ -61,10 +345,8 @@ dharc::rpc::commands_t commands {
 
 namespace {
 template<typename Ret>
-Ret unpack(std::istream &is) {
-	Ret res = Packer<Ret>::unpack(is);
-	//if (is.peek() == ',') is.ignore();
-	return res;
+Ret unpack(Reader &r) {
+	return Packer<Ret>::unpack(r);
 }
 
 
@@ -82,50 +364,170 @@ Ret callFunc(seq<S...>, T &params, F f) {
 
 
 
-template <typename Ret, typename... Args>
-void execute(std::istream &is, std::ostream &os, Ret(*f)(Args ...args)) {
-	std::tuple<typename std::decay<Args>::type...> params {
-		unpack<typename std::decay<Args>::type>(is)... };
-	 Packer<Ret>::pack(os,
-		callFunc<Ret>(typename gens<sizeof...(Args)>::type(), params, f));
+/*
+ * Result of a command, packed into the reply once every command in the
+ * message has run.
+ */
+struct Result {
+	virtual ~Result() {}
+	virtual size_t size() const = 0;
+	virtual void pack(Writer &w) const = 0;
+};
+
+template <typename Ret>
+struct ResultOf : Result {
+	explicit ResultOf(Ret &&v) : value(std::move(v)) {}
+	size_t size() const override { return Packer<Ret>::size(value); }
+	void pack(Writer &w) const override { Packer<Ret>::pack(w, value); }
+	Ret value;
+};
+
+typedef vector<std::unique_ptr<Result>> Results;
+
+
+
+/*
+ * Results of a message and the compressed copies of any of their arrays.
+ */
+struct Reply {
+	explicit Reply(const Compression &c) : comp(c) {}
+	Results results;
+	Compressor comp;
+};
+
+/*
+ * Parts of a reply refer into its results without copying them, so the
+ * results are kept alive until the last part has been sent.
+ */
+void releasePart(void *data, void *hint) {
+	delete static_cast<std::shared_ptr<const void>*>(hint);
 }
 
 
 
 /*
- * Template nested if to find correct function to call for the received
- * RPC command.
+ * Unpack the arguments of a command and run it, unless they were short.
  */
-template<int S>
-void callCmd(istream &is, ostream &os, int cmd) {
-	if (cmd == S) {
-		execute(is, os, std::get<S>(commands));
-	} else {
-		callCmd<S + 1>(is, os, cmd);
-	}
+template <typename Ret, typename... Args>
+bool execute(Reader &r, Results &res, Ret(*f)(Args ...args)) {
+	std::tuple<typename std::decay<Args>::type...> params {
+		unpack<typename std::decay<Args>::type>(r)... };
+	if (!r.ok()) return false;
+	res.emplace_back(new ResultOf<Ret>(
+		callFunc<Ret>(typename gens<sizeof...(Args)>::type(), params, f)));
+	return true;
 }
 
 
 
-/* Base case, do nothing */
-template<>
-inline void callCmd<static_cast<int>(Command::end)>(
-	istream &is,
-	ostream &os,
-	int cmd) {}
+typedef bool (*Dispatch)(Reader &r, Results &res);
+
+template<int S>
+bool dispatch(Reader &r, Results &res) {
+	return execute(r, res, std::get<S>(commands));
+}
+
+template<int... S>
+constexpr std::array<Dispatch, sizeof...(S)> makeTable(seq<S...>) {
+	return {{ &dispatch<S>... }};
+}
 
+/* Handler of each command, indexed by it. */
+constexpr auto kDispatch = makeTable(gens<kCommands>::type());
 };  // namespace
 
 /* ========================================================================== */
 
 
 
-void dharc::rpc::process_msg(istream &is, ostream &os) {
-	int cmd = 0;
-	is.read((char*)&cmd, sizeof(int));
-	//if (parse("{\"c\": ", value<int>{cmd}, ", \"args\": [", noact)) {
-		if (cmd >= static_cast<int>(Command::end) || cmd < 0) cmd = 0;
-		callCmd<0>(is, os, cmd);
-	//}
+void dharc::rpc::setCheckpointDir(const std::string &dir) {
+	checkpointdir = dir;
 }
 
+
+
+void dharc::rpc::process_msg(Fabric &f, Session &s,
+		vector<zmq::message_t> &req, vector<zmq::message_t> &rep) {
+	current = &f;
+	session = &s;
+	rep.clear();
+	if (req.empty()) req.emplace_back();
+
+	vector<View<uint8_t>> parts;
+	for (auto i = 1U; i < req.size(); ++i) {
+		parts.emplace_back(static_cast<const uint8_t*>(req[i].data()),
+			req[i].size());
+	}
+	Reader r(req[0].data(), req[0].size(), parts.data(), parts.size());
+
+	auto reply = std::make_shared<Reply>(s.replies);
+	Results &results = reply->results;
+	vector<int> cmds;  // Of each result.
+
+	// Run a command, false if it is unknown or its arguments short, after
+	// which nothing more of the message can be trusted.
+	auto run = [&](int cmd) {
+		if (!r.ok() || cmd < 0 || cmd >= kCommands) {
+			++instruments[kCommands].rejected;
+			return false;
+		}
+		Instrument &in = instruments[cmd];
+		const size_t before = r.consumed();
+		const auto start = steady_clock::now();
+		if (!kDispatch[cmd](r, results)) {
+			++in.rejected;
+			return false;
+		}
+		in.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			steady_clock::now() - start).count());
+		++in.calls;
+		in.bytesin += sizeof(int) + r.consumed() - before;
+		cmds.push_back(cmd);
+		return true;
+	};
+
+	int cmd = -1;
+	r.read(&cmd, sizeof(int));
+
+	if (r.ok() && cmd == static_cast<int>(Command::batch)) {
+		// Run each command in turn, stopping at any that is not valid.
+		// One too long is turned away before anything runs, and a nested
+		// one ends the batch, both counted against the batch command.
+		Instrument &batch = instruments[static_cast<int>(Command::batch)];
+		uint32_t count = 0;
+		r.read(&count, sizeof(count));
+		if (count > kMaxBatch) {
+			++batch.rejected;
+			count = 0;
+		}
+		for (auto i = 0U; i < count; ++i) {
+			cmd = -1;
+			r.read(&cmd, sizeof(int));
+			if (cmd == static_cast<int>(Command::batch)) {
+				++batch.rejected;
+				break;
+			}
+			if (!run(cmd)) break;
+		}
+	} else {
+		run(cmd);
+	}
+
+	// Results follow each other in the reply, in the order of the commands.
+	size_t size = 0;
+	for (auto &res : results) size += res->size();
+
+	vector<View<uint8_t>> repparts;
+	rep.emplace_back(size);
+	Writer w(rep.back().data(), &repparts, &reply->comp);
+	for (auto i = 0U; i < results.size(); ++i) {
+		const size_t before = w.written();
+		results[i]->pack(w);
+		instruments[cmds[i]].bytesout += w.written() - before;
+	}
+
+	for (auto &p : repparts) {
+		rep.emplace_back(const_cast<uint8_t*>(p.data), p.count, releasePart,
+			new std::shared_ptr<const void>(reply));
+	}
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#include "dharc/rpc_publisher.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+#include "dharc/fabric.hpp"
+#include "dharc/rpc_outputs.hpp"
+
+using dharc::rpc::Publisher;
+using dharc::rpc::DeltaHeader;
+using dharc::rpc::Stream;
+using dharc::RegionID;
+using dharc::TileGrid;
+using std::vector;
+
+constexpr int Publisher::kHighWater;
+constexpr size_t Publisher::kKeyframe;
+
+namespace {
+/* Longest the publisher waits before checking whether to stop, milliseconds */
+constexpr long kPollInterval = 100;
+
+/* Outputs are sent without copying and freed once the socket is done. */
+void releaseOutput(void *data, void *hint) {
+	delete static_cast<vector<uint8_t>*>(hint);
+}
+};  // namespace
+
+
+
+Publisher::Publisher(Fabric &fabric, zmq::context_t &context)
+	: fabric_(fabric), sock_(context, ZMQ_XPUB),
+		wakefd_(eventfd(0, EFD_NONBLOCK)), threshold_(0) {
+	int linger = 0;
+	sock_.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+	int hwm = kHighWater;
+	sock_.setsockopt(ZMQ_SNDHWM, &hwm, sizeof(hwm));
+	// Pass on repeated subscriptions too, as those ask for a resync.
+	int verbose = 1;
+	sock_.setsockopt(ZMQ_XPUB_VERBOSE, &verbose, sizeof(verbose));
+
+	fabric_.setOutputSink([this](RegionID regid, uint64_t epoch,
+			const TileGrid &grid, const vector<uint8_t> &out) {
+		publish(regid, epoch, grid, out);
+	});
+}
+
+
+
+Publisher::~Publisher() {
+	// No pass calls publish once this returns.
+	fabric_.setOutputSink(nullptr);
+	for (auto &sub : subscribed_) fabric_.publish2D(sub.first, false);
+
+	for (auto &o : outputs_) delete o.second.data;
+	close(wakefd_);
+}
+
+
+
+void Publisher::bind(const std::string &endpoint) {
+	sock_.bind(endpoint);
+}
+
+
+
+void Publisher::run(const volatile std::sig_atomic_t &stop) {
+	zmq::pollitem_t items[] = {
+		{ sock_, 0, ZMQ_POLLIN, 0 },
+		{ nullptr, wakefd_, ZMQ_POLLIN, 0 }
+	};
+
+	while (!stop) {
+		try {
+			zmq::poll(&items[0], 2, kPollInterval);
+		} catch (const zmq::error_t &ex) {
+			continue;
+		}
+
+		if (items[1].revents & ZMQ_POLLIN) {
+			uint64_t count;
+			if (read(wakefd_, &count, sizeof(count)) < 0) {}
+		}
+		if (items[0].revents & ZMQ_POLLIN) subscriptions();
+		send();
+	}
+}
+
+
+
+void Publisher::publish(RegionID regid, uint64_t epoch, const TileGrid &grid,
+		const vector<uint8_t> &out) {
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		// Only the latest output of a region is worth sending, so this
+		// replaces any not yet sent.
+		Output &o = outputs_[regid];
+		if (o.data == nullptr) o.data = new vector<uint8_t>();
+		o.data->assign(out.begin(), out.end());
+		o.epoch = epoch;
+		o.grid = grid;
+	}
+
+	const uint64_t one = 1;
+	if (write(wakefd_, &one, sizeof(one)) < 0) {}
+}
+
+
+
+void Publisher::subscriptions() {
+	zmq::message_t msg;
+
+	while (true) {
+		try {
+			if (!sock_.recv(&msg, ZMQ_DONTWAIT)) return;
+		} catch (const zmq::error_t &err) {
+			return;
+		}
+
+		// A byte, 1 to subscribe or 0 to unsubscribe, then the topic. Every
+		// subscription gets this far but only the last unsubscription.
+		if (msg.size() != 1 + kTopicBytes) continue;
+		const uint8_t *p = static_cast<const uint8_t*>(msg.data());
+		const bool on = p[0] == 1;
+		Stream stream;
+		RegionID regid;
+		parseTopic(p + 1, stream, regid);
+
+		const bool was = subscribed_.count(regid) > 0;
+		Subscribed &sub = subscribed_[regid];
+		if (!was) sub = Subscribed{false, false};
+
+		switch (stream) {
+		case Stream::outputs:
+			sub.outputs = on;
+			break;
+		case Stream::deltas:
+			// New subscribers need a whole output first, and those asking
+			// again have missed part of the chain.
+			sub.deltas = on;
+			refs_.erase(regid);
+			break;
+		default:
+			break;
+		}
+
+		const bool now = sub.outputs || sub.deltas;
+		if (!now) subscribed_.erase(regid);
+		if (now != was) fabric_.publish2D(regid, now);
+	}
+}
+
+
+
+void Publisher::send() {
+	vector<std::pair<RegionID, Output>> ready;
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		for (auto &o : outputs_) {
+			if (o.second.data == nullptr) continue;
+			ready.push_back(o);
+			o.second.data = nullptr;
+		}
+	}
+
+	for (auto &r : ready) {
+		auto it = subscribed_.find(r.first);
+		if (it != subscribed_.end() && it->second.deltas) {
+			sendDelta(r.first, r.second);
+		}
+		if (it != subscribed_.end() && it->second.outputs) {
+			sendOutput(r.first, r.second);
+		} else {
+			delete r.second.data;
+		}
+	}
+}
+
+
+
+void Publisher::sendOutput(RegionID regid, const Output &o) {
+	zmq::message_t topic(kTopicBytes);
+	makeTopic(static_cast<uint8_t*>(topic.data()), Stream::outputs, regid);
+	zmq::message_t epoch(sizeof(o.epoch));
+	std::memcpy(epoch.data(), &o.epoch, sizeof(o.epoch));
+	zmq::message_t body(o.data->data(), o.data->size(), releaseOutput, o.data);
+
+	// Subscribers at their high water mark silently miss this one.
+	try {
+		sock_.send(topic, ZMQ_SNDMORE);
+		sock_.send(epoch, ZMQ_SNDMORE);
+		sock_.send(body);
+	} catch (const zmq::error_t &err) {
+		std::cout << "ZMQ publish error: " << err.what() << "\n";
+	}
+}
+
+
+
+void Publisher::sendDelta(RegionID regid, const Output &o) {
+	const TileGrid &grid = o.grid;
+	const vector<uint8_t> &image = *o.data;
+	if (grid.count() == 0 || image.size() != grid.width * grid.height) return;
+
+	Reference &ref = refs_[regid];
+	const bool whole = ref.epoch == 0 || ref.grid != grid ||
+		ref.count >= kKeyframe;
+
+	DeltaHeader header{o.epoch, 0, static_cast<uint32_t>(grid.width),
+		static_cast<uint32_t>(grid.height), static_cast<uint32_t>(grid.tilew),
+		static_cast<uint32_t>(grid.tileh)};
+
+	if (whole) {
+		grid.all(image.data(), bitmap_, tiles_);
+		ref.image = image;
+		ref.grid = grid;
+		ref.count = 0;
+	} else {
+		// Nothing worth sending, so the next delta is relative to the same.
+		if (grid.diff(ref.image.data(), image.data(), threshold_, bitmap_,
+				tiles_) == 0) {
+			return;
+		}
+		// Keep the reference as subscribers have it, not as the output is, so
+		// small changes add up until they pass the threshold.
+		grid.apply(ref.image.data(), bitmap_.data(), tiles_.data());
+		header.base = ref.epoch;
+		++ref.count;
+	}
+	ref.epoch = o.epoch;
+
+	zmq::message_t topic(kTopicBytes);
+	makeTopic(static_cast<uint8_t*>(topic.data()), Stream::deltas, regid);
+	zmq::message_t head(sizeof(header));
+	std::memcpy(head.data(), &header, sizeof(header));
+	zmq::message_t bitmap(bitmap_.size());
+	std::memcpy(bitmap.data(), bitmap_.data(), bitmap_.size());
+	zmq::message_t tiles(tiles_.size());
+	std::memcpy(tiles.data(), tiles_.data(), tiles_.size());
+
+	try {
+		sock_.send(topic, ZMQ_SNDMORE);
+		sock_.send(head, ZMQ_SNDMORE);
+		sock_.send(bitmap, ZMQ_SNDMORE);
+		sock_.send(tiles);
+	} catch (const zmq::error_t &err) {
+		std::cout << "ZMQ publish error: " << err.what() << "\n";
+	}
+}
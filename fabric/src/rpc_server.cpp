@@ -0,0 +1,430 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#include "dharc/rpc_server.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <type_traits>
+#include <utility>
+
+#include "dharc/fabric.hpp"
+
+using dharc::rpc::Command;
+using dharc::rpc::Lane;
+using dharc::rpc::LaneCounters;
+using dharc::rpc::Server;
+using std::vector;
+using std::chrono::steady_clock;
+
+constexpr size_t Server::kDefaultWorkers;
+constexpr size_t Server::kMaxQueue;
+constexpr size_t Server::kMaxMonitorQueue;
+constexpr double Server::kDefaultMonitorRate;
+constexpr double Server::kMonitorBurst;
+constexpr size_t Server::kMaxSessions;
+
+namespace {
+/* Longest the server waits before checking whether to stop, milliseconds */
+constexpr long kPollInterval = 100;
+
+LaneCounters counters[static_cast<int>(Lane::end)];
+
+/* First command of a request, or of a batch, or Command::end if none. */
+Command command(const zmq::message_t &body) {
+	const uint8_t *data = static_cast<const uint8_t*>(body.data());
+	int cmd = -1;
+	if (body.size() < sizeof(cmd)) return Command::end;
+	std::memcpy(&cmd, data, sizeof(cmd));
+
+	if (cmd == static_cast<int>(Command::batch)) {
+		cmd = -1;
+		if (body.size() < sizeof(cmd) + sizeof(uint32_t) + sizeof(cmd)) {
+			return Command::end;
+		}
+		std::memcpy(&cmd, data + sizeof(cmd) + sizeof(uint32_t), sizeof(cmd));
+	}
+
+	if (cmd < 0 || cmd >= static_cast<int>(Command::end)) return Command::end;
+	return static_cast<Command>(cmd);
+}
+
+/* Packed size of arguments that are all numbers, or -1 if any are not. */
+template <typename... A>
+struct ArgBytes {
+	static constexpr long value = 0;
+};
+
+template <typename T, typename... A>
+struct ArgBytes<T, A...> {
+	static constexpr long rest = ArgBytes<A...>::value;
+	static constexpr long value = (std::is_arithmetic<T>::value && rest >= 0) ?
+		static_cast<long>(sizeof(T)) + rest : -1;
+};
+
+template <typename F>
+struct CommandBytes;
+
+template <typename R, typename... A>
+struct CommandBytes<R(*)(A...)> {
+	static constexpr long value =
+		ArgBytes<typename std::decay<A>::type...>::value;
+};
+
+template <size_t... I>
+constexpr std::array<long, sizeof...(I)> makeBytes(std::index_sequence<I...>) {
+	return {{ CommandBytes<typename std::tuple_element<I,
+		dharc::rpc::commands_t>::type>::value... }};
+}
+
+/* Bytes of the arguments of each command, where they are of fixed size. */
+constexpr auto kArgBytes = makeBytes(
+	std::make_index_sequence<static_cast<size_t>(Command::end)>());
+
+constexpr bool fixedIfDroppable() {
+	for (auto i = 0; i < static_cast<int>(Command::end); ++i) {
+		const Command c = static_cast<Command>(i);
+		if (dharc::rpc::droppable(c) && kArgBytes[i] < 0) return false;
+	}
+	return true;
+}
+
+static_assert(fixedIfDroppable(),
+	"Droppable commands need arguments of fixed size to skip them in batches");
+
+/*
+ * Can a request be turned away, see rpc::droppable. A batch can only if
+ * every command in it can, and as those have arguments of fixed size each
+ * is found without unpacking the one before.
+ */
+bool mayDrop(const zmq::message_t &body) {
+	const Command first = command(body);
+	if (!dharc::rpc::droppable(first)) return false;
+	if (first == Command::end) return true;
+
+	const uint8_t *data = static_cast<const uint8_t*>(body.data());
+	int cmd = -1;
+	uint32_t count = 0;
+	std::memcpy(&cmd, data, sizeof(cmd));
+	if (cmd != static_cast<int>(Command::batch)) return true;
+	std::memcpy(&count, data + sizeof(cmd), sizeof(count));
+
+	// Whatever is unreadable fails the rest of the batch, so may be dropped.
+	size_t at = sizeof(cmd) + sizeof(count);
+	for (auto i = 0U; i < count && at + sizeof(cmd) <= body.size(); ++i) {
+		std::memcpy(&cmd, data + at, sizeof(cmd));
+		if (cmd < 0 || cmd >= static_cast<int>(Command::end)) return true;
+		if (!dharc::rpc::droppable(static_cast<Command>(cmd))) return false;
+		at += sizeof(cmd) + kArgBytes[cmd];
+	}
+	return true;
+}
+
+void noLinger(zmq::socket_t &sock) {
+	int linger = 0;
+	sock.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+}
+
+/* Send a frame, retrying if interrupted. False if it could not be sent. */
+bool sendFrame(zmq::socket_t &sock, zmq::message_t &msg, bool more) {
+	while (true) {
+		try {
+			sock.send(msg, (more) ? ZMQ_SNDMORE : 0);
+			return true;
+		} catch (const zmq::error_t &err) {
+			if (err.num() != EINTR) {
+				std::cout << "ZMQ send error: " << err.what() << "\n";
+				return false;
+			}
+		}
+	}
+}
+
+/* Receive every frame of a message, retrying if interrupted. */
+bool recvAll(zmq::socket_t &sock, vector<zmq::message_t> &msg) {
+	do {
+		msg.emplace_back();
+		while (true) {
+			try {
+				sock.recv(&msg.back());
+				break;
+			} catch (const zmq::error_t &err) {
+				if (err.num() != EINTR) return false;
+			}
+		}
+	} while (msg.back().more());
+	return true;
+}
+};  // namespace
+
+
+
+LaneCounters &dharc::rpc::laneCounters(Lane lane) {
+	return counters[static_cast<int>(lane)];
+}
+
+
+
+Server::Server(Fabric &fabric, zmq::context_t &context, size_t workers)
+	: fabric_(fabric), context_(context), frontend_(context, ZMQ_ROUTER),
+		replies_(context, ZMQ_PULL), running_(true),
+		rate_(kDefaultMonitorRate), tokens_(kMonitorBurst),
+		refilled_(steady_clock::now()), received_(0) {
+	std::ostringstream addr;
+	addr << "inproc://dharc-replies-" << static_cast<const void*>(this);
+	replyaddr_ = addr.str();
+
+	noLinger(frontend_);
+	noLinger(replies_);
+	replies_.bind(replyaddr_);
+
+	if (workers == 0) workers = 1;
+	for (auto i = 0U; i < workers; ++i) {
+		threads_.emplace_back(&Server::worker, this);
+	}
+}
+
+
+
+Server::~Server() {
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		running_ = false;
+	}
+	wake_.notify_all();
+
+	for (auto &t : threads_) t.join();
+}
+
+
+
+void Server::bind(const std::string &endpoint) {
+	frontend_.bind(endpoint);
+}
+
+
+
+void Server::setMonitorRate(double rate) {
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		rate_ = (rate > 0.0) ? rate : 0.0;
+	}
+	wake_.notify_all();
+}
+
+
+
+void Server::run(const volatile std::sig_atomic_t &stop) {
+	zmq::pollitem_t items[] = {
+		{ replies_, 0, ZMQ_POLLIN, 0 },
+		{ frontend_, 0, ZMQ_POLLIN, 0 }
+	};
+
+	while (!stop) {
+		// When the sensor queue is full, new requests wait in the socket
+		// instead. Others are turned away when full, so never block this.
+		bool full;
+		{
+			std::lock_guard<std::mutex> lk(lock_);
+			full = queue(Lane::sense).size() >= kMaxQueue;
+		}
+
+		try {
+			zmq::poll(&items[0], (full) ? 1 : 2, kPollInterval);
+		} catch (const zmq::error_t &ex) {
+			continue;
+		}
+
+		if (items[0].revents & ZMQ_POLLIN) reply();
+		if (!full && (items[1].revents & ZMQ_POLLIN)) receive();
+	}
+}
+
+
+
+void Server::receive() {
+	Job job;
+	if (!recvAll(frontend_, job.msg)) return;
+
+	// The envelope is the peer's identity then any frames up to and including
+	// an empty delimiter, which REQ and well behaved DEALER clients send.
+	job.body = 0;
+	for (auto i = 1U; i < job.msg.size(); ++i) {
+		if (job.msg[i].size() == 0) {
+			job.body = i + 1;
+			break;
+		}
+	}
+	if (job.body == 0) return;
+
+	job.client.assign(static_cast<const char*>(job.msg[0].data()),
+		job.msg[0].size());
+	const bool hasbody = job.body < job.msg.size();
+	const Command cmd = hasbody ? command(job.msg[job.body]) : Command::end;
+	const bool drop = !hasbody || mayDrop(job.msg[job.body]);
+	job.lane = dharc::rpc::lane(cmd);
+	job.received = steady_clock::now();
+	job.deferred = false;
+	++laneCounters(job.lane).requests;
+
+	bool full;
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		const size_t queued = queue(Lane::monitor).size();
+		full = job.lane == Lane::monitor && (queued >= kMaxQueue ||
+			(queued >= kMaxMonitorQueue && drop));
+	}
+	if (full) {
+		++laneCounters(job.lane).rejected;
+		reject(job.msg, job.body);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		if (sessions_.size() >= kMaxSessions) {
+			for (auto it = sessions_.begin(); it != sessions_.end();) {
+				if (busy_.count(it->first) == 0) {
+					it = sessions_.erase(it);
+				} else {
+					++it;
+				}
+			}
+		}
+		job.seq = ++received_;
+		queue(job.lane).push_back(std::move(job));
+	}
+	wake_.notify_one();
+}
+
+
+
+void Server::reject(vector<zmq::message_t> &msg, size_t body) {
+	for (auto i = 0U; i < body; ++i) {
+		if (!sendFrame(frontend_, msg[i], true)) return;
+	}
+	zmq::message_t empty;
+	sendFrame(frontend_, empty, false);
+}
+
+
+
+void Server::reply() {
+	vector<zmq::message_t> msg;
+	if (!recvAll(replies_, msg)) return;
+
+	for (auto i = 0U; i < msg.size(); ++i) {
+		if (!sendFrame(frontend_, msg[i], i + 1 < msg.size())) return;
+	}
+}
+
+
+
+std::deque<Server::Job>::iterator Server::next(Lane lane) {
+	// Oldest request from a client that has none in progress, nor an older
+	// one waiting in another lane.
+	auto &q = queue(lane);
+	return std::find_if(q.begin(), q.end(), [this, lane](const Job &job) {
+		return busy_.count(job.client) == 0 && !waitingBefore(job, lane);
+	});
+}
+
+
+
+bool Server::waitingBefore(const Job &job, Lane lane) {
+	for (auto l = 0; l < static_cast<int>(Lane::end); ++l) {
+		if (l == static_cast<int>(lane)) continue;
+		// Queues are in the order received, so only the front can be older.
+		for (auto &other : queues_[l]) {
+			if (other.seq > job.seq) break;
+			if (other.client == job.client) return true;
+		}
+	}
+	return false;
+}
+
+
+
+bool Server::takeToken(steady_clock::time_point now) {
+	if (rate_ == 0.0) return true;
+
+	const double elapsed =
+		std::chrono::duration<double>(now - refilled_).count();
+	tokens_ = std::min(kMonitorBurst, tokens_ + elapsed * rate_);
+	refilled_ = now;
+	if (tokens_ < 1.0) return false;
+	tokens_ -= 1.0;
+	return true;
+}
+
+
+
+void Server::worker() {
+	zmq::socket_t out(context_, ZMQ_PUSH);
+	noLinger(out);
+	out.connect(replyaddr_.c_str());
+
+	vector<zmq::message_t> req;
+	vector<zmq::message_t> rep;
+	std::unique_lock<std::mutex> lk(lock_);
+
+	while (running_) {
+		Lane lane = Lane::sense;
+		auto it = next(lane);
+		if (it == queue(lane).end()) {
+			lane = Lane::monitor;
+			it = next(lane);
+			if (it == queue(lane).end()) {
+				wake_.wait(lk);
+				continue;
+			}
+
+			const auto now = steady_clock::now();
+			if (!takeToken(now)) {
+				if (!it->deferred) {
+					it->deferred = true;
+					++laneCounters(lane).deferred;
+				}
+				// Until the next token, or sooner for a sensor request.
+				wake_.wait_until(lk, now + std::chrono::duration_cast<
+					steady_clock::duration>(std::chrono::duration<double>(
+						(1.0 - tokens_) / rate_)));
+				continue;
+			}
+		}
+
+		Job job = std::move(*it);
+		queue(lane).erase(it);
+		laneCounters(lane).queueing.record(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(
+				steady_clock::now() - job.received).count());
+		busy_.insert(job.client);
+		// Only erased while its client is not busy, so safe to use unlocked.
+		Session &session = sessions_[job.client];
+		lk.unlock();
+
+		req.clear();
+		for (auto i = job.body; i < job.msg.size(); ++i) {
+			req.push_back(std::move(job.msg[i]));
+		}
+		process_msg(fabric_, session, req, rep);
+
+		bool sent = true;
+		for (auto i = 0U; sent && i < job.body; ++i) {
+			sent = sendFrame(out, job.msg[i], true);
+		}
+		for (auto i = 0U; sent && i < rep.size(); ++i) {
+			sent = sendFrame(out, rep[i], i + 1 < rep.size());
+		}
+
+		lk.lock();
+		busy_.erase(job.client);
+		// The client may have another request waiting.
+		wake_.notify_all();
+	}
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#include "dharc/scheduler.hpp"
+
+#include <vector>
+#include <mutex>
+#include <cstdlib>
+
+using dharc::fabric::Scheduler;
+using dharc::fabric::Region;
+using std::vector;
+using std::chrono::nanoseconds;
+using std::chrono::duration_cast;
+
+
+
+void Scheduler::add(RegionID regid, int priority) {
+	std::lock_guard<std::mutex> lk(lock_);
+
+	std::unique_ptr<Entry> e(new Entry());
+	e->period = period_;
+	e->priority = priority;
+	e->release = clock::now();
+	e->lastlate = nanoseconds(0);
+	e->ticks = 0;
+	e->missed = 0;
+	e->skipped = 0;
+	e->jitter = 0.0f;
+	e->running = false;
+	e->generation = ++generation_;
+
+	entries_[regid] = std::move(e);
+}
+
+
+
+void Scheduler::remove(RegionID regid) {
+	std::lock_guard<std::mutex> lk(lock_);
+	entries_.erase(regid);
+}
+
+
+
+bool Scheduler::setSchedule(RegionID regid, nanoseconds period, int priority) {
+	if (period.count() <= 0) return false;
+
+	std::lock_guard<std::mutex> lk(lock_);
+	auto it = entries_.find(regid);
+	if (it == entries_.end()) return false;
+
+	it->second->period = period;
+	it->second->priority = priority;
+	return true;
+}
+
+
+
+void Scheduler::setPeriod(nanoseconds period) {
+	if (period.count() <= 0) return;
+
+	std::lock_guard<std::mutex> lk(lock_);
+	period_ = period;
+	for (auto &i : entries_) {
+		i.second->period = period;
+	}
+}
+
+
+
+bool Scheduler::runNext(const Registry::Guard &regions, bool periodic,
+		size_t &units, uint64_t &helpercpu) {
+	Entry *best = nullptr;
+	RegionID bestid = RegionID::INVALID;
+	uint64_t generation = 0;
+	clock::time_point release;
+
+	{
+		std::lock_guard<std::mutex> lk(lock_);
+		const auto now = clock::now();
+
+		for (auto &i : entries_) {
+			Entry &e = *i.second;
+			const Region *region = regions.get(i.first);
+			if (region == nullptr || e.running) continue;
+
+			if (periodic) {
+				if (e.release > now) continue;
+			} else {
+				if (!region->hasInput()) continue;
+				e.release = region->inputTime();
+			}
+
+			if (best == nullptr || e.priority > best->priority ||
+					(e.priority == best->priority &&
+					e.release + e.period < best->release + best->period)) {
+				best = &e;
+				bestid = i.first;
+			}
+		}
+
+		if (best == nullptr) return false;
+		release = best->release;
+		generation = best->generation;
+		best->running = true;
+	}
+
+	Region *region = regions.get(bestid);
+	const uint64_t helpers = region->helperCpu();
+	const auto start = clock::now();
+	units = region->process();
+	const auto finish = clock::now();
+	helpercpu = region->helperCpu() - helpers;
+
+	// The entry may have been removed while processing, and even replaced
+	// by one for a new region given the same id.
+	std::lock_guard<std::mutex> lk(lock_);
+	auto it = entries_.find(bestid);
+	if (it != entries_.end() && it->second->generation == generation) {
+		it->second->running = false;
+		complete(*it->second, release, start, finish, periodic);
+	}
+	return true;
+}
+
+
+
+void Scheduler::complete(Entry &e, clock::time_point release,
+		clock::time_point start, clock::time_point finish, bool periodic) {
+	nanoseconds late = duration_cast<nanoseconds>(start - release);
+	if (late.count() < 0) late = nanoseconds(0);
+
+	// Interarrival jitter estimate as in RFC 3550.
+	const float d = std::abs(static_cast<float>((late - e.lastlate).count()));
+	e.jitter += (d - e.jitter) / 16.0f;
+	e.lastlate = late;
+
+	e.late.record(late.count());
+	++e.ticks;
+	if (finish > release + e.period) ++e.missed;
+
+	if (periodic) {
+		e.release = release + e.period;
+
+		// Overran by whole periods, so skip them rather than run back to back.
+		if (e.release < finish) {
+			const auto n = (finish - e.release) / e.period;
+			e.skipped += n;
+			e.release += n * e.period;
+		}
+	}
+}
+
+
+
+Scheduler::clock::time_point Scheduler::nextRelease() {
+	std::lock_guard<std::mutex> lk(lock_);
+	auto next = clock::now() + std::chrono::milliseconds(100);
+
+	for (auto &i : entries_) {
+		if (i.second->running) continue;
+		if (i.second->release < next) next = i.second->release;
+	}
+	return next;
+}
+
+
+
+TickStats Scheduler::stats(RegionID regid) {
+	std::lock_guard<std::mutex> lk(lock_);
+	auto it = entries_.find(regid);
+	if (it == entries_.end()) return TickStats{0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+	const Entry &e = *it->second;
+	TickStats res;
+	res.ticks = e.ticks;
+	res.missed = e.missed;
+	res.skipped = e.skipped;
+	res.period = static_cast<uint32_t>(e.period.count() / 1000);
+	res.priority = e.priority;
+	res.jitter = e.jitter / 1000.0f;
+	res.meanlate = static_cast<float>(e.late.mean() / 1000.0);
+	res.p50late = static_cast<float>(e.late.percentile(0.5)) / 1000.0f;
+	res.p99late = static_cast<float>(e.late.percentile(0.99)) / 1000.0f;
+	res.maxlate = static_cast<float>(e.late.max()) / 1000.0f;
+	return res;
+}
+
+
+
+vector<uint64_t> Scheduler::lateness(RegionID regid) {
+	std::lock_guard<std::mutex> lk(lock_);
+	auto it = entries_.find(regid);
+	if (it == entries_.end()) return vector<uint64_t>();
+
+	return it->second->late.buckets();
+}
@@ -0,0 +1,285 @@
+#include "lest.hpp"
+#include "dharc/fabric.hpp"
+#include "dharc/pool.hpp"
+#include "dharc/checkpoint.hpp"
+
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+using dharc::fabric::CheckpointHeader;
+using dharc::Fabric;
+using dharc::RegionID;
+using dharc::fabric::Pool;
+using std::vector;
+
+namespace {
+bool waitFor(Fabric &f, RegionID regid, uint64_t ticks) {
+	for (auto i = 0U; i < 500; ++i) {
+		if (f.tickStats(regid).ticks >= ticks) return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+	return false;
+}
+};
+
+const lest::test specification[] = {
+
+CASE( "Stopped fabric does not process until started" ) {
+	Fabric f;
+	RegionID r = f.create2D(40, 40, 8, 8);
+	f.write2D(r, vector<uint8_t>(40 * 40, 10));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT( f.tickStats(r).ticks == 0U );
+
+	f.start();
+	EXPECT( waitFor(f, r, 1) );
+
+	f.stop();
+	const auto ticks = f.tickStats(r).ticks;
+	f.write2D(r, vector<uint8_t>(40 * 40, 20));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT( f.tickStats(r).ticks == ticks );
+
+	f.start();
+	EXPECT( waitFor(f, r, ticks + 1) );
+},
+
+CASE( "Fabrics sharing a pool are all processed" ) {
+	Pool pool(2);
+	Fabric a(&pool);
+	Fabric b(&pool);
+	RegionID ra = a.create2D(40, 40, 8, 8);
+	RegionID rb = b.create2D(40, 40, 8, 8);
+	a.start();
+	b.start();
+
+	for (auto i = 0U; i < 5; ++i) {
+		a.write2D(ra, vector<uint8_t>(40 * 40, i * 10));
+		b.write2D(rb, vector<uint8_t>(40 * 40, i * 20));
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	EXPECT( waitFor(a, ra, 1) );
+	EXPECT( waitFor(b, rb, 1) );
+
+	// Destroying one leaves the other running.
+	a.stop();
+	const auto ticks = b.tickStats(rb).ticks;
+	b.write2D(rb, vector<uint8_t>(40 * 40, 99));
+	EXPECT( waitFor(b, rb, ticks + 1) );
+},
+
+CASE( "Frames can be written and reformed through caller buffers" ) {
+	Fabric f;
+	RegionID r = f.create2D(40, 40, 8, 8);
+	f.start();
+
+	uint8_t frame[40 * 40];
+	for (auto i = 0U; i < sizeof(frame); ++i) frame[i] = i % 256;
+	EXPECT( f.write2D(r, frame, sizeof(frame)).result ==
+		dharc::WriteResult::accepted );
+	EXPECT( f.write2D(r, frame, 10).result == dharc::WriteResult::rejected );
+	EXPECT( waitFor(f, r, 1) );
+
+	uint8_t out[40 * 40];
+	EXPECT( f.reform2D(r, out, sizeof(out)) == sizeof(out) );
+	EXPECT( f.reform2D(r, out, 10) == 0U );
+	EXPECT( vector<uint8_t>(out, out + sizeof(out)) == f.reform2D(r, 5, 5) );
+},
+
+CASE( "Reform gives smaller outputs and pyramids on request" ) {
+	Fabric f;
+	RegionID r = f.create2D(40, 40, 8, 8);
+	f.start();
+	vector<uint8_t> frame(40 * 40, 100);
+	f.write2D(r, frame);
+	EXPECT( waitFor(f, r, 1) );
+
+	EXPECT( f.reform2D(r, 5, 5).size() == 40U * 40U );
+	EXPECT( f.reform2D(r, 1, 1).size() == 8U * 8U );
+	EXPECT( f.reform2D(r, 2, 3).size() == 16U * 24U );
+	EXPECT( f.reform2D(r, size_t(0), 1).empty() );
+	EXPECT( f.reform2D(r, 6, 5).empty() );
+	EXPECT( f.reform2D(RegionID::INVALID, 1, 1).empty() );
+
+	const auto levels = f.pyramid2D(r, 4);
+	EXPECT( levels.size() == 4U );
+	EXPECT( levels[0].size() == 40U * 40U );
+	EXPECT( levels[1].size() == 20U * 20U );
+	EXPECT( levels[3].size() == 5U * 5U );
+	EXPECT( f.pyramid2D(r, 100).size() == 6U );  // Down to 1 by 1.
+	EXPECT( f.pyramid2D(r, 0).empty() );
+},
+
+CASE( "CPU spent polling between frames is counted per frame" ) {
+	Fabric waiting;
+	Fabric polling;
+	RegionID rw = waiting.create2D(40, 40, 8, 8);
+	RegionID rp = polling.create2D(40, 40, 8, 8);
+	polling.setPolicy(Fabric::Policy::poll);
+	waiting.start();
+	polling.start();
+
+	waiting.write2D(rw, vector<uint8_t>(40 * 40, 100));
+	polling.write2D(rp, vector<uint8_t>(40 * 40, 100));
+	EXPECT( waitFor(waiting, rw, 1) );
+	EXPECT( waitFor(polling, rp, 1) );
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	// Polling spins for the whole wait, waiting sleeps through it.
+	EXPECT( polling.cpuPerFrame() > 10000.0f );
+	EXPECT( waiting.cpuPerFrame() < polling.cpuPerFrame() );
+},
+
+CASE( "Regions too large to allocate are refused" ) {
+	Fabric f;
+	const size_t huge = size_t(1) << 33;
+	EXPECT( f.create2D(320, 240, 1, 1) == RegionID::INVALID );  // Links.
+	EXPECT( f.create2D(huge, huge, 1024, 1024) == RegionID::INVALID );
+	EXPECT( f.create2D(65536, 4, 65536, 4) == RegionID::INVALID );  // Units.
+
+	RegionID r = f.create2D(40, 40, 8, 8);
+	EXPECT( r != RegionID::INVALID );
+	EXPECT( !f.resize2D(r, 320, 240, 1, 1) );
+	EXPECT( f.resize2D(r, 80, 80, 16, 16) );
+	EXPECT( f.destroy(r) );
+	EXPECT( !f.destroy(r) );
+},
+
+CASE( "Checkpoints restore over live regions or as new ones" ) {
+	const std::string path = "pool_test.ckp";
+	Fabric f;
+	RegionID r = f.create2D(40, 40, 8, 8);
+	EXPECT( f.save(r, path) );
+
+	// Only ids handed out by create can be restored into.
+	EXPECT( f.restore(RegionID(5), path) == RegionID::INVALID );
+	EXPECT( f.restore(r, path) == r );
+
+	RegionID n = f.restore(RegionID::INVALID, path);
+	EXPECT( static_cast<size_t>(n) == static_cast<size_t>(r) + 1 );
+	f.start();
+	f.write2D(n, vector<uint8_t>(40 * 40, 100));
+	EXPECT( waitFor(f, n, 1) );
+	std::remove(path.c_str());
+},
+
+CASE( "Checkpoints with impossible headers are not restored" ) {
+	const std::string path = "pool_test_bad.ckp";
+	Fabric f;
+	RegionID r = f.create2D(40, 40, 8, 8);
+	EXPECT( f.save(r, path) );
+
+	CheckpointHeader hdr;
+	std::FILE *file = std::fopen(path.c_str(), "r+b");
+	EXPECT( std::fread(&hdr, sizeof(hdr), 1, file) == 1U );
+
+	// Larger than create2D would allow.
+	CheckpointHeader huge = hdr;
+	huge.width = huge.height = size_t(1) << 20;
+	huge.unitsx = huge.unitsy = 1;
+	std::rewind(file);
+	std::fwrite(&huge, sizeof(huge), 1, file);
+	std::fflush(file);
+	EXPECT( f.restore(RegionID::INVALID, path) == RegionID::INVALID );
+
+	// Records that only fit the file once the size wraps around.
+	CheckpointHeader wrap = hdr;
+	wrap.bytes = ~uint64_t(0) - wrap.offset + 2;
+	std::rewind(file);
+	std::fwrite(&wrap, sizeof(wrap), 1, file);
+	std::fclose(file);
+	EXPECT( f.restore(RegionID::INVALID, path) == RegionID::INVALID );
+	std::remove(path.c_str());
+},
+
+CASE( "Step returns the output of the pass over its frame" ) {
+	Fabric f;
+	RegionID r = f.create2D(40, 40, 8, 8);
+	f.setIngest(r, dharc::Ingest::lockstep, 1);
+	vector<uint8_t> frame(40 * 40, 100);
+
+	// Not processed while stopped, so waiting times out.
+	EXPECT( f.step2D(r, frame.data(), frame.size(), 5, 5,
+		std::chrono::milliseconds(20)).empty() );
+
+	f.start();
+	vector<uint8_t> out = f.step2D(r, frame.data(), frame.size(), 5, 5,
+		std::chrono::milliseconds(500));
+	EXPECT( out.size() == frame.size() );
+	EXPECT( f.tickStats(r).ticks >= 1U );
+	EXPECT( f.step2D(r, frame.data(), 10, 5, 5,
+		std::chrono::milliseconds(0)).empty() );
+
+	// Smaller units give the output reform2D would, as they are taken.
+	out = f.step2D(r, frame.data(), frame.size(), 2, 3,
+		std::chrono::milliseconds(500));
+	EXPECT( out.size() == 16U * 24U );
+	EXPECT( out == f.reform2D(r, 2, 3) );
+	EXPECT( f.step2D(r, frame.data(), frame.size(), 6, 5,
+		std::chrono::milliseconds(0)).empty() );
+	EXPECT( f.step2D(r, frame.data(), frame.size(), 0, 5,
+		std::chrono::milliseconds(0)).empty() );
+	EXPECT( f.step2D(r, frame.data(), frame.size(), 1, 1,
+		std::chrono::milliseconds(500)).size() == 8U * 8U );
+
+	// A step waiting on its pass does not hold up destroying the region.
+	f.stop();
+	std::thread step([&f, r, &frame]() {
+		f.step2D(r, frame.data(), frame.size(), 5, 5,
+			std::chrono::milliseconds(800));
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	const auto start = std::chrono::steady_clock::now();
+	EXPECT( f.destroy(r) );
+	const auto took = std::chrono::steady_clock::now() - start;
+	EXPECT( took < std::chrono::milliseconds(400) );
+	step.join();
+},
+
+CASE( "Frames can be written through a shared memory ring" ) {
+	const std::string name = "/dharc-pool-test-" + std::to_string(getpid());
+	Fabric f;
+	RegionID r = f.create2D(40, 40, 8, 8);
+	std::unique_ptr<dharc::ShmRing> ring(
+		dharc::ShmRing::create(name, 2, 40 * 40));
+	EXPECT( f.attachShm(r, name) );
+	EXPECT( !f.attachShm(RegionID(99), name) );
+
+	const vector<uint8_t> frame(40 * 40, 77);
+	const uint64_t seq = ring->write(frame.data(), frame.size());
+	EXPECT( f.writeShm(r, seq).result == dharc::WriteResult::accepted );
+	EXPECT( f.writeShm(r, seq + 1).result == dharc::WriteResult::rejected );
+	EXPECT( f.ingestStats(r).pending == 1U );
+
+	// Stepping with a frame from the ring gives the output of its pass.
+	f.start();
+	const uint64_t next = ring->write(frame.data(), frame.size());
+	EXPECT( f.stepShm(r, next, 5, 5, std::chrono::milliseconds(500)).size() ==
+		frame.size() );
+	EXPECT( f.stepShm(r, next + 1, 5, 5,
+		std::chrono::milliseconds(0)).empty() );
+	const uint64_t small = ring->write(frame.data(), frame.size());
+	EXPECT( f.stepShm(r, small, 1, 1, std::chrono::milliseconds(500)).size() ==
+		8U * 8U );
+	f.stop();
+
+	EXPECT( f.detachShm(r) );
+	EXPECT( f.writeShm(r, seq).result == dharc::WriteResult::rejected );
+
+	// Destroying the region drops its ring, so a new region with its id
+	// does not read another sense's frames.
+	EXPECT( f.attachShm(r, name) );
+	EXPECT( f.destroy(r) );
+	EXPECT( f.create2D(40, 40, 8, 8) == r );
+	EXPECT( !f.detachShm(r) );
+}
+};
+
+int main(int argc, char *argv[]) {
+	return lest::run(specification, argc, argv);
+}
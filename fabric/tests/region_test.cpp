@@ -0,0 +1,224 @@
+#include "lest.hpp"
+#include "dharc/region.hpp"
+
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+using dharc::fabric::Region;
+using std::vector;
+
+const lest::test specification[] = {
+
+CASE( "Unbudgeted pass processes every unit" ) {
+	Region region(40, 40, 8, 8);
+	region.write(vector<uint8_t>(40 * 40, 128));
+	region.process();
+
+	auto cov = region.coverage();
+	EXPECT( cov.pass == 1U );
+	EXPECT( cov.units == 64U );
+	EXPECT( cov.processed == 64U );
+	EXPECT( cov.deferred == 0U );
+},
+
+CASE( "Budgeted pass defers units and eventually reaches all" ) {
+	Region region(40, 40, 8, 8);
+	region.setBudget(std::chrono::microseconds(1));
+	region.write(vector<uint8_t>(40 * 40, 200));
+	region.process();
+
+	auto cov = region.coverage();
+	EXPECT( (cov.processed + cov.deferred) == cov.units );
+	EXPECT( cov.processed >= 1U );
+	EXPECT( cov.deferred > 0U );
+
+	// A unit never processed would be as old as the number of passes, so
+	// once the oldest is younger than that every unit has been reached.
+	for (auto i = 0U; i < 100000 && cov.maxage >= cov.pass; ++i) {
+		region.process();
+		cov = region.coverage();
+	}
+	EXPECT( cov.maxage < cov.pass );
+	EXPECT( region.budget().count() == 1 );
+},
+
+CASE( "Latest ingest coalesces unprocessed frames" ) {
+	Region region(40, 40, 8, 8);
+	auto s1 = region.write(vector<uint8_t>(40 * 40, 10));
+	auto s2 = region.write(vector<uint8_t>(40 * 40, 20));
+	EXPECT( s1.result == dharc::WriteResult::accepted );
+	EXPECT( s2.result == dharc::WriteResult::coalesced );
+	EXPECT( s2.pending == 1U );
+
+	region.process();
+	region.process();
+	auto stats = region.ingestStats();
+	EXPECT( stats.accepted == 2U );
+	EXPECT( stats.coalesced == 1U );
+	EXPECT( stats.reprocessed == 1U );
+	EXPECT( !region.hasInput() );
+},
+
+CASE( "Queue ingest drops frames beyond its depth" ) {
+	Region region(40, 40, 8, 8);
+	region.setIngest(dharc::Ingest::queue, 2);
+	region.write(vector<uint8_t>(40 * 40, 10));
+	region.write(vector<uint8_t>(40 * 40, 20));
+	auto s3 = region.write(vector<uint8_t>(40 * 40, 30));
+	EXPECT( s3.result == dharc::WriteResult::dropped );
+
+	EXPECT( region.process() == 64U );
+	EXPECT( region.process() == 64U );
+	auto stats = region.ingestStats();
+	EXPECT( stats.dropped == 1U );
+	EXPECT( stats.pending == 0U );
+	EXPECT( stats.reprocessed == 0U );
+},
+
+CASE( "Lockstep ingest never reprocesses a frame" ) {
+	Region region(40, 40, 8, 8);
+	region.setIngest(dharc::Ingest::lockstep, 1);
+	region.write(vector<uint8_t>(40 * 40, 10));
+	EXPECT( region.process() == 64U );
+	EXPECT( region.process() == 0U );
+	EXPECT( region.ingestStats().reprocessed == 0U );
+},
+
+CASE( "Delta frame matches writing the whole frame" ) {
+	Region whole(40, 40, 8, 8);
+	Region delta(40, 40, 8, 8);
+	vector<uint8_t> frame(40 * 40, 10);
+	vector<uint8_t> bitmap(8, 0);
+	vector<uint8_t> tiles(5 * 5, 200);
+
+	// Nothing to be relative to yet.
+	EXPECT( delta.writeDelta(1, bitmap.data(), bitmap.size(), nullptr, 0).result
+		== dharc::WriteResult::rejected );
+
+	whole.write(frame);
+	auto s = delta.write(frame);
+	whole.process();
+	delta.process();
+
+	// Change unit 9, the second of the second row of units.
+	for (auto y = 5U; y < 10U; ++y) {
+		for (auto x = 5U; x < 10U; ++x) frame[y * 40 + x] = 200;
+	}
+	bitmap[1] = 0x02;
+	whole.write(frame);
+	EXPECT( delta.writeDelta(s.seq + 1, bitmap.data(), bitmap.size(),
+		tiles.data(), tiles.size()).result == dharc::WriteResult::rejected );
+	EXPECT( delta.writeDelta(s.seq, bitmap.data(), bitmap.size(),
+		tiles.data(), tiles.size() - 1).result == dharc::WriteResult::rejected );
+	EXPECT( delta.writeDelta(s.seq, bitmap.data(), bitmap.size(),
+		tiles.data(), tiles.size()).result == dharc::WriteResult::accepted );
+	whole.process();
+	delta.process();
+
+	vector<uint8_t> a;
+	vector<uint8_t> b;
+	whole.reform(a);
+	delta.reform(b);
+	EXPECT( a == b );
+},
+
+CASE( "Output hook gets every pass's output until removed" ) {
+	Region region(40, 40, 8, 8);
+	uint64_t epoch = 0;
+	vector<uint8_t> out;
+	region.setOutputHook([&](uint64_t e, const vector<uint8_t> &o) {
+		epoch = e;
+		out = o;
+	});
+
+	region.write(vector<uint8_t>(40 * 40, 100));
+	region.process();
+	region.process();
+	EXPECT( epoch == 2U );
+
+	vector<uint8_t> reformed;
+	region.reform(reformed);
+	EXPECT( out == reformed );
+
+	region.setOutputHook(nullptr);
+	region.process();
+	EXPECT( epoch == 2U );
+},
+
+CASE( "Restored checkpoint reforms like the saved region" ) {
+	const std::string path = "region_test.ckp";
+	Region region(40, 40, 8, 8);
+	for (auto i = 0U; i < 5; ++i) {
+		vector<uint8_t> frame(40 * 40);
+		for (auto j = 0U; j < frame.size(); ++j) frame[j] = (j * 7 + i * 31) % 256;
+		region.write(frame);
+		region.process();
+	}
+	EXPECT( region.save(path) );
+
+	std::unique_ptr<Region> restored(Region::restore(path));
+	EXPECT( restored != nullptr );
+	EXPECT( restored->width() == 40U );
+	EXPECT( restored->unitsY() == 8U );
+
+	vector<uint8_t> a, b;
+	region.reform(a);
+	restored->reform(b);
+	EXPECT( a == b );
+	std::remove(path.c_str());
+},
+
+CASE( "Background snapshot captures the region as it was when started" ) {
+	const std::string path = "region_test.snap";
+	Region region(40, 40, 8, 8);
+	vector<uint8_t> frame(40 * 40);
+	for (auto j = 0U; j < frame.size(); ++j) frame[j] = (j * 13) % 256;
+	region.write(frame);
+	region.process();
+
+	vector<uint8_t> before;
+	region.reform(before);
+
+	// Slow enough that later passes change units before they are written.
+	EXPECT( region.snapshot(path, 2000000) );
+	EXPECT( !region.snapshot(path, 0) );
+	for (auto i = 0U; i < 5; ++i) {
+		for (auto j = 0U; j < frame.size(); ++j) frame[j] = (j * 3 + i * 71) % 256;
+		region.write(frame);
+		region.process();
+	}
+	while (region.snapshotStats().active) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	auto stats = region.snapshotStats();
+	EXPECT( stats.snapshots == 1U );
+	EXPECT( stats.copied > 0U );
+
+	std::unique_ptr<Region> restored(Region::restore(path));
+	EXPECT( restored != nullptr );
+
+	vector<uint8_t> after;
+	restored->reform(after);
+	EXPECT( before == after );
+	std::remove(path.c_str());
+},
+
+CASE( "Restore rejects missing and corrupt checkpoints" ) {
+	const std::string path = "region_test.bad";
+	EXPECT( Region::restore(path) == nullptr );
+
+	std::FILE *f = std::fopen(path.c_str(), "wb");
+	std::fputs("not a checkpoint", f);
+	std::fclose(f);
+	EXPECT( Region::restore(path) == nullptr );
+	std::remove(path.c_str());
+}
+};
+
+int main(int argc, char *argv[]) {
+	return lest::run(specification, argc, argv);
+}
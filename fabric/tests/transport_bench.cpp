@@ -0,0 +1,92 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+/*
+ * Round trip latency of RPC over each kind of endpoint, to a fabric served
+ * from this process. Usage: transport-bench [<requests>] [<io threads>]
+ */
+
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dharc/fabric.hpp"
+#include "dharc/histogram.hpp"
+#include "dharc/rpc.hpp"
+#include "dharc/rpc_server.hpp"
+
+using dharc::Fabric;
+using dharc::Histogram;
+using dharc::RegionID;
+using std::cout;
+using std::string;
+using std::vector;
+using std::chrono::steady_clock;
+
+namespace {
+volatile std::sig_atomic_t stop = 0;
+
+class Client : public dharc::Rpc {
+	public:
+	explicit Client(const string &endpoint) : Rpc(endpoint) {}
+
+	int version() { return send<Command::version>(); }
+
+	dharc::WriteStatus write(const vector<uint8_t> &frame) {
+		return send<Command::write2d>(
+			static_cast<size_t>(RegionID::SENSE_CAMERA_0_LUMINANCE),
+			dharc::rpc::View<uint8_t>(frame), size_t(5), size_t(5));
+	}
+};
+
+template<typename F>
+void measure(const char *name, size_t requests, F f) {
+	Histogram h;
+	for (auto i = 0U; i < requests; ++i) {
+		const auto start = steady_clock::now();
+		f();
+		h.record(std::chrono::duration_cast<std::chrono::microseconds>(
+			steady_clock::now() - start).count());
+	}
+	cout << "  " << name << ": " << h.percentile(0.5) << "us p50, ";
+	cout << h.percentile(0.99) << "us p99, " << h.mean() << "us mean\n";
+}
+};  // namespace
+
+
+
+int main(int argc, char *argv[]) {
+	const size_t requests = (argc > 1) ? std::stoul(argv[1]) : 10000;
+	if (argc > 2) dharc::rpc::setIoThreads(std::stoi(argv[2]));
+
+	// Not started, so that passes do not compete with the transport.
+	Fabric fabric;
+	fabric.create2D(320, 240, 64, 48);  // SENSE_CAMERA_0_LUMINANCE
+
+	const vector<string> endpoints = {
+		"tcp://127.0.0.1:7880",
+		"ipc:///tmp/dharc-bench.ipc",
+		"inproc://dharc-bench"
+	};
+
+	dharc::rpc::Server server(fabric, dharc::rpc::context(), 1);
+	server.setMonitorRate(0);  // Version is in the rate limited lane.
+	for (auto &e : endpoints) server.bind(e);
+	std::thread serving([&server]() { server.run(stop); });
+
+	const vector<uint8_t> frame(320 * 240, 128);
+	for (auto &e : endpoints) {
+		Client client(e);
+		cout << e << "\n";
+		measure("version", requests, [&client]() { client.version(); });
+		measure("write2d", requests / 10, [&]() { client.write(frame); });
+	}
+
+	stop = 1;
+	serving.join();
+	return 0;
+}
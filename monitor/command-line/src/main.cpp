@@ -14,6 +14,7 @@
 #include <algorithm>
 #include "dharc/node.hpp"
 #include "dharc/monitor.hpp"
+#include "dharc/output_stream.hpp"
 #include "dharc/labels.hpp"
 
 
@@ -34,6 +35,7 @@ struct {
 	int no_labels;
 	int stats;
 	int changes;
+	int watch;
 	vector<Node> params;
 } config {
 	0,
@@ -41,6 +43,7 @@ struct {
 	0,
 	0,
 	0,
+	0,
 	{}
 };
 
@@ -58,6 +61,7 @@ option opts[] = {
 	{"set", 1, nullptr, 1001},
 	{"stats", 1, nullptr, 1002},
 	{"log", 1, nullptr, 1003},
+	{"watch", 1, nullptr, 1004},
 	{"interactive", 0, &config.interactive, 1},
 	{"port", 1, nullptr, 'p'},
 	{"host", 1, nullptr, 'h'},
@@ -71,9 +75,70 @@ const char *helpmsg =
 "usage: dharc-arch [-i | --interactive] [--noinfo] [--param=<node>]\n"
 "                  [-h <host> | --host=<host>] [-p <port> | --port=<port>]\n"
 "                  [-f <file> | --file=<file>] [--nolabels] [--help]\n"
+"                  [--watch=<messages>]\n"
 "\n"
 ;
 
+
+
+/* Statistics of the camera region and of the fabric's RPC. */
+void printStats(dharc::Monitor &monitor) {
+	const auto regid = dharc::RegionID::SENSE_CAMERA_0_LUMINANCE;
+	const dharc::Monitor::Stats stats = monitor.stats(regid);
+	const dharc::Metrics &m = stats.metrics;
+
+	cout << "Processed (s): " << (stats.procps / 1000.0f);
+	cout << "K/s" << std::endl;
+	cout << "CPU per frame: " << stats.framecpu << "us" << std::endl;
+	cout << "Units (s): " << (m.unitsps / 1000.0f) << "K/s" << std::endl;
+	cout << "Links (s): " << (m.linksps / 1000000.0f) << "M/s" << std::endl;
+	cout << "Learning (s): " << (m.learnsps / 1000000.0f);
+	cout << "M/s" << std::endl;
+	cout << "Write latency: " << m.writep50 << "us p50, ";
+	cout << m.writep99 << "us p99" << std::endl;
+	cout << "Process latency: " << m.processp50 << "us p50, ";
+	cout << m.processp99 << "us p99" << std::endl;
+	cout << "Reform latency: " << m.reformp50 << "us p50, ";
+	cout << m.reformp99 << "us p99" << std::endl;
+
+	const dharc::rpc::CompressStats c = monitor.compressStats();
+	if (c.arrays > 0) {
+		cout << "Compression: " << (100.0f * c.packedbytes / c.rawbytes);
+		cout << "% of " << (c.rawbytes / 1000000.0f) << "MB, ";
+		cout << (c.compressns / 1000 / c.arrays) << "us each";
+		cout << std::endl;
+	}
+	if (c.inflated > 0) {
+		cout << "Decompression: " << (c.inflatedbytes / 1000000.0f);
+		cout << "MB, " << (c.inflatens / 1000 / c.inflated) << "us each";
+		cout << std::endl;
+	}
+
+	const auto cmds = monitor.commandStats();
+	for (auto i = 0U; i < cmds.size(); ++i) {
+		const dharc::rpc::CommandStats &s = cmds[i];
+		if (s.calls == 0 && s.rejected == 0) continue;
+		const bool known = i < static_cast<size_t>(dharc::rpc::Command::end);
+		cout << "RPC " << ((known) ? dharc::rpc::kCommandNames[i] :
+			"unreadable") << ": ";
+		cout << s.calls << " calls, " << s.rejected << " rejected, ";
+		cout << (s.bytesin / 1000) << "KB in, " << (s.bytesout / 1000);
+		cout << "KB out, " << s.p50 << "ns p50, " << s.p99 << "ns p99";
+		cout << std::endl;
+	}
+
+	const char *lanes[] = {"sense", "monitor"};
+	const auto queued = monitor.laneStats();
+	for (auto i = 0U; i < queued.size() &&
+			i < static_cast<size_t>(dharc::rpc::Lane::end); ++i) {
+		const dharc::rpc::LaneStats &l = queued[i];
+		cout << "Queue " << lanes[i] << ": " << l.requests << " requests, ";
+		cout << l.deferred << " rate limited, " << l.rejected << " rejected, ";
+		cout << l.p50 << "ns p50, " << l.p99 << "ns p99, " << l.max;
+		cout << "ns max" << std::endl;
+	}
+}
+
 };  // namespace
 
 
@@ -98,6 +163,7 @@ int main(int argc, char *argv[]) {
 		case 1001: delayed.push_back({0, string(optarg)}); break;
 		case 1002: if (string(optarg) == "all") config.stats = 0xFFFF; break;
 		case 1003: config.changes = stoi(string(optarg)); break;
+		case 1004: config.watch = stoi(string(optarg)); break;
 		case ':': cout << "Option '" << optopt << "' requires an argument\n";
 					break;
 		default: break;
@@ -108,14 +174,37 @@ int main(int argc, char *argv[]) {
 
 
 	if (config.stats == 0xFFFF) {
-		cout << "Harc Count: " << monitor.harcCount() << std::endl;
-		cout << "Branch Count: " << monitor.branchCount() << std::endl;
-		cout << "Follows (s): " << (monitor.followsPerSecond() / 1000000.0f);
-		cout << "M/s" << std::endl;
-		cout << "Activations (s): " << (monitor.activationsPerSecond() / 1000000.0f);
-		cout << "M/s" << std::endl;
-		cout << "Processed (s): " << (monitor.processedPerSecond() / 1000000.0f);
-		cout << "M/s" << std::endl;
+		try {
+			printStats(monitor);
+		} catch (const std::runtime_error &err) {
+			cout << "Could not get statistics: " << err.what() << std::endl;
+			return -1;
+		}
+	}
+
+
+	// Watch output deltas for a number of passes to see what they save.
+	if (config.watch > 0) {
+		const auto regid = dharc::RegionID::SENSE_CAMERA_0_LUMINANCE;
+		dharc::OutputStream outputs(host, port + 1);
+		outputs.subscribe(regid, dharc::rpc::Stream::deltas);
+
+		size_t whole = 0;
+		int passes = 0;
+		for (auto i = 0; i < config.watch; ++i) {
+			dharc::RegionID id;
+			uint64_t epoch;
+			const vector<uint8_t> *out = outputs.next(id, epoch, 1000);
+			if (out == nullptr) continue;
+			whole += out->size();
+			++passes;
+		}
+
+		if (whole > 0) {
+			cout << "Output deltas: " << (100.0f * outputs.received() / whole);
+			cout << "% of whole outputs over " << passes << " messages, ";
+			cout << outputs.resyncs() << " resyncs" << std::endl;
+		}
 	}
 
 
@@ -12,6 +12,7 @@
 #include "dharc/node.hpp"
 #include "dharc/rpc.hpp"
 #include "dharc/tail.hpp"
+#include "dharc/regions.hpp"
 
 using std::vector;
 using std::list;
@@ -22,12 +23,30 @@ class Monitor : public dharc::Rpc {
 	Monitor(const char *host, int port);
 	~Monitor();
 
-	size_t harcCount();
-	size_t branchCount();
-	size_t followCount();
-	float followsPerSecond();
-	float activationsPerSecond();
 	float processedPerSecond();
+	float cpuPerFrame();
+
+	dharc::Metrics metrics(dharc::RegionID regid);
+	dharc::Coverage coverage(dharc::RegionID regid);
+	dharc::TickStats tickStats(dharc::RegionID regid);
+
+	/**
+	 * Statistics polled together by the monitors.
+	 */
+	struct Stats {
+		float procps;
+		float framecpu;
+		dharc::Metrics metrics;
+		dharc::Coverage coverage;
+		dharc::TickStats ticks;
+	};
+
+	/**
+	 * Fetch all of Stats in one batched round trip.
+	 * @throw std::runtime_error if the fabric turned the request away, as it
+	 *        may when monitors poll faster than it allows.
+	 */
+	Stats stats(dharc::RegionID regid);
 
 	/* Statistics functions */
 	/* Stream functions */
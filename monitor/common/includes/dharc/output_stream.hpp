@@ -0,0 +1,75 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#ifndef DHARC_OUTPUT_STREAM_HPP_
+#define DHARC_OUTPUT_STREAM_HPP_
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "zmq.hpp"
+#include "dharc/regions.hpp"
+#include "dharc/rpc_outputs.hpp"
+#include "dharc/tiles.hpp"
+
+using std::vector;
+
+namespace dharc {
+/**
+ * Watch the outputs of regions as the fabric publishes them after each pass,
+ * either whole or as the tiles that changed. Deltas are applied here, so both
+ * give whole outputs, and a gap in the deltas is resynced automatically.
+ */
+class OutputStream {
+	public:
+	/**
+	 * Deltas that cannot be used, while waiting for a whole output, before
+	 * asking for one again in case the one asked for was lost.
+	 */
+	static constexpr size_t kResyncAfter = 30;
+
+	OutputStream(const char *host, int port);
+
+	OutputStream(const OutputStream&) = delete;
+	OutputStream &operator=(const OutputStream&) = delete;
+
+	void subscribe(RegionID regid, rpc::Stream stream);
+	void unsubscribe(RegionID regid, rpc::Stream stream);
+
+	/**
+	 * Wait for the next message of any region subscribed to.
+	 * @param timeout Longest to wait, in milliseconds.
+	 * @return The region's output, valid until the next call, or nullptr if
+	 *         nothing came in time or the message could not be used.
+	 */
+	const vector<uint8_t> *next(RegionID &regid, uint64_t &epoch,
+		long timeout);
+
+	/** Bytes received, for comparing the streams. */
+	size_t received() const { return received_; }
+
+	/** Times a gap in the deltas of a region had to be resynced. */
+	size_t resyncs() const { return resyncs_; }
+
+	private:
+	struct Image {
+		uint64_t epoch;  // 0 while waiting for a whole one.
+		size_t skipped;  // Deltas unused since asking for a whole one.
+		TileGrid grid;
+		vector<uint8_t> data;
+	};
+
+	void resync(RegionID regid);
+	const vector<uint8_t> *applyDelta(RegionID regid, uint64_t &epoch,
+		const vector<zmq::message_t> &parts);
+
+	zmq::socket_t sock_;
+	std::map<std::pair<rpc::Stream, RegionID>, Image> images_;
+	size_t received_;
+	size_t resyncs_;
+};
+};  // namespace dharc
+
+#endif  // DHARC_OUTPUT_STREAM_HPP_
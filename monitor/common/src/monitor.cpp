@@ -32,34 +32,45 @@ Monitor::~Monitor() {
 }
 
 
-size_t Monitor::harcCount() {
-	return send<Command::harccount>();
+float Monitor::processedPerSecond() {
+	return send<Command::procps>();
 }
 
 
 
-size_t Monitor::branchCount() {
-	return send<Command::branchcount>();
+float Monitor::cpuPerFrame() {
+	return send<Command::framecpu>();
 }
 
 
-size_t Monitor::followCount() {
-	return send<Command::followcount>();
+
+dharc::Metrics Monitor::metrics(dharc::RegionID regid) {
+	return send<Command::metrics2d>(static_cast<size_t>(regid));
 }
 
 
-float Monitor::followsPerSecond() {
-	return send<Command::followps>();
+
+dharc::Coverage Monitor::coverage(dharc::RegionID regid) {
+	return send<Command::coverage2d>(static_cast<size_t>(regid));
 }
 
 
 
-float Monitor::activationsPerSecond() {
-	return send<Command::activeps>();
+dharc::TickStats Monitor::tickStats(dharc::RegionID regid) {
+	return send<Command::ticks2d>(static_cast<size_t>(regid));
 }
 
-float Monitor::processedPerSecond() {
-	return send<Command::procps>();
-}
 
 
+Monitor::Stats Monitor::stats(dharc::RegionID regid) {
+	Stats res;
+	const size_t id = static_cast<size_t>(regid);
+	dharc::rpc::Batch batch;
+	batch.add<Command::procps>(res.procps)
+		.add<Command::framecpu>(res.framecpu)
+		.add<Command::metrics2d>(res.metrics, id)
+		.add<Command::coverage2d>(res.coverage, id)
+		.add<Command::ticks2d>(res.ticks, id);
+	send(batch);
+	return res;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2015 Nicolas Pope
+ */
+
+#include "dharc/output_stream.hpp"
+
+#include <string>
+#include <cstring>
+
+using dharc::OutputStream;
+using dharc::RegionID;
+using dharc::TileGrid;
+using dharc::rpc::DeltaHeader;
+using dharc::rpc::Stream;
+using std::vector;
+
+namespace {
+zmq::context_t &context() {
+	static zmq::context_t ctx(1);
+	return ctx;
+}
+};  // namespace
+
+
+
+OutputStream::OutputStream(const char *host, int port)
+	: sock_(context(), ZMQ_SUB), received_(0), resyncs_(0) {
+	std::string uri = "tcp://";
+	uri += host;
+	uri += ':';
+	uri += std::to_string(port);
+
+	int linger = 0;
+	sock_.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+	sock_.connect(uri.c_str());
+}
+
+
+
+void OutputStream::subscribe(RegionID regid, Stream stream) {
+	uint8_t topic[rpc::kTopicBytes];
+	rpc::makeTopic(topic, stream, regid);
+	sock_.setsockopt(ZMQ_SUBSCRIBE, topic, sizeof(topic));
+	images_[{stream, regid}] = Image{0, 0, TileGrid{0, 0, 0, 0}, {}};
+}
+
+
+
+void OutputStream::unsubscribe(RegionID regid, Stream stream) {
+	uint8_t topic[rpc::kTopicBytes];
+	rpc::makeTopic(topic, stream, regid);
+	sock_.setsockopt(ZMQ_UNSUBSCRIBE, topic, sizeof(topic));
+	images_.erase({stream, regid});
+}
+
+
+
+void OutputStream::resync(RegionID regid) {
+	// The publisher takes a repeated subscription as asking for a whole one.
+	unsubscribe(regid, Stream::deltas);
+	subscribe(regid, Stream::deltas);
+	++resyncs_;
+}
+
+
+
+const vector<uint8_t> *OutputStream::next(RegionID &regid, uint64_t &epoch,
+		long timeout) {
+	zmq::pollitem_t item = { sock_, 0, ZMQ_POLLIN, 0 };
+	if (zmq::poll(&item, 1, timeout) <= 0) return nullptr;
+
+	vector<zmq::message_t> parts;
+	do {
+		parts.emplace_back();
+		sock_.recv(&parts.back());
+		received_ += parts.back().size();
+	} while (parts.back().more());
+
+	if (parts[0].size() != rpc::kTopicBytes) return nullptr;
+	Stream stream;
+	rpc::parseTopic(static_cast<const uint8_t*>(parts[0].data()), stream,
+		regid);
+
+	if (stream == Stream::deltas) return applyDelta(regid, epoch, parts);
+
+	auto it = images_.find({stream, regid});
+	if (it == images_.end() || parts.size() != 3 ||
+			parts[1].size() != sizeof(epoch)) {
+		return nullptr;
+	}
+	std::memcpy(&epoch, parts[1].data(), sizeof(epoch));
+	const uint8_t *data = static_cast<const uint8_t*>(parts[2].data());
+	it->second.data.assign(data, data + parts[2].size());
+	it->second.epoch = epoch;
+	return &it->second.data;
+}
+
+
+
+const vector<uint8_t> *OutputStream::applyDelta(RegionID regid,
+		uint64_t &epoch, const vector<zmq::message_t> &parts) {
+	auto it = images_.find({Stream::deltas, regid});
+	if (it == images_.end()) return nullptr;
+	Image &image = it->second;
+
+	DeltaHeader header;
+	if (parts.size() != 4 || parts[1].size() != sizeof(header)) return nullptr;
+	std::memcpy(&header, parts[1].data(), sizeof(header));
+	const TileGrid grid{header.width, header.height, header.tilew,
+		header.tileh};
+	const uint8_t *bitmap = static_cast<const uint8_t*>(parts[2].data());
+	const uint8_t *tiles = static_cast<const uint8_t*>(parts[3].data());
+	if (!grid.valid(bitmap, parts[2].size(), parts[3].size())) return nullptr;
+
+	if (header.base == 0) {
+		image.grid = grid;
+		image.data.resize(grid.width * grid.height);
+	} else if (header.base != image.epoch || image.grid != grid) {
+		// Missed one, or still waiting for the whole one asked for. That
+		// can be dropped too, if the publisher's queue was full, so ask again
+		// if it is long in coming.
+		if (image.epoch != 0 || ++image.skipped >= kResyncAfter) {
+			resync(regid);
+		}
+		return nullptr;
+	}
+
+	grid.apply(image.data.data(), bitmap, tiles);
+	image.epoch = header.epoch;
+	epoch = header.epoch;
+	return &image.data;
+}
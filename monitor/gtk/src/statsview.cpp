@@ -28,34 +28,34 @@ StatsView::StatsView(Gtk::TreeView *widget, dharc::Monitor &mon) :
 	tree_->set_model(store_);
 
 	sigc::connection stat_conn = Glib::signal_timeout().connect([&]() {
-		int harccount = mon_.harcCount();
-		int branchcount = mon_.branchCount();
-		float bfactor = static_cast<float>(branchcount) /
-						static_cast<float>(harccount);
-		int followcount = mon_.followCount();
-		float ffactor = static_cast<float>(followcount) /
-						static_cast<float>(harccount);
-		float actives = mon_.activationsPerSecond() / 1000.0f;
-		float processed = mon_.processedPerSecond() / 1000.0f;
-		float follows = mon_.followsPerSecond() / 1000.0f;
+		dharc::Monitor::Stats stats;
+		try {
+			stats = mon_.stats(dharc::RegionID::SENSE_CAMERA_0_LUMINANCE);
+		} catch (const std::runtime_error &err) {
+			// Turned away, so keep showing the last and try again next time.
+			return true;
+		}
+		const dharc::Metrics &m = stats.metrics;
+		float processed = stats.procps / 1000.0f;
+		float framecpu = stats.framecpu;
 
 		char buffer[100];
-		sprintf(buffer, "%d", harccount);
-		stats_[kHarcCount][cols_.value] = buffer;
-		sprintf(buffer, "%d", branchcount);
-		stats_[kBranchCount][cols_.value] = buffer;		
-		sprintf(buffer, "%.4f", bfactor);
-		stats_[kBranchFactor][cols_.value] = buffer;
-		sprintf(buffer, "%d", followcount);
-		stats_[kFollowCount][cols_.value] = buffer;		
-		sprintf(buffer, "%.4f", ffactor);
-		stats_[kFollowFactor][cols_.value] = buffer;
-		sprintf(buffer, "%.2f", actives);
-		stats_[kActivations][cols_.value] = buffer;
+		sprintf(buffer, "%.2f", m.unitsps / 1000.0f);
+		stats_[kUnits][cols_.value] = buffer;
+		sprintf(buffer, "%.2f", m.linksps / 1000000.0f);
+		stats_[kLinks][cols_.value] = buffer;
+		sprintf(buffer, "%.2f", m.learnsps / 1000000.0f);
+		stats_[kLearns][cols_.value] = buffer;
 		sprintf(buffer, "%.2f", processed);
 		stats_[kProcessed][cols_.value] = buffer;
-		sprintf(buffer, "%.2f", follows);
-		stats_[kFollows][cols_.value] = buffer;
+		sprintf(buffer, "%.1f", framecpu);
+		stats_[kFrameCpu][cols_.value] = buffer;
+		sprintf(buffer, "%.1f / %.1f", m.writep50, m.writep99);
+		stats_[kWriteLatency][cols_.value] = buffer;
+		sprintf(buffer, "%.1f / %.1f", m.processp50, m.processp99);
+		stats_[kProcessLatency][cols_.value] = buffer;
+		sprintf(buffer, "%.1f / %.1f", m.reformp50, m.reformp99);
+		stats_[kReformLatency][cols_.value] = buffer;
 		return true;
 	}, 100);
 }	
@@ -66,30 +66,29 @@ StatsView::~StatsView() {
 
 void StatsView::makeTree() {
 	auto title = store_->append();
-	(*title)[cols_.name] = "Scale Statistics";
-	stats_[kHarcCount] = *store_->append(title->children());
-	stats_[kBranchCount] = *store_->append(title->children());
-	stats_[kBranchFactor] = *store_->append(title->children());
-	stats_[kFollowCount] = *store_->append(title->children());
-	stats_[kFollowFactor] = *store_->append(title->children());
+	(*title)[cols_.name] = "Work Statistics";
+	stats_[kUnits] = *store_->append(title->children());
+	stats_[kLinks] = *store_->append(title->children());
+	stats_[kLearns] = *store_->append(title->children());
+	stats_[kProcessed] = *store_->append(title->children());
 	title = store_->append();
 	(*title)[cols_.name] = "Performance Statistics";
-	stats_[kActivations] = *store_->append(title->children());
-	stats_[kProcessed] = *store_->append(title->children());
-	stats_[kFollows] = *store_->append(title->children());
+	stats_[kFrameCpu] = *store_->append(title->children());
+	stats_[kWriteLatency] = *store_->append(title->children());
+	stats_[kProcessLatency] = *store_->append(title->children());
+	stats_[kReformLatency] = *store_->append(title->children());
 }
 
 
 
 void StatsView::setLabels() {
-	stats_[kHarcCount][cols_.name]    = "Number of Harcs";
-	stats_[kBranchCount][cols_.name]  = "Number of Branches";
-	stats_[kBranchFactor][cols_.name] = "Branch Factor";
-	stats_[kFollowCount][cols_.name]  = "Number of Queries";
-	stats_[kFollowFactor][cols_.name] = "Query Factor";
-	stats_[kActivations][cols_.name]  = "Activations (Kps)";
-	stats_[kProcessed][cols_.name]    = "Processed (Kps)";
-	stats_[kFollows][cols_.name]      = "Harc Follows (Kps)";
+	stats_[kUnits][cols_.name]          = "Units (Kps)";
+	stats_[kLinks][cols_.name]          = "Links (Mps)";
+	stats_[kLearns][cols_.name]         = "Learning (Mps)";
+	stats_[kProcessed][cols_.name]      = "Processed (Kps)";
+	stats_[kFrameCpu][cols_.name]       = "CPU per Frame (us)";
+	stats_[kWriteLatency][cols_.name]   = "Write p50/p99 (us)";
+	stats_[kProcessLatency][cols_.name] = "Process p50/p99 (us)";
+	stats_[kReformLatency][cols_.name]  = "Reform p50/p99 (us)";
 }
 
-
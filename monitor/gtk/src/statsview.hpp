@@ -23,14 +23,14 @@ class StatsColumns : public Gtk::TreeModel::ColumnRecord {
 
 
 enum Statistic {
-	kHarcCount,
-	kBranchCount,
-	kBranchFactor,
-	kFollowCount,
-	kFollowFactor,
-	kActivations,
+	kUnits,
+	kLinks,
+	kLearns,
 	kProcessed,
-	kFollows,
+	kFrameCpu,
+	kWriteLatency,
+	kProcessLatency,
+	kReformLatency,
 	kStatEnd
 };
 
@@ -272,7 +272,8 @@ int sdl_filter(const SDL_Event * event)
 
 
 int main(int argc, char *argv[]) {
-	Sense sense("localhost", 7878);
+	// The fabric's endpoint, such as ipc:///tmp/dharc.ipc when on this box.
+	Sense sense(std::string((argc > 1) ? argv[1] : "tcp://localhost:7878"));
 
 	atexit(SDL_Quit);
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
@@ -336,8 +337,6 @@ int main(int argc, char *argv[]) {
 
 		read_frame();
 
-		vector<uint8_t> rdata = sense.reform2D(RegionID::SENSE_CAMERA_0_LUMINANCE, 5, 5);
-
 		for (auto i = 0U; i < data.size(); ++i) {
 			int y = *((unsigned char*)buffers[0].start + (2*i));
 
@@ -353,7 +352,9 @@ int main(int argc, char *argv[]) {
 			//	buffer_sdl[i*3 + 1] = data[i] * 2;
 			//}
 		}
-		sense.write2D(RegionID::SENSE_CAMERA_0_LUMINANCE, ldata, 5, 5);
+		// Write the frame and get the output back in one round trip.
+		vector<uint8_t> rdata = sense.step2D(RegionID::SENSE_CAMERA_0_LUMINANCE, ldata, 5, 5, 0);
+		if (rdata.empty()) rdata = sense.reform2D(RegionID::SENSE_CAMERA_0_LUMINANCE, 5, 5);
 
 		assert(rdata.size() == 320 * 240);
 
@@ -5,8 +5,15 @@
 #ifndef DHARC_SENSE_HPP_
 #define DHARC_SENSE_HPP_
 
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+
 #include "dharc/rpc.hpp"
 #include "dharc/regions.hpp"
+#include "dharc/shm_ring.hpp"
+#include "dharc/tiles.hpp"
 
 using dharc::RegionID;
 
@@ -15,14 +22,138 @@ namespace dharc {
 class Sense : public dharc::Rpc {
 	public:
 	Sense(const char *addr, int port);
+
+	/**
+	 * Connect to the fabric at any endpoint, see Rpc. Frames go through
+	 * shared memory for ipc, inproc and loopback tcp endpoints.
+	 */
+	explicit Sense(const std::string &endpoint);
+
 	~Sense();
 
-	void write2D(
+	/**
+	 * Frame slots in each shared memory ring.
+	 */
+	static constexpr size_t kShmSlots = 4;
+
+	/**
+	 * Send a frame. The reply says whether the fabric accepted, coalesced or
+	 * dropped it and suggests how long to back off before the next one.
+	 * When the fabric is on this host the frame goes through a shared memory
+	 * ring and only its sequence number is sent, otherwise (or if the ring
+	 * is full) it is sent whole or as a delta, see setDelta2D.
+	 */
+	dharc::WriteStatus write2D(
+		RegionID regid,
+		const vector<uint8_t> &values,
+		size_t uw, size_t uh);
+
+	/**
+	 * Have write2D send only the units of a frame that changed since the
+	 * last one the fabric accepted, with a whole frame every so often in
+	 * case the fabric lost track. Units must be the region's own.
+	 * @param width Width of the frames in pixels, 0 to send whole frames.
+	 * @param keyframe Deltas to send between whole frames.
+	 */
+	void setDelta2D(RegionID regid, size_t width, size_t keyframe);
+
+	/**
+	 * Send a frame without waiting for the reply, so the next frame can be
+	 * captured while this one is on its way. The frame is copied and always
+	 * sent whole. The server handles a sense's requests one at a time, so
+	 * sending several before their replies does not make them overlap.
+	 */
+	std::future<dharc::WriteStatus> write2DAsync(
 		RegionID regid,
 		const vector<uint8_t> &values,
 		size_t uw, size_t uh);
 
+	/**
+	 * Get the output of a region with its units uw by uh pixels, so the
+	 * region's own unit size for full resolution and less for a smaller
+	 * image, down to 1 by 1 for a value per unit.
+	 */
 	vector<uint8_t> reform2D(RegionID regid, size_t uw, size_t uh);
+
+	/**
+	 * Get the output of a region at full resolution and then each level
+	 * of half the size down, see Fabric::pyramid2D.
+	 */
+	vector<vector<uint8_t>> pyramid2D(RegionID regid, size_t levels);
+
+	std::future<vector<uint8_t>> reform2DAsync(RegionID regid,
+		size_t uw, size_t uh);
+
+	/**
+	 * Send a frame and get the reformed output back in one round trip. The
+	 * frame goes through shared memory as for write2D when it can. With
+	 * deltas on and no wait it is sent as a delta and the output fetched
+	 * after, a second round trip but far fewer bytes; with a wait it is sent
+	 * whole, as a delta has no way to wait for its pass.
+	 * @param wait Microseconds to wait for the process pass over this frame,
+	 *        0 for the current output without waiting.
+	 * @return The output, or empty if the frame was not accepted or the pass
+	 *         did not complete in time.
+	 */
+	vector<uint8_t> step2D(RegionID regid, const vector<uint8_t> &values,
+		size_t uw, size_t uh, size_t wait);
+
+	/**
+	 * Reform into an existing vector, which is only reallocated if too small.
+	 */
+	void reform2D(RegionID regid, size_t uw, size_t uh, vector<uint8_t> &out);
+
+	/**
+	 * Ask the fabric for a new region to write into.
+	 * @return The new region's id or RegionID::INVALID on failure.
+	 */
+	RegionID create2D(size_t width, size_t height,
+		size_t unitsx, size_t unitsy);
+
+	bool resize2D(RegionID regid, size_t width, size_t height,
+		size_t unitsx, size_t unitsy);
+
+	bool destroy2D(RegionID regid);
+
+	/**
+	 * Checkpoint a region to a file on the fabric's machine.
+	 * @param name Bare file name, kept in the fabric's checkpoint directory.
+	 */
+	bool save2D(RegionID regid, const std::string &name);
+
+	/**
+	 * Load a checkpoint into a region, or a new one if regid is INVALID.
+	 * @param name Bare file name, as given to save2D.
+	 * @return The loaded region's id or RegionID::INVALID on failure.
+	 */
+	RegionID load2D(RegionID regid, const std::string &name);
+
+	/**
+	 * Checkpoint a region without pausing it, see snapstats2d for progress.
+	 * @param name Bare file name, as for save2D.
+	 * @param rate Write rate limit in bytes per second, 0 for unlimited.
+	 */
+	bool snapshot2D(RegionID regid, const std::string &name, size_t rate);
+
+	private:
+	/* Frames of a region written as deltas. */
+	struct Delta {
+		size_t width;
+		size_t keyframe;
+		size_t count;          // Deltas since the last whole frame.
+		uint64_t base;         // Fabric's number for ref, 0 if none.
+		vector<uint8_t> ref;   // Last frame the fabric accepted.
+		vector<uint8_t> bitmap;
+		vector<uint8_t> tiles;
+	};
+
+	ShmRing *ring(RegionID regid, size_t size);
+	dharc::WriteStatus writeDelta(Delta &d, RegionID regid,
+		const vector<uint8_t> &values, size_t uw, size_t uh);
+
+	const bool local_;
+	std::map<RegionID, std::unique_ptr<ShmRing>> rings_;  // Null if refused.
+	std::map<RegionID, Delta> deltas_;
 };
 
 };
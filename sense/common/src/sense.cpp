@@ -4,24 +4,224 @@
 
 #include "dharc/sense.hpp"
 
+#include <unistd.h>
+
 #include <vector>
+#include <string>
+#include <cstring>
 
 using std::vector;
 using dharc::Sense;
+using dharc::ShmRing;
 using std::pair;
 
-Sense::Sense(const char *addr, int port) : Rpc(addr, port) {}
+namespace {
+bool isLocal(const std::string &endpoint) {
+	if (endpoint.compare(0, 6, "ipc://") == 0) return true;
+	if (endpoint.compare(0, 9, "inproc://") == 0) return true;
+	for (const char *host : {"tcp://localhost:", "tcp://127.0.0.1:",
+			"tcp://::1:", "tcp://[::1]:"}) {
+		if (endpoint.compare(0, std::strlen(host), host) == 0) return true;
+	}
+	return false;
+}
+};  // namespace
+
+Sense::Sense(const char *addr, int port)
+	: Sense("tcp://" + std::string(addr) + ':' + std::to_string(port)) {
+}
+
+Sense::Sense(const std::string &endpoint)
+	: Rpc(endpoint), local_(isLocal(endpoint)) {
+	// Frames to a remote fabric are worth compressing on most networks.
+	if (!local_) setCompression(rpc::Compression::fast());
+}
 
 Sense::~Sense() {}
 
-void Sense::write2D(
+dharc::WriteStatus Sense::write2D(
+		RegionID regid,
+		const vector<uint8_t> &values,
+		size_t uw, size_t uh) {
+	ShmRing *r = ring(regid, values.size());
+	if (r != nullptr) {
+		const uint64_t seq = r->write(values.data(), values.size());
+		if (seq != 0) {
+			return send<Command::shmwrite2d>(static_cast<size_t>(regid),
+				static_cast<size_t>(seq));
+		}
+	}
+
+	auto it = deltas_.find(regid);
+	if (it != deltas_.end()) return writeDelta(it->second, regid, values, uw, uh);
+
+	return send<Command::write2d>(static_cast<size_t>(regid),
+		rpc::View<uint8_t>(values), uw, uh);
+}
+
+void Sense::setDelta2D(RegionID regid, size_t width, size_t keyframe) {
+	if (width == 0) {
+		deltas_.erase(regid);
+	} else {
+		deltas_[regid] = Delta{width, keyframe, 0, 0, {}, {}, {}};
+	}
+}
+
+dharc::WriteStatus Sense::writeDelta(Delta &d, RegionID regid,
+		const vector<uint8_t> &values, size_t uw, size_t uh) {
+	const TileGrid grid{d.width, values.size() / d.width, uw, uh};
+
+	bool whole = d.base == 0 || d.count >= d.keyframe || grid.count() == 0 ||
+		values.size() != d.ref.size();
+
+	if (!whole) {
+		grid.diff(d.ref.data(), values.data(), 0, d.bitmap, d.tiles);
+		// Past half the frame, a whole one is hardly bigger.
+		whole = d.tiles.size() * 2 > values.size();
+	}
+
+	dharc::WriteStatus status{WriteResult::rejected, 0, 0, 0};
+	if (!whole) {
+		status = send<Command::delta2d>(static_cast<size_t>(regid),
+			static_cast<size_t>(d.base), rpc::View<uint8_t>(d.bitmap),
+			rpc::View<uint8_t>(d.tiles), uw, uh);
+		// Rejected if the fabric no longer has the frame this is relative to.
+		whole = status.result == WriteResult::rejected;
+		++d.count;
+	}
+
+	if (whole) {
+		status = send<Command::write2d>(static_cast<size_t>(regid),
+			rpc::View<uint8_t>(values), uw, uh);
+		d.count = 0;
+		d.base = 0;
+	}
+
+	if (status.result == WriteResult::accepted ||
+			status.result == WriteResult::coalesced) {
+		d.ref = values;
+		d.base = status.seq;
+	}
+	return status;
+}
+
+std::future<dharc::WriteStatus> Sense::write2DAsync(
 		RegionID regid,
 		const vector<uint8_t> &values,
 		size_t uw, size_t uh) {
-	send<Command::write2d>(static_cast<size_t>(regid), values, uw, uh);
+	ShmRing *r = ring(regid, values.size());
+	if (r != nullptr) {
+		const uint64_t seq = r->write(values.data(), values.size());
+		if (seq != 0) {
+			return async<Command::shmwrite2d>(static_cast<size_t>(regid),
+				static_cast<size_t>(seq));
+		}
+	}
+
+	return async<Command::write2d>(static_cast<size_t>(regid),
+		rpc::View<uint8_t>(values), uw, uh);
 }
 
 vector<uint8_t> Sense::reform2D(RegionID regid, size_t uw, size_t uh) {
 	return send<Command::reform2d>(static_cast<size_t>(regid), uw, uh);
 }
 
+vector<uint8_t> Sense::step2D(RegionID regid, const vector<uint8_t> &values,
+		size_t uw, size_t uh, size_t wait) {
+	ShmRing *r = ring(regid, values.size());
+	if (r != nullptr) {
+		const uint64_t seq = r->write(values.data(), values.size());
+		if (seq != 0) {
+			return send<Command::shmstep2d>(static_cast<size_t>(regid),
+				static_cast<size_t>(seq), uw, uh, wait);
+		}
+	}
+
+	auto it = deltas_.find(regid);
+	if (it != deltas_.end()) {
+		if (wait == 0) {
+			const dharc::WriteStatus status =
+				writeDelta(it->second, regid, values, uw, uh);
+			if (status.result == WriteResult::rejected ||
+					status.result == WriteResult::dropped) {
+				return {};
+			}
+			return reform2D(regid, uw, uh);
+		}
+		// The fabric's last frame is about to be one the delta state has not
+		// seen, so start again from a whole frame next time.
+		it->second.base = 0;
+	}
+
+	return send<Command::step2d>(static_cast<size_t>(regid),
+		rpc::View<uint8_t>(values), uw, uh, wait);
+}
+
+vector<vector<uint8_t>> Sense::pyramid2D(RegionID regid, size_t levels) {
+	return send<Command::pyramid2d>(static_cast<size_t>(regid), levels);
+}
+
+std::future<vector<uint8_t>> Sense::reform2DAsync(RegionID regid,
+		size_t uw, size_t uh) {
+	return async<Command::reform2d>(static_cast<size_t>(regid), uw, uh);
+}
+
+void Sense::reform2D(RegionID regid, size_t uw, size_t uh,
+		vector<uint8_t> &out) {
+	sendInto<Command::reform2d>(out, static_cast<size_t>(regid), uw, uh);
+}
+
+
+RegionID Sense::create2D(size_t width, size_t height,
+		size_t unitsx, size_t unitsy) {
+	return static_cast<RegionID>(
+		send<Command::create2d>(width, height, unitsx, unitsy));
+}
+
+bool Sense::resize2D(RegionID regid, size_t width, size_t height,
+		size_t unitsx, size_t unitsy) {
+	return send<Command::resize2d>(static_cast<size_t>(regid),
+		width, height, unitsx, unitsy);
+}
+
+bool Sense::destroy2D(RegionID regid) {
+	return send<Command::destroy2d>(static_cast<size_t>(regid));
+}
+
+bool Sense::save2D(RegionID regid, const std::string &name) {
+	return send<Command::save2d>(static_cast<size_t>(regid), name);
+}
+
+RegionID Sense::load2D(RegionID regid, const std::string &name) {
+	return static_cast<RegionID>(
+		send<Command::load2d>(static_cast<size_t>(regid), name));
+}
+
+bool Sense::snapshot2D(RegionID regid, const std::string &name, size_t rate) {
+	return send<Command::snapshot2d>(static_cast<size_t>(regid), name, rate);
+}
+
+ShmRing *Sense::ring(RegionID regid, size_t size) {
+	if (!local_) return nullptr;
+
+	auto it = rings_.find(regid);
+	if (it != rings_.end()) {
+		// Recreate if the region has grown since.
+		if (!it->second || it->second->slotBytes() >= size) {
+			return it->second.get();
+		}
+		rings_.erase(it);
+	}
+
+	std::unique_ptr<ShmRing> r(ShmRing::create("/dharc-" +
+		std::to_string(getpid()) + "-" +
+		std::to_string(static_cast<size_t>(regid)), kShmSlots, size));
+	if (r && !send<Command::shmattach2d>(static_cast<size_t>(regid),
+			r->name())) {
+		r.reset();
+	}
+
+	ShmRing *res = r.get();
+	rings_[regid] = std::move(r);
+	return res;
+}
@@ -55,8 +55,6 @@ static void unlock(void *data, void *id, void *const *p_pixels)
 {
     ctx *pctx = (ctx*)data;
 
-	vector<uint8_t> rdata = sense->reform2D(RegionID::SENSE_CAMERA_0_LUMINANCE, 5, 5);
-
     /* VLC just rendered the video, but we can also render stuff */
     uint16_t *pixels = (uint16_t*)*p_pixels;
 
@@ -85,7 +83,9 @@ static void unlock(void *data, void *id, void *const *p_pixels)
 		ddata[i] = (std::abs(ldata[i] - delta) & 0xF0) + (ldata[i] >> 4);
 	}*/
 
-	sense->write2D(RegionID::SENSE_CAMERA_0_LUMINANCE, ldata, 5, 5);
+	// Write the frame and get the output back in one round trip.
+	vector<uint8_t> rdata = sense->step2D(RegionID::SENSE_CAMERA_0_LUMINANCE, ldata, 5, 5, 0);
+	if (rdata.empty()) rdata = sense->reform2D(RegionID::SENSE_CAMERA_0_LUMINANCE, 5, 5);
 
 	assert(rdata.size() == 320 * 240);
 
@@ -116,7 +116,8 @@ static void display(void *data, void *id)
 
 int main(int argc, char *argv[])
 {
-	sense = new Sense("localhost", 7878);
+	sense = new Sense(std::string(
+		(argc > 2) ? argv[2] : "tcp://localhost:7878"));
 
 	ddata.resize(320*240);
 	ldata.resize(320*240);
@@ -142,7 +143,7 @@ int main(int argc, char *argv[])
 
     if(argc < 2)
     {
-        printf("Usage: %s <filename>\n", argv[0]);
+        printf("Usage: %s <filename> [<fabric endpoint>]\n", argv[0]);
         return EXIT_FAILURE;
     }
 